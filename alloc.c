@@ -25,12 +25,430 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 
 #include "hugetlbfs.h"
 #include "libhugetlbfs_internal.h"
 
+struct prefault_job;
+
+/*
+ * Registry of regions handed out by get_huge_pages() and
+ * get_hugepage_region(). Each entry is keyed on the pointer returned to
+ * the caller and records the mapping that backs it, so that freeing a
+ * region is a hash lookup and a munmap() rather than a walk of
+ * /proc/self/maps. The table is split into shards, each with its own
+ * lock, so that threads allocating and freeing unrelated regions rarely
+ * contend. Pointers the registry does not know about (for example
+ * because the entry could not be allocated) are still freed by
+ * consulting /proc/self/maps.
+ */
+struct ghp_region {
+	void *ptr;		/* Pointer returned to the caller */
+	void *base;		/* Start of the backing mapping */
+	size_t len;		/* Length of the backing mapping */
+	ghp_t flags;		/* Flags the mapping was created with */
+	int node;		/* Node the mapping was placed on or -1 */
+	int tier;		/* HUGETLB_TIER_* backing the region */
+	long page_size;		/* Largest page size backing the region */
+	struct prefault_job *prefault;	/* GHP_ASYNC_PREFAULT population */
+	struct ghp_region *next;
+};
+
+#define REGION_SHARDS		16
+#define REGION_SHARD_BUCKETS	1024
+
+struct region_shard {
+	pthread_mutex_t lock;
+	struct ghp_region *buckets[REGION_SHARD_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct region_shard region_table[REGION_SHARDS];
+
+static void __attribute__ ((constructor)) region_table_init(void)
+{
+	int i;
+
+	for (i = 0; i < REGION_SHARDS; i++)
+		pthread_mutex_init(&region_table[i].lock, NULL);
+}
+
+static unsigned long region_hash(void *ptr)
+{
+	uint64_t key = (uintptr_t)ptr;
+
+	/* Regions are at least page aligned so mix the upper bits down */
+	key ^= key >> 29;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 32;
+	return (unsigned long)key;
+}
+
+static struct region_shard *region_shard_of(unsigned long hash)
+{
+	return &region_table[hash % REGION_SHARDS];
+}
+
+static struct ghp_region **region_bucket_of(struct region_shard *shard,
+					    unsigned long hash)
+{
+	return &shard->buckets[(hash / REGION_SHARDS) % REGION_SHARD_BUCKETS];
+}
+
+/* Record a new region. Returns the entry, or NULL if it is not tracked */
+static struct ghp_region *region_register(void *ptr, void *base, size_t len,
+					  ghp_t flags, int node, int tier,
+					  long page_size)
+{
+	unsigned long hash = region_hash(ptr);
+	struct region_shard *shard = region_shard_of(hash);
+	struct ghp_region **bucket;
+	struct ghp_region *region;
+
+	region = malloc(sizeof(*region));
+	if (!region) {
+		DEBUG("Unable to track region at %p, free will use "
+			"/proc/self/maps\n", ptr);
+		return NULL;
+	}
+	region->ptr = ptr;
+	region->base = base;
+	region->len = len;
+	region->flags = flags;
+	region->node = node;
+	region->tier = tier;
+	region->page_size = page_size;
+	region->prefault = NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	bucket = region_bucket_of(shard, hash);
+	region->next = *bucket;
+	*bucket = region;
+	pthread_mutex_unlock(&shard->lock);
+	return region;
+}
+
+/*
+ * Remove the region keyed on ptr from the registry. Returns the entry,
+ * which the caller must free, or NULL if the region was not found.
+ */
+static struct ghp_region *region_unregister(void *ptr)
+{
+	unsigned long hash = region_hash(ptr);
+	struct region_shard *shard = region_shard_of(hash);
+	struct ghp_region **pprev;
+	struct ghp_region *region;
+
+	pthread_mutex_lock(&shard->lock);
+	for (pprev = region_bucket_of(shard, hash); (region = *pprev);
+			pprev = &region->next) {
+		if (region->ptr == ptr) {
+			*pprev = region->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return region;
+}
+
+/* Copy the entry of the region keyed on ptr. Returns -1 if not found */
+static int region_lookup(void *ptr, struct ghp_region *entry)
+{
+	unsigned long hash = region_hash(ptr);
+	struct region_shard *shard = region_shard_of(hash);
+	struct ghp_region *region;
+
+	pthread_mutex_lock(&shard->lock);
+	for (region = *region_bucket_of(shard, hash); region;
+			region = region->next) {
+		if (region->ptr == ptr) {
+			*entry = *region;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return region ? 0 : -1;
+}
+
+/*
+ * Cache of freed hugepage mappings, enabled by HUGETLB_REGION_CACHE.
+ * Rather than being unmapped, a freed mapping is kept and handed back to
+ * the next request for the same length and flags, which skips the
+ * mmap(), the prefault and the kernel clearing the pages again. A region
+ * is only reused for a request with the same placement. Each
+ * thread keeps a few mappings on a list of its own so that a thread
+ * reusing the same buffer only touches its own lock; the rest go to a
+ * global list. The total size of both is bounded by HUGETLB_REGION_CACHE,
+ * the oldest global entries being unmapped to make room for new ones,
+ * and the threads' entries once the global list is empty.
+ * Entries are the registry entries of the freed regions.
+ */
+#define REGION_TCACHE_MAX	4
+
+struct region_tcache {
+	pthread_mutex_t lock;
+	struct ghp_region *head;
+	unsigned int count;
+	struct region_tcache *next;
+	struct region_tcache *prev;
+};
+
+static struct {
+	pthread_mutex_t lock;		/* Protects head and caches */
+	struct ghp_region *head;	/* Most recently freed first */
+	struct region_tcache *caches;
+	pthread_key_t key;
+	int key_valid;
+	unsigned long bytes;		/* Cached in all lists */
+} region_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void region_cache_unmap(struct ghp_region *list)
+{
+	struct ghp_region *next;
+
+	for (; list; list = next) {
+		next = list->next;
+		__atomic_sub_fetch(&region_cache.bytes, list->len,
+				   __ATOMIC_RELAXED);
+		munmap(list->base, list->len);
+		free(list);
+	}
+}
+
+/* Thread exit: hand the cached mappings over to the global list */
+static void region_tcache_destroy(void *arg)
+{
+	struct region_tcache *tc = arg;
+	struct ghp_region *region, *next;
+
+	pthread_mutex_lock(&region_cache.lock);
+	pthread_mutex_lock(&tc->lock);
+	for (region = tc->head; region; region = next) {
+		next = region->next;
+		region->next = region_cache.head;
+		region_cache.head = region;
+	}
+	pthread_mutex_unlock(&tc->lock);
+
+	if (tc->prev)
+		tc->prev->next = tc->next;
+	else
+		region_cache.caches = tc->next;
+	if (tc->next)
+		tc->next->prev = tc->prev;
+	pthread_mutex_unlock(&region_cache.lock);
+
+	pthread_mutex_destroy(&tc->lock);
+	free(tc);
+}
+
+static void __attribute__ ((constructor)) region_cache_init(void)
+{
+	if (pthread_key_create(&region_cache.key, region_tcache_destroy) == 0)
+		region_cache.key_valid = 1;
+}
+
+static struct region_tcache *region_tcache(int create)
+{
+	struct region_tcache *tc;
+
+	if (!region_cache.key_valid)
+		return NULL;
+	tc = pthread_getspecific(region_cache.key);
+	if (tc || !create)
+		return tc;
+
+	tc = calloc(1, sizeof(*tc));
+	if (!tc)
+		return NULL;
+	pthread_mutex_init(&tc->lock, NULL);
+	if (pthread_setspecific(region_cache.key, tc) != 0) {
+		free(tc);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&region_cache.lock);
+	tc->next = region_cache.caches;
+	if (tc->next)
+		tc->next->prev = tc;
+	region_cache.caches = tc;
+	pthread_mutex_unlock(&region_cache.lock);
+
+	return tc;
+}
+
+/* Account for len more cached bytes if that stays within the limit */
+static int region_cache_charge(size_t len)
+{
+	if (__atomic_add_fetch(&region_cache.bytes, len, __ATOMIC_RELAXED) <=
+			__hugetlb_opts.region_cache)
+		return 1;
+
+	__atomic_sub_fetch(&region_cache.bytes, len, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Unmap cached entries until len more bytes would fit: the oldest global
+ * entries first, then those of the thread caches if that is not enough.
+ */
+static void region_cache_shrink(size_t len)
+{
+	struct ghp_region **pprev, *victims, *region;
+	struct region_tcache *tc;
+	unsigned long bytes, over, tail = 0;
+
+	pthread_mutex_lock(&region_cache.lock);
+	bytes = __atomic_load_n(&region_cache.bytes, __ATOMIC_RELAXED);
+	over = bytes + len > __hugetlb_opts.region_cache ?
+		bytes + len - __hugetlb_opts.region_cache : 0;
+
+	/* Cut off the shortest tail of the global list that covers over */
+	for (region = region_cache.head; region; region = region->next)
+		tail += region->len;
+	for (pprev = &region_cache.head; *pprev && tail - (*pprev)->len >= over;
+			pprev = &(*pprev)->next)
+		tail -= (*pprev)->len;
+	victims = *pprev;
+	*pprev = NULL;
+	over = tail < over ? over - tail : 0;
+
+	for (tc = region_cache.caches; tc && over; tc = tc->next) {
+		pthread_mutex_lock(&tc->lock);
+		while ((region = tc->head) && over) {
+			tc->head = region->next;
+			tc->count--;
+			region->next = victims;
+			victims = region;
+			over = region->len < over ? over - region->len : 0;
+		}
+		pthread_mutex_unlock(&tc->lock);
+	}
+	pthread_mutex_unlock(&region_cache.lock);
+
+	region_cache_unmap(victims);
+}
+
+static struct ghp_region *region_list_take(struct ghp_region **head,
+					   size_t len, ghp_t flags, int node)
+{
+	struct ghp_region **pprev, *region;
+
+	for (pprev = head; (region = *pprev); pprev = &region->next) {
+		if (region->len == len && region->flags == flags &&
+		    region->node == node) {
+			*pprev = region->next;
+			return region;
+		}
+	}
+
+	return NULL;
+}
+
+/* Find a cached mapping of len bytes created with flags on node */
+static void *region_cache_get(size_t len, ghp_t flags, int node)
+{
+	struct region_tcache *tc = region_tcache(0);
+	struct ghp_region *region = NULL;
+	void *base;
+
+	if (tc) {
+		pthread_mutex_lock(&tc->lock);
+		region = region_list_take(&tc->head, len, flags, node);
+		if (region)
+			tc->count--;
+		pthread_mutex_unlock(&tc->lock);
+	}
+
+	if (!region && __atomic_load_n(&region_cache.head, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&region_cache.lock);
+		region = region_list_take(&region_cache.head, len, flags,
+					  node);
+		pthread_mutex_unlock(&region_cache.lock);
+	}
+
+	if (!region)
+		return NULL;
+
+	DEBUG("get_huge_pages: Reusing cached region at %p\n", region->base);
+	__atomic_sub_fetch(&region_cache.bytes, len, __ATOMIC_RELAXED);
+	base = region->base;
+	free(region);
+	return base;
+}
+
+/* Keep a freed hugepage mapping for reuse. Returns 1 if it was kept. */
+static int region_cache_put(struct ghp_region *region)
+{
+	struct region_tcache *tc;
+
+	if (region->len > __hugetlb_opts.region_cache)
+		return 0;
+
+	if (!region_cache_charge(region->len)) {
+		region_cache_shrink(region->len);
+		if (!region_cache_charge(region->len))
+			return 0;
+	}
+
+	tc = region_tcache(1);
+	if (tc) {
+		pthread_mutex_lock(&tc->lock);
+		if (tc->count < REGION_TCACHE_MAX) {
+			region->next = tc->head;
+			tc->head = region;
+			tc->count++;
+			pthread_mutex_unlock(&tc->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&tc->lock);
+	}
+
+	pthread_mutex_lock(&region_cache.lock);
+	region->next = region_cache.head;
+	region_cache.head = region;
+	pthread_mutex_unlock(&region_cache.lock);
+	return 1;
+}
+
+/**
+ * hugetlb_region_cache_flush - Unmap all cached hugepage regions
+ *
+ * Regions freed while HUGETLB_REGION_CACHE is set stay mapped so they can
+ * be reused. This returns the hugepages of every cached region, including
+ * those cached by other threads, to the pool.
+ */
+void hugetlb_region_cache_flush(void)
+{
+	struct ghp_region *list, *region;
+	struct region_tcache *tc;
+
+	pthread_mutex_lock(&region_cache.lock);
+	list = region_cache.head;
+	region_cache.head = NULL;
+	for (tc = region_cache.caches; tc; tc = tc->next) {
+		pthread_mutex_lock(&tc->lock);
+		while ((region = tc->head)) {
+			tc->head = region->next;
+			region->next = list;
+			list = region;
+		}
+		tc->count = 0;
+		pthread_mutex_unlock(&tc->lock);
+	}
+	pthread_mutex_unlock(&region_cache.lock);
+
+	region_cache_unmap(list);
+}
+
 /* Allocate base pages if huge page allocation fails */
 static void *fallback_base_pages(size_t len, ghp_t flags)
 {
@@ -39,11 +457,10 @@ static void *fallback_base_pages(size_t len, ghp_t flags)
 	INFO("get_huge_pages: Falling back to base pages\n");
 
 	/*
-	 * Map /dev/zero instead of MAP_ANONYMOUS avoid VMA mergings. Freeing
-	 * pages depends on /proc/pid/maps to find lengths of allocations.
-	 * This is a bit lazy and if found to be costly due to either the
-	 * extra open() or virtual address space usage, we could track active
-	 * mappings in a lock-protected list instead.
+	 * Map /dev/zero instead of MAP_ANONYMOUS avoid VMA mergings. Lengths
+	 * of allocations are normally taken from the region registry but
+	 * freeing a region the registry does not know about depends on
+	 * /proc/pid/maps, which only works if the mappings stay distinct.
 	 */
 	fd = open("/dev/zero", O_RDWR);
 	if (fd == -1) {
@@ -64,81 +481,643 @@ static void *fallback_base_pages(size_t len, ghp_t flags)
 	return buf;
 }
 
-/**
- * get_huge_pages - Allocate an amount of memory backed by huge pages
- * len: Size of the region to allocate, must be hugepage-aligned
- * flags: Flags specifying the behaviour of the function
- *
- * This function allocates a region of memory that is backed by huge pages
- * and hugepage-aligned. This is not a suitable drop-in for malloc() but a
- * a malloc library could use this function to create a new fixed-size heap
- * similar in principal to what morecore does for glibc malloc.
+/*
+ * Back a region with transparent hugepages when the hugetlb pool cannot.
+ * The mapping is aligned to the THP size so that all of it can be backed
+ * by hugepages. With HUGETLB_THP_COLLAPSE=yes the region is populated and
+ * collapsed now, instead of leaving the fault path or khugepaged to find
+ * hugepages later. Returns NULL if THP cannot be used.
  */
-void *get_huge_pages(size_t len, ghp_t flags)
+static void *thp_pages(size_t len, size_t *mapped_len, long *page_size)
+{
+	long thp_size = thp_page_size();
+	char *reserve, *buf;
+
+	if (thp_size <= 0)
+		return NULL;
+	len = ALIGN(len, thp_size);
+
+	reserve = mmap(NULL, len + thp_size, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (reserve == MAP_FAILED)
+		return NULL;
+	buf = (char *)ALIGN((unsigned long)reserve, thp_size);
+	if (buf != reserve)
+		munmap(reserve, buf - reserve);
+	munmap(buf + len, reserve + thp_size - buf);
+
+	if (madvise(buf, len, MADV_HUGEPAGE) != 0) {
+		INFO("get_hugepage_region: MADV_HUGEPAGE failed: %s\n",
+			strerror(errno));
+		munmap(buf, len);
+		return NULL;
+	}
+
+	if (__hugetlb_opts.thp_collapse) {
+		if (hugetlbfs_populate(buf, len, thp_size, -1) != 0) {
+			munmap(buf, len);
+			return NULL;
+		}
+		if (madvise(buf, len, MADV_COLLAPSE) != 0)
+			INFO("get_hugepage_region: MADV_COLLAPSE failed: %s, "
+				"part of the region uses base pages\n",
+				strerror(errno));
+	}
+
+	*mapped_len = len;
+	*page_size = thp_size;
+	return buf;
+}
+
+/*
+ * The page size selected by the GHP_HUGE_* bits of flags, or the default
+ * hugepage size if none are set. Returns -1 with errno set to EINVAL for
+ * sizes that cannot be represented.
+ */
+long flags_page_size(unsigned long flags)
+{
+	unsigned int shift;
+
+	shift = (flags & GHP_HUGE_SIZE_MASK) >> GHP_HUGE_SHIFT;
+	if (!shift)
+		return gethugepagesize();
+
+	if (shift >= sizeof(long) * 8 - 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 1L << shift;
+}
+
+/*
+ * Choose the memory policy placing a new region. Returns the MPOL_* mode,
+ * 0 if the region is not placed or -1 if the node cannot satisfy a
+ * strict request. The per-node pool counters are checked up front as
+ * a hugetlb fault that finds the bound node empty is fatal.
+ */
+static int region_policy(size_t len, long page_size, ghp_t flags, int node)
+{
+	long nr_free;
+
+	if (flags & GHP_INTERLEAVE)
+		return MPOL_INTERLEAVE;
+	if (node < 0)
+		return 0;
+
+	nr_free = hugetlbfs_node_free_hugepages(node, page_size);
+	if (nr_free >= 0 && nr_free < len / page_size) {
+		if (flags & GHP_NODE_STRICT) {
+			WARNING("get_huge_pages: Node %d has only %ld free "
+				"hugepages\n", node, nr_free);
+			errno = ENOMEM;
+			return -1;
+		}
+		INFO("get_huge_pages: Node %d has only %ld free hugepages, "
+			"other nodes will be used\n", node, nr_free);
+	}
+
+	return (flags & GHP_NODE_STRICT) ? MPOL_BIND : MPOL_PREFERRED;
+}
+
+/*
+ * mmap() len bytes of hugepages of the given size. Pages of the kernel
+ * default size are mapped with MAP_HUGETLB where possible, other sizes
+ * come from an unlinked file on a hugetlbfs mount for that size.
+ * mmap_flags may add MAP_FIXED. Returns MAP_FAILED on failure.
+ */
+static void *map_huge_pages(void *addr, size_t len, long page_size,
+			    int mmap_flags)
 {
 	void *buf;
-	int buf_fd = -1;
+	int buf_fd;
 	int mmap_reserve = __hugetlb_opts.no_reserve ? MAP_NORESERVE : 0;
 	int mmap_hugetlb = 0;
-	int ret;
-
-	/* Catch an altogether-too easy typo */
-	if (flags & GHR_MASK)
-		ERROR("Improper use of GHR_* in get_huge_pages()\n");
 
 #ifdef MAP_HUGETLB
 	mmap_hugetlb = MAP_HUGETLB;
 #endif
 
 	if (__hugetlb_opts.map_hugetlb &&
-			gethugepagesize() == kernel_default_hugepage_size()) {
+			page_size == kernel_default_hugepage_size()) {
 		/* Because we can use MAP_HUGETLB, we simply mmap the region */
-		buf = mmap(NULL, len, PROT_READ|PROT_WRITE,
-			MAP_PRIVATE|MAP_ANONYMOUS|mmap_hugetlb|mmap_reserve,
-			0, 0);
-	} else {
-		/* Create a file descriptor for the new region */
-		buf_fd = hugetlbfs_unlinked_fd();
-		if (buf_fd < 0) {
-			WARNING("Couldn't open hugetlbfs file for %zd-sized buffer\n",
-					len);
-			return NULL;
+		return mmap(addr, len, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|mmap_hugetlb|mmap_reserve|
+			mmap_flags, 0, 0);
+	}
+
+	/* Create a file descriptor for the new region */
+	buf_fd = hugetlbfs_unlinked_fd_for_size(page_size);
+	if (buf_fd < 0) {
+		WARNING("Couldn't open hugetlbfs file for %zd-sized buffer "
+			"of %ld kB pages\n", len, page_size / 1024);
+		errno = ENOENT;
+		return MAP_FAILED;
+	}
+
+	/* Map the requested region */
+	buf = mmap(addr, len, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|mmap_reserve|mmap_flags, buf_fd, 0);
+
+	/* Close the file so we do not have to track the descriptor */
+	close(buf_fd);
+	return buf;
+}
+
+/*
+ * Background population of GHP_ASYNC_PREFAULT regions. Regions are queued
+ * to a single worker thread owned by the library, started on first use,
+ * which faults them in order with hugetlbfs_populate(). The outcome is
+ * kept in the job so that hugetlb_prefault_wait() can report a shortage
+ * of hugepages instead of the caller being killed on first touch. With
+ * HUGETLB_PREFAULT_RATE set, the worker faults a slice at a time and
+ * sleeps between slices to stay under the given bytes per second.
+ */
+enum prefault_state {
+	PREFAULT_QUEUED,
+	PREFAULT_RUNNING,
+	PREFAULT_DONE,
+};
+
+struct prefault_job {
+	void *addr;
+	size_t len;
+	long page_size;
+	int node;
+	enum prefault_state state;
+	int error;		/* errno of a failed prefault, or 0 */
+	int cancel;		/* Region is being freed, stop early */
+	int refs;		/* Held by the region and by each waiter */
+	struct prefault_job *next;
+};
+
+/* Slices per second when the population rate is limited */
+#define PREFAULT_RATE_SLICES	10
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* Signalled when a job is queued */
+	pthread_cond_t done;		/* Broadcast when a job finishes */
+	struct prefault_job *head, **tail;
+	struct prefault_job *current;	/* Job the worker is running */
+	int running;			/* Worker thread exists */
+} prefault_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.tail = &prefault_queue.head,
+};
+
+static pthread_once_t prefault_atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The worker does not survive fork(). Put the job it was running back on
+ * the queue so that the child faults it again when the worker restarts.
+ */
+static void prefault_atfork_child(void)
+{
+	pthread_mutex_init(&prefault_queue.lock, NULL);
+	pthread_cond_init(&prefault_queue.work, NULL);
+	pthread_cond_init(&prefault_queue.done, NULL);
+	prefault_queue.running = 0;
+
+	if (prefault_queue.current) {
+		prefault_queue.current->state = PREFAULT_QUEUED;
+		prefault_queue.current->next = prefault_queue.head;
+		if (!prefault_queue.head)
+			prefault_queue.tail = &prefault_queue.current->next;
+		prefault_queue.head = prefault_queue.current;
+		prefault_queue.current = NULL;
+	}
+}
+
+static void prefault_atfork_init(void)
+{
+	pthread_atfork(NULL, NULL, prefault_atfork_child);
+}
+
+/* Sleep until len bytes may have been faulted since start */
+static void prefault_pace(const struct timespec *start, size_t len)
+{
+	struct timespec now, delay;
+	double due;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	due = (double)len / __hugetlb_opts.prefault_rate -
+		((now.tv_sec - start->tv_sec) +
+		 (now.tv_nsec - start->tv_nsec) / 1e9);
+	if (due <= 0)
+		return;
+
+	delay.tv_sec = (time_t)due;
+	delay.tv_nsec = (long)((due - delay.tv_sec) * 1e9);
+	nanosleep(&delay, NULL);
+}
+
+/* Fault a queued region. Returns 0 or an errno value */
+static int prefault_job_run(struct prefault_job *job)
+{
+	unsigned long rate = __hugetlb_opts.prefault_rate;
+	struct timespec start;
+	size_t offset, slice;
+
+	slice = job->len;
+	if (rate)
+		slice = ALIGN(rate / PREFAULT_RATE_SLICES, job->page_size);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (offset = 0; offset < job->len; offset += slice) {
+		if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED))
+			return 0;
+		if (slice > job->len - offset)
+			slice = job->len - offset;
+		if (hugetlbfs_populate(job->addr + offset, slice,
+				       job->page_size, job->node) != 0)
+			return ENOMEM;
+		if (rate)
+			prefault_pace(&start, offset + slice);
+	}
+
+	return 0;
+}
+
+static void *prefault_worker(void *arg)
+{
+	struct prefault_job *job;
+	int error;
+
+	pthread_mutex_lock(&prefault_queue.lock);
+	for (;;) {
+		while (!(job = prefault_queue.head))
+			pthread_cond_wait(&prefault_queue.work,
+					  &prefault_queue.lock);
+		prefault_queue.head = job->next;
+		if (!prefault_queue.head)
+			prefault_queue.tail = &prefault_queue.head;
+		job->state = PREFAULT_RUNNING;
+		prefault_queue.current = job;
+		pthread_mutex_unlock(&prefault_queue.lock);
+
+		error = prefault_job_run(job);
+
+		pthread_mutex_lock(&prefault_queue.lock);
+		job->error = error;
+		job->state = PREFAULT_DONE;
+		prefault_queue.current = NULL;
+		pthread_cond_broadcast(&prefault_queue.done);
+	}
+
+	return NULL;
+}
+
+/* Start the worker if it is not running. Called with the queue locked */
+static int prefault_worker_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int ret;
+
+	if (prefault_queue.running)
+		return 0;
+
+	pthread_once(&prefault_atfork_once, prefault_atfork_init);
+
+	/* Signals meant for the application must not land on the worker */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, prefault_worker, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		WARNING("Unable to start prefault thread: %s\n",
+			strerror(ret));
+		return -1;
+	}
+	prefault_queue.running = 1;
+	return 0;
+}
+
+/* Queue a region for population. Returns the job or NULL on failure */
+static struct prefault_job *prefault_job_queue(void *addr, size_t len,
+					       long page_size, int node)
+{
+	struct prefault_job *job;
+
+	job = malloc(sizeof(*job));
+	if (!job)
+		return NULL;
+	job->addr = addr;
+	job->len = len;
+	job->page_size = page_size;
+	job->node = node;
+	job->state = PREFAULT_QUEUED;
+	job->error = 0;
+	job->cancel = 0;
+	job->refs = 1;
+	job->next = NULL;
+
+	pthread_mutex_lock(&prefault_queue.lock);
+	if (prefault_worker_start() != 0) {
+		pthread_mutex_unlock(&prefault_queue.lock);
+		free(job);
+		return NULL;
+	}
+	*prefault_queue.tail = job;
+	prefault_queue.tail = &job->next;
+	pthread_cond_signal(&prefault_queue.work);
+	pthread_mutex_unlock(&prefault_queue.lock);
+
+	return job;
+}
+
+/* Wait for a job to finish. Called with the queue locked */
+static void prefault_job_wait(struct prefault_job *job)
+{
+	/* A worker lost to fork() is restarted to finish the queue */
+	if (job->state != PREFAULT_DONE && prefault_worker_start() != 0) {
+		job->error = ENOMEM;
+		return;
+	}
+
+	while (job->state != PREFAULT_DONE)
+		pthread_cond_wait(&prefault_queue.done, &prefault_queue.lock);
+}
+
+/* Drop a reference to a job, freeing it once the last one is gone */
+static void prefault_job_put(struct prefault_job *job)
+{
+	if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(job);
+}
+
+/*
+ * Take a reference to the job of the region keyed on ptr. Taking it under
+ * the shard lock keeps the job alive across a concurrent free, which
+ * unregisters the region before cancelling the job. Returns NULL if the
+ * region is not found or was not prefaulted in the background.
+ */
+static struct prefault_job *prefault_job_get(void *ptr)
+{
+	unsigned long hash = region_hash(ptr);
+	struct region_shard *shard = region_shard_of(hash);
+	struct prefault_job *job = NULL;
+	struct ghp_region *region;
+
+	pthread_mutex_lock(&shard->lock);
+	for (region = *region_bucket_of(shard, hash); region;
+			region = region->next) {
+		if (region->ptr == ptr) {
+			job = region->prefault;
+			if (job)
+				__atomic_add_fetch(&job->refs, 1,
+						   __ATOMIC_RELAXED);
+			break;
 		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return job;
+}
+
+/*
+ * Stop populating a region that is about to be freed and drop the
+ * region's reference to the job. A hugetlb_prefault_wait() still
+ * waiting on it frees the job when it is done.
+ */
+static void prefault_job_cancel(struct prefault_job *job)
+{
+	struct prefault_job **pprev;
 
-		/* Map the requested region */
-		buf = mmap(NULL, len, PROT_READ|PROT_WRITE,
-			MAP_PRIVATE|mmap_reserve, buf_fd, 0);
+	pthread_mutex_lock(&prefault_queue.lock);
+	if (job->state == PREFAULT_QUEUED) {
+		for (pprev = &prefault_queue.head; *pprev != job;
+				pprev = &(*pprev)->next)
+			;
+		*pprev = job->next;
+		if (prefault_queue.tail == &job->next)
+			prefault_queue.tail = pprev;
+		job->state = PREFAULT_DONE;
+		pthread_cond_broadcast(&prefault_queue.done);
+	} else if (job->state == PREFAULT_RUNNING) {
+		__atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+		while (job->state != PREFAULT_DONE)
+			pthread_cond_wait(&prefault_queue.done,
+					  &prefault_queue.lock);
 	}
+	pthread_mutex_unlock(&prefault_queue.lock);
 
-	if (buf == MAP_FAILED) {
-		if (buf_fd >= 0)
-			close(buf_fd);
+	prefault_job_put(job);
+}
+
+/**
+ * hugetlb_prefault_wait - Wait for a region's background prefault
+ * ptr: A region returned by get_huge_pages() with GHP_ASYNC_PREFAULT
+ *
+ * Returns 0 once every hugepage of the region is instantiated, or at once
+ * for regions that were not prefaulted in the background. Returns -1 with
+ * errno set to ENOMEM if the hugepages could not all be had, in which case
+ * the region must not be touched and should be freed.
+ */
+int hugetlb_prefault_wait(void *ptr)
+{
+	struct prefault_job *job;
+	int error;
+
+	job = prefault_job_get(ptr);
+	if (!job)
+		return 0;
+
+	pthread_mutex_lock(&prefault_queue.lock);
+	prefault_job_wait(job);
+	error = job->error;
+	pthread_mutex_unlock(&prefault_queue.lock);
+	prefault_job_put(job);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map and prefault a hugepage region, or reuse a cached one, without
+ * recording it. A node of -1 leaves placement to the flags and the
+ * process memory policy.
+ */
+static void *__get_huge_pages(size_t len, ghp_t flags, int node)
+{
+	void *buf;
+	long page_size;
+	int policy;
+	int ret;
+
+	page_size = flags_page_size(flags);
+	if (page_size < 0)
+		return NULL;
+
+	/* A length that is not a multiple of an explicit size cannot be freed */
+	if ((flags & GHP_HUGE_SIZE_MASK) && len % page_size) {
+		WARNING("get_huge_pages: Length %zd is not a multiple of the "
+			"%ld kB page size\n", len, page_size / 1024);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (__hugetlb_opts.region_cache) {
+		buf = region_cache_get(len, flags, node);
+		if (buf)
+			return buf;
+	}
+
+	policy = region_policy(len, page_size, flags, node);
+	if (policy < 0)
+		return NULL;
 
+	buf = map_huge_pages(NULL, len, page_size, 0);
+	if (buf == MAP_FAILED) {
 		WARNING("get_huge_pages: New region mapping failed (flags: 0x%lX): %s\n",
 			flags, strerror(errno));
 		return NULL;
 	}
 
-	/* Fault the region to ensure accesses succeed */
-	ret = hugetlbfs_prefault(buf, len);
+	/* The policy must be in place before the first page is faulted */
+	if (policy && hugetlbfs_mbind(buf, len, policy, node) != 0) {
+		if (flags & GHP_NODE_STRICT) {
+			ret = errno;
+			munmap(buf, len);
+
+			WARNING("get_huge_pages: Unable to bind region to "
+				"node %d: %s\n", node, strerror(ret));
+			errno = ret;
+			return NULL;
+		}
+		WARNING("get_huge_pages: Unable to place region: %s\n",
+			strerror(errno));
+	}
+
+	/* The caller queues the prefault once the region is recorded */
+	if (flags & GHP_ASYNC_PREFAULT)
+		return buf;
+
+	/*
+	 * Fault the region to ensure accesses succeed. A region bound to a
+	 * node is always faulted so that a shortage on the node is reported
+	 * here rather than killing the process on first touch.
+	 */
+	if (policy == MPOL_BIND)
+		ret = hugetlbfs_populate(buf, len, page_size, node);
+	else
+		ret = hugetlbfs_prefault(buf, len, page_size, node);
 	if (ret != 0) {
 		munmap(buf, len);
-		if (buf_fd >= 0)
-			close(buf_fd);
 
 		WARNING("get_huge_pages: Prefaulting failed (flags: 0x%lX): %s\n",
 			flags, strerror(ret));
 		return NULL;
 	}
 
-	/* Close the file so we do not have to track the descriptor */
-	if (buf_fd >= 0 && close(buf_fd) != 0) {
-		WARNING("Failed to close new buffer fd: %s\n", strerror(errno));
+	/* woo, new buffer of shiny */
+	return buf;
+}
+
+/*
+ * Record a region from __get_huge_pages() and queue its prefault if it
+ * was asked for in the background. A region whose prefault cannot be
+ * queued is populated here, as __get_huge_pages() left it untouched.
+ */
+static void *get_huge_pages_finish(void *buf, size_t len, ghp_t flags,
+				   int node)
+{
+	long page_size = flags_page_size(flags);
+	struct ghp_region *region;
+
+	region = region_register(buf, buf, len, flags, node,
+				 HUGETLB_TIER_HUGETLB, page_size);
+	if (!(flags & GHP_ASYNC_PREFAULT))
+		goto out;
+
+	if (region) {
+		region->prefault = prefault_job_queue(buf, len, page_size,
+						      node);
+		if (region->prefault)
+			goto out;
+	}
+
+	if (hugetlbfs_populate(buf, len, page_size, node) != 0) {
+		if (region)
+			free(region_unregister(buf));
 		munmap(buf, len);
+		WARNING("get_huge_pages: Prefaulting failed (flags: 0x%lX)\n",
+			flags);
+		errno = ENOMEM;
 		return NULL;
 	}
+out:
+	hugetlbfs_stat_alloc(page_size);
+	return buf;
+}
 
-	/* woo, new buffer of shiny */
+/**
+ * get_huge_pages - Allocate an amount of memory backed by huge pages
+ * len: Size of the region to allocate, must be hugepage-aligned
+ * flags: Flags specifying the behaviour of the function
+ *
+ * This function allocates a region of memory that is backed by huge pages
+ * and hugepage-aligned. This is not a suitable drop-in for malloc() but a
+ * a malloc library could use this function to create a new fixed-size heap
+ * similar in principal to what morecore does for glibc malloc.
+ */
+void *get_huge_pages(size_t len, ghp_t flags)
+{
+	int node = -1;
+	void *buf;
+
+	/* Catch an altogether-too easy typo */
+	if (flags & GHR_MASK)
+		ERROR("Improper use of GHR_* in get_huge_pages()\n");
+
+	if ((flags & GHP_LOCAL) && (flags & GHP_INTERLEAVE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (flags & GHP_LOCAL)
+		node = hugetlbfs_local_node();
+
+	buf = __get_huge_pages(len, flags, node);
+	if (buf)
+		buf = get_huge_pages_finish(buf, len, flags, node);
+	return buf;
+}
+
+/**
+ * get_huge_pages_onnode - Allocate huge pages from a given NUMA node
+ * len: Size of the region to allocate, must be hugepage-aligned
+ * node: The node whose hugepage pool the region should come from
+ * flags: Flags specifying the behaviour of the function
+ *
+ * This behaves like get_huge_pages() except that the region is placed on
+ * the given node. Unless GHP_NODE_STRICT is given, pages come from other
+ * nodes when the node runs out. The region is freed with free_huge_pages().
+ */
+void *get_huge_pages_onnode(size_t len, int node, ghp_t flags)
+{
+	void *buf;
+
+	if (flags & GHR_MASK)
+		ERROR("Improper use of GHR_* in get_huge_pages_onnode()\n");
+
+	if (node < 0 || (flags & (GHP_LOCAL|GHP_INTERLEAVE))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	buf = __get_huge_pages(len, flags, node);
+	if (buf)
+		buf = get_huge_pages_finish(buf, len, flags, node);
 	return buf;
 }
 
@@ -150,6 +1129,23 @@ static void __free_huge_pages(void *ptr, int aligned)
 	unsigned long start = 0, end = 0;
 	unsigned long palign = 0, hpalign = 0;
 	unsigned long hpalign_end = 0;
+	struct ghp_region *region;
+
+	/* The common case, the region was recorded when it was allocated */
+	region = region_unregister(ptr);
+	if (region) {
+		hugetlbfs_stat_free(region->page_size);
+		if (region->prefault) {
+			prefault_job_cancel(region->prefault);
+			region->prefault = NULL;
+		}
+		if (region->tier != HUGETLB_TIER_HUGETLB ||
+		    !region_cache_put(region)) {
+			munmap(region->base, region->len);
+			free(region);
+		}
+		return;
+	}
 
 	/*
 	 * /proc/self/maps is used to determine the length of the original
@@ -235,10 +1231,11 @@ static void __free_huge_pages(void *ptr, int aligned)
  * free_huge_pages - Free a region allocated that was backed by large pages
  * ptr - The pointer to the buffer returned by get_huge_pages()
  *
- * This function finds a region to free based on the contents of
- * /proc/pid/maps. The assumption is made that the ptr is the start of
- * a hugepage region allocated with free_huge_pages. No checking is made
- * that the pointer is to a hugepage backed region.
+ * This function looks up the region in the registry filled in at
+ * allocation time, falling back to the contents of /proc/pid/maps for
+ * pointers it does not know. The assumption is made that the ptr is the
+ * start of a hugepage region allocated with get_huge_pages. No checking
+ * is made that the pointer is to a hugepage backed region.
  */
 void free_huge_pages(void *ptr)
 {
@@ -306,6 +1303,149 @@ void *cachecolor(void *buf, size_t len, size_t color_bytes)
 	return bytebuf;
 }
 
+/*
+ * Put back the placeholder over a range of a mixed region after mapping
+ * hugepages over it failed. A failed MAP_FIXED mmap() may or may not
+ * have left the old placeholder in place; EEXIST means it did.
+ */
+static int mixed_reserve(void *addr, size_t len, int mmap_flags)
+{
+	void *p;
+
+	p = mmap(addr, len, PROT_NONE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|mmap_flags, -1, 0);
+	if (p == MAP_FAILED)
+		return errno == EEXIST ? 0 : -1;
+	if (p != addr) {
+		munmap(p, len);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Build one contiguous region from the largest hugepage sizes that fit
+ * in len, then smaller sizes for what is left. The tail that no
+ * hugepage size fits is backed by base pages with GHR_FALLBACK, or
+ * rounded up to the smallest hugepage size otherwise. A size whose pool
+ * cannot supply the pages is skipped in favour of the next. The region
+ * is first reserved with a PROT_NONE placeholder aligned to the largest
+ * size so that the pieces can be mapped over it in place.
+ *
+ * Returns the start of the region, its length in *region_len and the
+ * largest page size used in *region_page_size, or NULL.
+ */
+static void *get_mixed_pages(size_t len, ghr_t flags, size_t *region_len,
+			     long *region_page_size)
+{
+	long sizes[MAX_HPAGE_SIZES], size, max_size, unit;
+	int nr_sizes, nr_usable = 0, nr_huge = 0;
+	size_t total, offset = 0, chunk;
+	char *reserve, *start;
+	int i, j;
+
+	max_size = (flags & GHP_HUGE_SIZE_MASK) ? flags_page_size(flags) : 0;
+	if (max_size < 0)
+		return NULL;
+
+	/* Usable sizes in decreasing order */
+	nr_sizes = gethugepagesizes(sizes, MAX_HPAGE_SIZES);
+	for (i = 0; i < nr_sizes; i++) {
+		size = sizes[i];
+		if ((max_size && size > max_size) ||
+		    !hugetlbfs_find_path_for_size(size))
+			continue;
+		for (j = nr_usable; j > 0 && sizes[j - 1] < size; j--)
+			sizes[j] = sizes[j - 1];
+		sizes[j] = size;
+		nr_usable++;
+	}
+
+	if (flags & GHR_FALLBACK)
+		unit = getpagesize();
+	else if (nr_usable)
+		unit = sizes[nr_usable - 1];
+	else
+		return NULL;
+	total = ALIGN(len, unit);
+
+	max_size = unit;
+	for (i = 0; i < nr_usable; i++) {
+		if (sizes[i] <= total) {
+			max_size = sizes[i];
+			break;
+		}
+	}
+
+	reserve = mmap(NULL, total + max_size, PROT_NONE,
+		       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (reserve == MAP_FAILED)
+		return NULL;
+	start = (char *)ALIGN((unsigned long)reserve, max_size);
+	if (start != reserve)
+		munmap(reserve, start - reserve);
+	munmap(start + total, reserve + max_size - start);
+
+	for (i = 0; i < nr_usable && offset < total; i++) {
+		size = sizes[i];
+		chunk = ALIGN_DOWN(total - offset, size);
+		if (!chunk)
+			continue;
+
+		if (map_huge_pages(start + offset, chunk, size, MAP_FIXED) ==
+				MAP_FAILED) {
+			INFO("get_hugepage_region: No %ld kB pages for %zd "
+				"bytes: %s\n", size / 1024, chunk,
+				strerror(errno));
+#ifdef MAP_FIXED_NOREPLACE
+			if (mixed_reserve(start + offset, chunk,
+					  MAP_FIXED_NOREPLACE) != 0)
+				goto hole;
+#endif
+			continue;
+		}
+
+		if (hugetlbfs_prefault(start + offset, chunk, size, -1) != 0) {
+			if (mixed_reserve(start + offset, chunk, MAP_FIXED))
+				goto hole;
+			continue;
+		}
+
+		DEBUG("get_hugepage_region: %zd bytes of %ld kB pages at %p\n",
+			chunk, size / 1024, start + offset);
+		if (!nr_huge)
+			*region_page_size = size;
+		offset += chunk;
+		nr_huge++;
+	}
+
+	if (offset < total) {
+		if (!(flags & GHR_FALLBACK) ||
+		    mmap(start + offset, total - offset, PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) ==
+				MAP_FAILED) {
+			munmap(start, total);
+			return NULL;
+		}
+		DEBUG("get_hugepage_region: %zd bytes of base pages at %p\n",
+			total - offset, start + offset);
+	}
+
+	if (!nr_huge) {
+		INFO("get_hugepage_region: Falling back to base pages\n");
+		*region_page_size = getpagesize();
+		STAT_ADD(base_fallbacks, 1);
+	}
+	*region_len = total;
+	return start;
+
+hole:
+	/* Part of the range was lost, only unmap what is still ours */
+	munmap(start, offset);
+	munmap(start + offset + chunk, total - offset - chunk);
+	return NULL;
+}
+
 /**
  * get_hugepage_region - Allocate an amount of memory backed by huge pages
  *
@@ -316,28 +1456,73 @@ void *cachecolor(void *buf, size_t len, size_t color_bytes)
  * be taken when using this function as a drop-in replacement for malloc() as
  * memory can be wasted if the length is not hugepage-aligned. This function
  * is more relaxed than get_huge_pages() in that it allows fallback to small
- * pages when requested.
+ * pages when requested. With GHR_MIXED, the region is built from several
+ * page sizes so that little or nothing is wasted.
  */
 void *get_hugepage_region(size_t len, ghr_t flags)
 {
 	size_t aligned_len, wastage;
-	void *buf;
+	ghp_t ghp_flags = GHP_DEFAULT | (flags & GHP_HUGE_SIZE_MASK);
+	long page_size;
+	void *base, *buf;
+	int tier = HUGETLB_TIER_HUGETLB;
 
 	/* Catch an altogether-too easy typo */
 	if (flags & GHP_MASK)
 		ERROR("Improper use of GHP_* in get_hugepage_region()\n");
 
+	if (flags & GHR_MIXED) {
+		base = get_mixed_pages(len, flags, &aligned_len, &page_size);
+		if (base == NULL)
+			return NULL;
+		/* The pieces are only freed together through the registry */
+		buf = base;
+		if (flags & GHR_COLOR)
+			buf = cachecolor(base, len, aligned_len - len);
+		if (!region_register(buf, base, aligned_len, ghp_flags, -1,
+				     HUGETLB_TIER_MIXED, page_size)) {
+			munmap(base, aligned_len);
+			return NULL;
+		}
+		hugetlbfs_stat_alloc(page_size);
+		return buf;
+	}
+
+	page_size = flags_page_size(flags);
+	if (page_size < 0)
+		return NULL;
+
 	/* Align the len parameter to a hugepage boundary and allocate */
-	aligned_len = ALIGN(len, gethugepagesize());
-	buf = get_huge_pages(aligned_len, GHP_DEFAULT);
-	if (buf == NULL) {
+	aligned_len = ALIGN(len, page_size);
+	base = __get_huge_pages(aligned_len, ghp_flags, -1);
+
+	/* Then transparent hugepages, before giving up on hugepages */
+	if (base == NULL && ((flags & GHR_THP) ||
+	    ((flags & GHR_FALLBACK) && __hugetlb_opts.thp_fallback))) {
+		base = thp_pages(len, &aligned_len, &page_size);
+		tier = HUGETLB_TIER_THP;
+		if (base)
+			STAT_ADD(thp_fallbacks, 1);
+	}
+
+	if (base == NULL) {
 		if (flags & GHR_FALLBACK) {
 			aligned_len = ALIGN(len, getpagesize());
-			buf = fallback_base_pages(len, flags);
+			base = fallback_base_pages(len, flags);
+			if (base == NULL)
+				return NULL;
+			tier = HUGETLB_TIER_BASE;
+			page_size = getpagesize();
+			STAT_ADD(base_fallbacks, 1);
 		} else {
-			return buf;
+			return NULL;
 		}
 	}
+	INFO("get_hugepage_region: %zd bytes at %p backed by %s\n", len, base,
+		tier == HUGETLB_TIER_HUGETLB ? "hugetlb pages" :
+		tier == HUGETLB_TIER_THP ? "transparent hugepages" :
+		"base pages");
+	buf = base;
 
 	/* Calculate wastage for coloring */
 	wastage = aligned_len - len;
@@ -349,6 +1534,13 @@ void *get_hugepage_region(size_t len, ghr_t flags)
 	if (flags & GHR_COLOR)
 		buf = cachecolor(buf, len, wastage);
 
+	/* Anonymous mappings may merge so /proc/self/maps cannot free them */
+	if (!region_register(buf, base, aligned_len, ghp_flags, -1, tier,
+			     page_size) && tier == HUGETLB_TIER_THP) {
+		munmap(base, aligned_len);
+		return NULL;
+	}
+	hugetlbfs_stat_alloc(page_size);
 	return buf;
 }
 
@@ -356,12 +1548,33 @@ void *get_hugepage_region(size_t len, ghr_t flags)
  * free_hugepage_region - Free a region allocated by get_hugepage_region
  * ptr - The pointer to the buffer returned by get_hugepage_region
  *
- * This function finds a region to free based on the contents of
- * /proc/pid/maps. The assumption is made that the ptr is the start of
- * a hugepage region allocated with get_hugepage_region. No checking is made
- * that the pointer is to a hugepage backed region.
+ * This function looks up the region in the registry filled in at
+ * allocation time, falling back to the contents of /proc/pid/maps for
+ * pointers it does not know. The assumption is made that the ptr is the
+ * start of a hugepage region allocated with get_hugepage_region. No
+ * checking is made that the pointer is to a hugepage backed region.
  */
 void free_hugepage_region(void *ptr)
 {
 	__free_huge_pages(ptr, 0);
 }
+
+/**
+ * hugetlb_region_tier - Report the kind of pages backing a region
+ * ptr - A pointer returned by get_huge_pages() or get_hugepage_region()
+ *
+ * Returns one of the HUGETLB_TIER_* values, telling whether the region
+ * got hugetlb pages, several page sizes (GHR_MIXED), transparent
+ * hugepages or base pages. Returns -1 with errno set to EINVAL for a
+ * pointer the library has no record of.
+ */
+int hugetlb_region_tier(void *ptr)
+{
+	struct ghp_region region;
+
+	if (region_lookup(ptr, &region) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return region.tier;
+}
@@ -0,0 +1,403 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ * arena.c - Size-class allocator for small objects carved from hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hugetlbfs.h"
+#include "libhugetlbfs_internal.h"
+
+/*
+ * An arena is built from slabs, each a single hugepage obtained with
+ * get_huge_pages(). A slab is divided into runs of ARENA_RUN_SIZE bytes
+ * and every run serves objects of a single size class. The slab header
+ * at the start of each slab records the class of each of its runs so
+ * that free only needs the object address to find the class.
+ *
+ * Freed objects are kept on an intrusive free list per class, protected
+ * by a per-class lock. Each thread keeps a magazine of objects for every
+ * class so that the common alloc and free paths take no lock at all; the
+ * class lock is only taken to refill an empty magazine or to drain a full
+ * one.
+ */
+#define ARENA_MIN_SHIFT		6
+#define ARENA_MIN_OBJ		(1UL << ARENA_MIN_SHIFT)	/* 64 bytes */
+#define ARENA_MAX_OBJ		(64UL * 1024)
+#define ARENA_NR_CLASSES	21
+#define ARENA_RUN_SIZE		(64UL * 1024)
+#define ARENA_MAG_MAX		64
+#define ARENA_MAG_MIN		4
+
+struct arena_slab {
+	struct arena_slab *next;
+	unsigned long nr_runs;
+	unsigned long next_run;
+	unsigned char run_class[];
+};
+
+struct arena_class {
+	pthread_mutex_t lock;
+	void *free;		/* Intrusive list of freed objects */
+	char *bump;		/* Uncarved space in the current run */
+	char *bump_end;
+} __attribute__((aligned(64)));
+
+struct arena_magazine {
+	unsigned int count;
+	void *objs[ARENA_MAG_MAX];
+};
+
+struct arena_tcache {
+	struct hugetlb_arena *arena;
+	struct arena_tcache *next;
+	struct arena_tcache *prev;
+	struct arena_magazine mags[ARENA_NR_CLASSES];
+};
+
+struct hugetlb_arena {
+	pthread_key_t key;
+	ghp_t flags;
+	unsigned long slab_size;
+	pthread_mutex_t lock;		/* Protects slabs and caches */
+	struct arena_slab *slabs;	/* Slab runs are taken from first */
+	struct arena_tcache *caches;
+	struct arena_class classes[ARENA_NR_CLASSES];
+};
+
+/*
+ * Size classes are the powers of two from 64 bytes to 64KB with one class
+ * half-way between each, which bounds the internal waste to a third.
+ */
+static unsigned long class_size(int cls)
+{
+	if (cls == 0)
+		return ARENA_MIN_OBJ;
+	if (cls & 1)
+		return 3UL << (cls / 2 + ARENA_MIN_SHIFT - 1);
+	return 1UL << (cls / 2 + ARENA_MIN_SHIFT);
+}
+
+static int size_to_class(size_t size)
+{
+	int shift;
+
+	if (size <= ARENA_MIN_OBJ)
+		return 0;
+
+	/* size lies in (2^shift, 2^(shift+1)] */
+	shift = (sizeof(long) * 8 - 1) - __builtin_clzl(size - 1);
+	return (shift - ARENA_MIN_SHIFT) * 2 + 1 +
+		(size > (3UL << (shift - 1)));
+}
+
+static unsigned int mag_capacity(int cls)
+{
+	unsigned long cap = 2 * ARENA_RUN_SIZE / class_size(cls);
+
+	if (cap > ARENA_MAG_MAX)
+		return ARENA_MAG_MAX;
+	if (cap < ARENA_MAG_MIN)
+		return ARENA_MAG_MIN;
+	return cap;
+}
+
+static struct arena_slab *slab_of(struct hugetlb_arena *arena, void *ptr)
+{
+	return (struct arena_slab *)ALIGN_DOWN((unsigned long)ptr,
+						arena->slab_size);
+}
+
+static char *slab_first_run(struct arena_slab *slab)
+{
+	return (char *)ALIGN((unsigned long)&slab->run_class[slab->nr_runs],
+				ARENA_RUN_SIZE);
+}
+
+/* Hand a fresh run to a class. Called with the class lock held. */
+static int arena_new_run(struct hugetlb_arena *arena, int cls)
+{
+	struct arena_class *class = &arena->classes[cls];
+	struct arena_slab *slab;
+	char *run;
+
+	pthread_mutex_lock(&arena->lock);
+	slab = arena->slabs;
+	if (!slab || slab->next_run == slab->nr_runs) {
+		slab = get_huge_pages(arena->slab_size, arena->flags);
+		if (!slab) {
+			pthread_mutex_unlock(&arena->lock);
+			WARNING("hugetlb_arena: Unable to allocate a new "
+				"slab\n");
+			return -1;
+		}
+		slab->nr_runs = arena->slab_size / ARENA_RUN_SIZE;
+		slab->next_run = (slab_first_run(slab) - (char *)slab) /
+					ARENA_RUN_SIZE;
+		slab->next = arena->slabs;
+		arena->slabs = slab;
+		DEBUG("hugetlb_arena: New slab at %p\n", slab);
+	}
+	slab->run_class[slab->next_run] = cls;
+	run = (char *)slab + slab->next_run * ARENA_RUN_SIZE;
+	slab->next_run++;
+	pthread_mutex_unlock(&arena->lock);
+
+	class->bump = run;
+	class->bump_end = run + ARENA_RUN_SIZE;
+	return 0;
+}
+
+/* Fill an empty magazine to half capacity from the class */
+static int arena_refill(struct hugetlb_arena *arena, int cls,
+			struct arena_magazine *mag)
+{
+	struct arena_class *class = &arena->classes[cls];
+	unsigned long size = class_size(cls);
+	unsigned int want = mag_capacity(cls) / 2;
+
+	pthread_mutex_lock(&class->lock);
+	while (mag->count < want) {
+		if (class->free) {
+			mag->objs[mag->count++] = class->free;
+			class->free = *(void **)class->free;
+			continue;
+		}
+		if (class->bump_end - class->bump < size &&
+		    arena_new_run(arena, cls) != 0)
+			break;
+		mag->objs[mag->count++] = class->bump;
+		class->bump += size;
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	return mag->count;
+}
+
+/* Return the oldest nr objects of a magazine to the class */
+static void arena_drain(struct hugetlb_arena *arena, int cls,
+			struct arena_magazine *mag, unsigned int nr)
+{
+	struct arena_class *class = &arena->classes[cls];
+	unsigned int i;
+
+	pthread_mutex_lock(&class->lock);
+	for (i = 0; i < nr; i++) {
+		*(void **)mag->objs[i] = class->free;
+		class->free = mag->objs[i];
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	mag->count -= nr;
+	memmove(mag->objs, mag->objs + nr, mag->count * sizeof(void *));
+}
+
+/* Thread exit: give the cached objects back and forget the cache */
+static void arena_tcache_destroy(void *arg)
+{
+	struct arena_tcache *tc = arg;
+	struct hugetlb_arena *arena = tc->arena;
+	int cls;
+
+	for (cls = 0; cls < ARENA_NR_CLASSES; cls++)
+		if (tc->mags[cls].count)
+			arena_drain(arena, cls, &tc->mags[cls],
+				    tc->mags[cls].count);
+
+	pthread_mutex_lock(&arena->lock);
+	if (tc->prev)
+		tc->prev->next = tc->next;
+	else
+		arena->caches = tc->next;
+	if (tc->next)
+		tc->next->prev = tc->prev;
+	pthread_mutex_unlock(&arena->lock);
+
+	free(tc);
+}
+
+static struct arena_tcache *arena_tcache(struct hugetlb_arena *arena)
+{
+	struct arena_tcache *tc;
+
+	tc = pthread_getspecific(arena->key);
+	if (tc)
+		return tc;
+
+	tc = calloc(1, sizeof(*tc));
+	if (!tc)
+		return NULL;
+	tc->arena = arena;
+	if (pthread_setspecific(arena->key, tc) != 0) {
+		free(tc);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	tc->next = arena->caches;
+	if (tc->next)
+		tc->next->prev = tc;
+	arena->caches = tc;
+	pthread_mutex_unlock(&arena->lock);
+
+	return tc;
+}
+
+/**
+ * hugetlb_arena_create - Create an allocator for small objects
+ * flags: Flags passed to get_huge_pages() when allocating slabs
+ *
+ * Slabs are one hugepage of the size selected by flags and are only
+ * allocated as objects are requested, so creating an arena does not
+ * consume any hugepages.
+ */
+hugetlb_arena_t *hugetlb_arena_create(ghp_t flags)
+{
+	struct hugetlb_arena *arena;
+	long hpage_size;
+	int cls;
+
+	hpage_size = flags_page_size(flags);
+	if (hpage_size < 0)
+		return NULL;
+	if (hpage_size < 2 * ARENA_RUN_SIZE) {
+		WARNING("hugetlb_arena: Hugepage size %ld too small for "
+			"arena runs\n", hpage_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+
+	if (pthread_key_create(&arena->key, arena_tcache_destroy) != 0) {
+		free(arena);
+		errno = EAGAIN;
+		return NULL;
+	}
+	arena->flags = flags;
+	arena->slab_size = hpage_size;
+	pthread_mutex_init(&arena->lock, NULL);
+	for (cls = 0; cls < ARENA_NR_CLASSES; cls++)
+		pthread_mutex_init(&arena->classes[cls].lock, NULL);
+
+	return arena;
+}
+
+/**
+ * hugetlb_arena_alloc - Allocate an object from an arena
+ * arena: The arena returned by hugetlb_arena_create()
+ * size: Size of the object, at most 64KB
+ */
+void *hugetlb_arena_alloc(hugetlb_arena_t *arena, size_t size)
+{
+	struct arena_tcache *tc;
+	struct arena_magazine *mag;
+	int cls;
+
+	if (size > ARENA_MAX_OBJ) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tc = arena_tcache(arena);
+	if (!tc) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cls = size_to_class(size);
+	mag = &tc->mags[cls];
+	if (mag->count == 0 && arena_refill(arena, cls, mag) == 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return mag->objs[--mag->count];
+}
+
+/**
+ * hugetlb_arena_free - Return an object to the arena it came from
+ * arena: The arena the object was allocated from
+ * ptr: The object returned by hugetlb_arena_alloc()
+ */
+void hugetlb_arena_free(hugetlb_arena_t *arena, void *ptr)
+{
+	struct arena_slab *slab;
+	struct arena_tcache *tc;
+	struct arena_magazine *mag;
+	unsigned int cap;
+	int cls;
+
+	if (!ptr)
+		return;
+
+	slab = slab_of(arena, ptr);
+	cls = slab->run_class[((char *)ptr - (char *)slab) / ARENA_RUN_SIZE];
+
+	tc = arena_tcache(arena);
+	if (!tc) {
+		/* No cache for this thread, hand it straight back */
+		struct arena_magazine tmp = { .count = 1, .objs = { ptr } };
+
+		arena_drain(arena, cls, &tmp, 1);
+		return;
+	}
+
+	mag = &tc->mags[cls];
+	cap = mag_capacity(cls);
+	if (mag->count == cap)
+		arena_drain(arena, cls, mag, cap / 2);
+	mag->objs[mag->count++] = ptr;
+}
+
+/**
+ * hugetlb_arena_destroy - Release an arena and all of its hugepages
+ * arena: The arena returned by hugetlb_arena_create()
+ *
+ * All objects allocated from the arena become invalid. The arena must not
+ * be in use by any other thread when it is destroyed.
+ */
+void hugetlb_arena_destroy(hugetlb_arena_t *arena)
+{
+	struct arena_slab *slab, *next;
+	struct arena_tcache *tc, *tc_next;
+	int cls;
+
+	pthread_key_delete(arena->key);
+	for (tc = arena->caches; tc; tc = tc_next) {
+		tc_next = tc->next;
+		free(tc);
+	}
+
+	for (slab = arena->slabs; slab; slab = next) {
+		next = slab->next;
+		free_huge_pages(slab);
+	}
+
+	for (cls = 0; cls < ARENA_NR_CLASSES; cls++)
+		pthread_mutex_destroy(&arena->classes[cls].lock);
+	pthread_mutex_destroy(&arena->lock);
+	free(arena);
+}
@@ -0,0 +1,164 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ * copy.c - Bulk copies into hugepages that bypass the CPU caches
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "hugetlbfs.h"
+#include "libhugetlbfs_internal.h"
+
+/*
+ * A copy of many megabytes, such as a program segment being moved into
+ * hugepages, is read once and not written again soon. Through memcpy()
+ * it would flush everything else out of the last level cache on its way.
+ * On x86 it is instead done with non-temporal stores, which go straight
+ * to memory, while the source is prefetched ahead of the loads with a
+ * hint to keep it out of the outer caches. The widest vector unit the
+ * CPU has is picked the first time. Other architectures, small copies
+ * and HUGETLB_COPY_METHOD=memcpy use memcpy().
+ */
+#define COPY_NT_MIN		(4UL << 20)
+#define COPY_BLOCK		64	/* One cache line per iteration */
+#define COPY_PREFETCH		(16 * COPY_BLOCK)
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void copy_sse2(char *dst, const char *src, size_t len)
+{
+	__m128i a, b, c, d;
+
+	for (; len >= COPY_BLOCK; len -= COPY_BLOCK) {
+		_mm_prefetch(src + COPY_PREFETCH, _MM_HINT_NTA);
+		a = _mm_loadu_si128((const __m128i *)src);
+		b = _mm_loadu_si128((const __m128i *)(src + 16));
+		c = _mm_loadu_si128((const __m128i *)(src + 32));
+		d = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+		src += COPY_BLOCK;
+		dst += COPY_BLOCK;
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(char *dst, const char *src, size_t len)
+{
+	__m256i a, b;
+
+	for (; len >= COPY_BLOCK; len -= COPY_BLOCK) {
+		_mm_prefetch(src + COPY_PREFETCH, _MM_HINT_NTA);
+		a = _mm256_loadu_si256((const __m256i *)src);
+		b = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_stream_si256((__m256i *)dst, a);
+		_mm256_stream_si256((__m256i *)(dst + 32), b);
+		src += COPY_BLOCK;
+		dst += COPY_BLOCK;
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(char *dst, const char *src, size_t len)
+{
+	__m512i a;
+
+	for (; len >= COPY_BLOCK; len -= COPY_BLOCK) {
+		_mm_prefetch(src + COPY_PREFETCH, _MM_HINT_NTA);
+		a = _mm512_loadu_si512((const void *)src);
+		_mm512_stream_si512((void *)dst, a);
+		src += COPY_BLOCK;
+		dst += COPY_BLOCK;
+	}
+	_mm_sfence();
+}
+#endif
+
+/* The stream copy of whole blocks, or NULL to use memcpy() */
+static void (*copy_stream)(char *dst, const char *src, size_t len);
+static int copy_method = -1;
+
+static void copy_select(void)
+{
+	int method = __hugetlb_opts.copy_method;
+
+	copy_stream = NULL;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (method == COPY_AUTO)
+		method = __builtin_cpu_supports("avx512f") ? COPY_AVX512 :
+			__builtin_cpu_supports("avx2") ? COPY_AVX2 :
+			__builtin_cpu_supports("sse2") ? COPY_SSE2 :
+			COPY_MEMCPY;
+
+	if (method == COPY_AVX512 && __builtin_cpu_supports("avx512f"))
+		copy_stream = copy_avx512;
+	else if (method == COPY_AVX2 && __builtin_cpu_supports("avx2"))
+		copy_stream = copy_avx2;
+	else if (method == COPY_SSE2 && __builtin_cpu_supports("sse2"))
+		copy_stream = copy_sse2;
+	else if (method != COPY_MEMCPY)
+		WARNING("CPU lacks the HUGETLB_COPY_METHOD asked for, "
+			"copying with memcpy()\n");
+#endif
+	DEBUG("Large copies use %s\n", !copy_stream ? "memcpy()" :
+	      method == COPY_AVX512 ? "AVX-512 streaming stores" :
+	      method == COPY_AVX2 ? "AVX2 streaming stores" :
+	      "SSE2 streaming stores");
+	__atomic_store_n(&copy_method, method, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy len bytes from src to dst, which must not overlap, bypassing the
+ * caches where the copy is large and the CPU allows.
+ */
+void hugetlbfs_copy(void *dst, const void *src, size_t len)
+{
+	size_t head;
+
+	if (len < COPY_NT_MIN) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	/* Races only pick the same copy twice */
+	if (__atomic_load_n(&copy_method, __ATOMIC_ACQUIRE) < 0)
+		copy_select();
+	if (!copy_stream) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	/* Streaming stores want whole, aligned cache lines */
+	head = -(uintptr_t)dst & (COPY_BLOCK - 1);
+	memcpy(dst, src, head);
+	copy_stream(dst + head, src + head, len - head);
+	len -= head;
+	head += ALIGN_DOWN(len, COPY_BLOCK);
+	memcpy(dst + head, src + head, len & (COPY_BLOCK - 1));
+}
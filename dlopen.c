@@ -0,0 +1,65 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ * dlopen.c - Remap the segments of libraries loaded with dlopen()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+
+#include "hugetlbfs.h"
+
+/*
+ * libhugetlbfs_dlopen.so, for LD_PRELOAD. The libraries a program needs
+ * are remapped at startup, by hugetlbfs_setup_elflink(). Those it loads
+ * later are remapped here, once dlopen() has loaded and initialised them,
+ * and dlclose() lets libhugetlbfs forget the ones unloaded. This is kept
+ * out of libhugetlbfs.so itself, as libraries are now looked up as if
+ * dlopen() had been called from here rather than from the caller.
+ */
+void *dlopen(const char *file, int mode)
+{
+	static void *(*real_dlopen)(const char *file, int mode);
+	void *handle;
+
+	if (!real_dlopen)
+		real_dlopen = dlsym(RTLD_NEXT, "dlopen");
+	if (!real_dlopen)
+		return NULL;
+
+	handle = real_dlopen(file, mode);
+	if (handle)
+		hugetlb_remap_libs();
+	return handle;
+}
+
+int dlclose(void *handle)
+{
+	static int (*real_dlclose)(void *handle);
+	int ret;
+
+	if (!real_dlclose)
+		real_dlclose = dlsym(RTLD_NEXT, "dlclose");
+	if (!real_dlclose)
+		return -1;
+
+	ret = real_dlclose(handle);
+	if (ret == 0)
+		hugetlb_remap_libs();
+	return ret;
+}
@@ -38,6 +38,9 @@
 #include <limits.h>
 #include <elf.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <sys/auxv.h>
 
 #include "version.h"
 #include "hugetlbfs.h"
@@ -48,6 +51,7 @@
 #define Elf_Phdr	Elf64_Phdr
 #define Elf_Dyn		Elf64_Dyn
 #define Elf_Sym		Elf64_Sym
+#define Elf_Nhdr	Elf64_Nhdr
 #define ELF_ST_BIND(x)  ELF64_ST_BIND(x)
 #define ELF_ST_TYPE(x)  ELF64_ST_TYPE(x)
 #else
@@ -55,6 +59,7 @@
 #define Elf_Phdr	Elf32_Phdr
 #define Elf_Dyn		Elf32_Dyn
 #define Elf_Sym		Elf32_Sym
+#define Elf_Nhdr	Elf32_Nhdr
 #define ELF_ST_BIND(x)  ELF64_ST_BIND(x)
 #define ELF_ST_TYPE(x)  ELF64_ST_TYPE(x)
 #endif
@@ -67,6 +72,13 @@
  */
 #define SHARED_TIMEOUT 10
 
+/*
+ * Segments are copied by up to HUGETLB_ELFMAP_THREADS workers, each taking
+ * at least COPY_MIN_CHUNK bytes so small segments are copied by one.
+ */
+#define COPY_MIN_CHUNK		(16UL << 20)
+#define COPY_MAX_THREADS	64
+
 /* This function prints an error message to stderr, then aborts.  It
  * is safe to call, even if the executable segments are presently
  * unmapped.
@@ -158,6 +170,10 @@ static void unmapped_abort(const char *fmt, ...)
 /* The directory to use for sharing readonly segments */
 static char share_readonly_path[PATH_MAX+1];
 
+/* The program's NT_GNU_BUILD_ID in hex, which names its shared files */
+#define BUILD_ID_MAX	64
+static char build_id[2 * BUILD_ID_MAX + 1];
+
 #define MAX_HTLB_SEGS	4
 #define MAX_SEGS	10
 
@@ -168,6 +184,11 @@ struct seg_info {
 	int fd;
 	int index;
 	long page_size;
+	pid_t pid;		/* Child preparing the file, or 0 */
+	bool thp;		/* Copied to staging, not to a file */
+	void *staging;		/* Moved in place by mremap(), or NULL */
+	const char *name;	/* Library path, NULL for the program */
+	char build_id[2 * BUILD_ID_MAX + 1];
 };
 
 struct seg_layout {
@@ -179,6 +200,29 @@ static struct seg_info htlb_seg_table[MAX_HTLB_SEGS];
 static int htlb_num_segs;
 static unsigned long force_remap; /* =0 */
 static long hpage_readonly_size, hpage_writable_size;
+static int copy_threads = 1;	/* Copy workers per segment */
+static bool remap_program = true;
+static bool thp_elfmap;		/* HUGETLB_ELFMAP=thp */
+
+/*
+ * Segments of the shared libraries matching HUGETLB_ELFMAP_LIBS, and of
+ * the program with HUGETLB_ELFMAP=thp. The
+ * table is rebuilt, under libs_lock, each time libraries are loaded.
+ * The libraries already handled are remembered by load address until
+ * they are unloaded.
+ */
+struct lib_info {
+	ElfW(Addr) addr;
+	bool loaded;
+};
+
+static pthread_mutex_t libs_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool libs_enabled;
+static bool libs_runtime;	/* Startup is over, other threads may run */
+static struct seg_info *lib_seg_table;
+static int lib_num_segs, lib_max_segs;
+static struct lib_info *lib_table;
+static int lib_num, lib_max;
 
 /**
  * assemble_path - handy wrapper around snprintf() for building paths
@@ -332,15 +376,17 @@ static void check_bss(unsigned long *start, unsigned long *end)
 }
 
 /**
- * get_shared_file_name - create a shared file name from program name,
- * segment number and current word size
+ * get_shared_file_name - create a shared file name from the program's
+ * build ID, segment number and page size
  * @htlb_seg_info: pointer to program's segment data
  * @file_path: pointer to a PATH_MAX+1 array to store filename in
  *
- * The file name created is *not* intended to be unique, except when
- * the name, gid or phdr number differ. The goal here is to have a
- * standard means of accessing particular segments of particular
- * executables.
+ * A build ID identifies the contents of the program, so the same binary
+ * shares its segments wherever it is installed, and a rebuilt one gets
+ * files of its own. Programs linked without one fall back to a name made
+ * of the program name, phdr number and current word size, which is
+ * *not* intended to be unique; find_or_prepare_shared_file() checks such
+ * files before use.
  *
  * returns:
  *   -1, on failure
@@ -352,12 +398,23 @@ static int get_shared_file_name(struct seg_info *htlb_seg_info, char *file_path)
 	char binary[PATH_MAX+1];
 	char *binary2;
 
+	if (htlb_seg_info->build_id[0]) {
+		assemble_path(file_path, "%s/%s_%d_%ldkB", share_readonly_path,
+			      htlb_seg_info->build_id, htlb_seg_info->index,
+			      htlb_seg_info->page_size / 1024);
+		return 0;
+	}
+
 	memset(binary, 0, sizeof(binary));
-	ret = readlink("/proc/self/exe", binary, PATH_MAX);
-	if (ret < 0) {
-		WARNING("shared_file: readlink() on /proc/self/exe "
-		      "failed: %s\n", strerror(errno));
-		return -1;
+	if (htlb_seg_info->name) {
+		strncpy(binary, htlb_seg_info->name, PATH_MAX);
+	} else {
+		ret = readlink("/proc/self/exe", binary, PATH_MAX);
+		if (ret < 0) {
+			WARNING("shared_file: readlink() on /proc/self/exe "
+			      "failed: %s\n", strerror(errno));
+			return -1;
+		}
 	}
 
 	binary2 = basename(binary);
@@ -373,6 +430,55 @@ static int get_shared_file_name(struct seg_info *htlb_seg_info, char *file_path)
 	return 0;
 }
 
+/* Write the NT_GNU_BUILD_ID note of an object, if any, to id in hex */
+static void read_build_id(struct dl_phdr_info *info, char *id)
+{
+	const ElfW(Phdr) *phdr;
+	const Elf_Nhdr *note;
+	const char *p, *end, *desc;
+	unsigned long align;
+	int i, j;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type != PT_NOTE)
+			continue;
+
+		align = phdr->p_align == 8 ? 8 : 4;
+		p = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+		end = p + phdr->p_memsz;
+		while (p + sizeof(*note) <= end) {
+			note = (const Elf_Nhdr *)p;
+			desc = p + sizeof(*note) + ALIGN(note->n_namesz, align);
+			p = desc + ALIGN(note->n_descsz, align);
+			if (p > end)
+				break;
+			if (note->n_type != NT_GNU_BUILD_ID ||
+			    note->n_namesz != 4 ||
+			    memcmp(note + 1, "GNU", 4) ||
+			    note->n_descsz > BUILD_ID_MAX)
+				continue;
+
+			for (j = 0; j < note->n_descsz; j++)
+				sprintf(id + 2 * j, "%02x",
+					(unsigned char)desc[j]);
+			return;
+		}
+	}
+}
+
+/*
+ * Record the build ID of the main program, the first object
+ * dl_iterate_phdr() reports, in build_id.
+ */
+static int find_build_id(struct dl_phdr_info *info, size_t size, void *data)
+{
+	read_build_id(info, build_id);
+	if (build_id[0])
+		INFO("Build ID %s\n", build_id);
+	return 1;
+}
+
 /* Find the .dynamic program header */
 static int find_dynamic(Elf_Dyn **dyntab, const ElfW(Addr) addr,
 			const Elf_Phdr *phdr, int phnum)
@@ -612,14 +718,38 @@ static unsigned long hugetlb_prev_slice_end(unsigned long addr)
 	return hugetlb_slice_start(addr) - 1;
 }
 
+/* Fill in a segment from its program header */
+static void set_seg_info(struct seg_info *seg, int phnum,
+			 const ElfW(Addr) addr, const ElfW(Phdr) *phdr)
+{
+	int prot = 0;
+
+	if (phdr->p_flags & PF_R)
+		prot |= PROT_READ;
+	if (phdr->p_flags & PF_W)
+		prot |= PROT_WRITE;
+	if (phdr->p_flags & PF_X)
+		prot |= PROT_EXEC;
+
+	seg->vaddr = (void *)(addr + phdr->p_vaddr);
+	seg->filesz = phdr->p_filesz;
+	seg->memsz = phdr->p_memsz;
+	seg->extrasz = 0;
+	seg->prot = prot;
+	seg->index = phnum;
+	seg->pid = 0;
+	seg->thp = false;
+	seg->staging = NULL;
+	seg->name = NULL;
+	seg->build_id[0] = '\0';
+}
+
 /*
  * Store a copy of the given program header
  */
 static int save_phdr(int table_idx, int phnum, const ElfW(Addr) addr,
 		     const ElfW(Phdr) *phdr)
 {
-	int prot = 0;
-
 	if (table_idx >= MAX_HTLB_SEGS) {
 		WARNING("Executable has too many segments (max %d)\n",
 			MAX_HTLB_SEGS);
@@ -627,24 +757,15 @@ static int save_phdr(int table_idx, int phnum, const ElfW(Addr) addr,
 		return -1;
 	}
 
-	if (phdr->p_flags & PF_R)
-		prot |= PROT_READ;
-	if (phdr->p_flags & PF_W)
-		prot |= PROT_WRITE;
-	if (phdr->p_flags & PF_X)
-		prot |= PROT_EXEC;
-
-	htlb_seg_table[table_idx].vaddr = (void *)(addr + phdr->p_vaddr);
-	htlb_seg_table[table_idx].filesz = phdr->p_filesz;
-	htlb_seg_table[table_idx].memsz = phdr->p_memsz;
-	htlb_seg_table[table_idx].prot = prot;
-	htlb_seg_table[table_idx].index = phnum;
+	set_seg_info(&htlb_seg_table[table_idx], phnum, addr, phdr);
+	strcpy(htlb_seg_table[table_idx].build_id, build_id);
 
 	INFO("Segment %d (phdr %d): %#0lx-%#0lx  (filesz=%#0lx) "
 		"(prot = %#0x)\n", table_idx, phnum,
 		(unsigned long) addr + phdr->p_vaddr,
 		(unsigned long) addr + phdr->p_vaddr + phdr->p_memsz,
-		(unsigned long) phdr->p_filesz, (unsigned int) prot);
+		(unsigned long) phdr->p_filesz,
+		(unsigned int) htlb_seg_table[table_idx].prot);
 
 	return 0;
 }
@@ -829,6 +950,199 @@ int parse_elf_partial(struct dl_phdr_info *info, size_t size, void *data)
 	return 1;
 }
 
+/* Whether one of the loaded segments of an object holds addr */
+static int object_contains(struct dl_phdr_info *info, unsigned long addr)
+{
+	const ElfW(Phdr) *phdr;
+	unsigned long start;
+	int i;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		phdr = &info->dlpi_phdr[i];
+		start = info->dlpi_addr + phdr->p_vaddr;
+		if (phdr->p_type == PT_LOAD && addr >= start &&
+		    addr < start + phdr->p_memsz)
+			return 1;
+	}
+	return 0;
+}
+
+/* Whether a library path matches one of the HUGETLB_ELFMAP_LIBS globs */
+static int lib_selected(const char *name)
+{
+	const char *pattern = __hugetlb_opts.elfmap_libs;
+	const char *base = strrchr(name, '/') + 1;
+	char glob[PATH_MAX+1];
+	size_t len;
+
+	while (*pattern) {
+		len = strcspn(pattern, ":");
+		if (len && len <= PATH_MAX) {
+			memcpy(glob, pattern, len);
+			glob[len] = '\0';
+			if (fnmatch(glob, name, 0) == 0 ||
+			    fnmatch(glob, base, 0) == 0)
+				return 1;
+		}
+		pattern += len;
+		if (*pattern)
+			pattern++;
+	}
+	return 0;
+}
+
+/* The page size for a library segment, or 0 to leave it be */
+static long lib_segment_page_size(const ElfW(Phdr) *phdr)
+{
+	long page_size;
+
+	if (hpage_readonly_size || hpage_writable_size)
+		return (phdr->p_flags & PF_W) ? hpage_writable_size :
+			hpage_readonly_size;
+
+	page_size = gethugepagesize();
+	return page_size > 0 ? page_size : 0;
+}
+
+/* Remember a library as handled, until it is unloaded */
+static int add_lib(ElfW(Addr) addr)
+{
+	struct lib_info *table;
+	int i;
+
+	for (i = 0; i < lib_num; i++)
+		if (lib_table[i].addr == addr)
+			return 0;
+
+	if (lib_num == lib_max) {
+		table = realloc(lib_table, (lib_max + 16) * sizeof(*table));
+		if (!table)
+			return 0;
+		lib_table = table;
+		lib_max += 16;
+	}
+	lib_table[lib_num].addr = addr;
+	lib_table[lib_num].loaded = true;
+	lib_num++;
+	return 1;
+}
+
+static struct seg_info *new_lib_seg(void)
+{
+	struct seg_info *table;
+
+	if (lib_num_segs == lib_max_segs) {
+		table = realloc(lib_seg_table,
+				(lib_max_segs + 16) * sizeof(*table));
+		if (!table)
+			return NULL;
+		lib_seg_table = table;
+		lib_max_segs += 16;
+	}
+	return &lib_seg_table[lib_num_segs];
+}
+
+/*
+ * Add the segments of an object to lib_seg_table. Library segments are
+ * packed at base page alignment next to each other, so only the hugepage
+ * aligned part in the middle of each segment is remapped, as
+ * parse_elf_partial() does for the program. Writable segments start after
+ * the part made read-only after relocation (PT_GNU_RELRO). Once startup
+ * is over they are left alone, since a store another thread makes while
+ * one is copied would be lost.
+ */
+static void add_object_segments(struct dl_phdr_info *info)
+{
+	const char *name = info->dlpi_name[0] ? info->dlpi_name : "program";
+	const ElfW(Phdr) *phdr;
+	unsigned long start, end, relro_end = 0;
+	struct seg_info *seg;
+	long seg_psize;
+	int i;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type == PT_GNU_RELRO)
+			relro_end = info->dlpi_addr + phdr->p_vaddr +
+				phdr->p_memsz;
+	}
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		if (libs_runtime && (phdr->p_flags & PF_W))
+			continue;
+		seg_psize = lib_segment_page_size(phdr);
+		if (!seg_psize)
+			continue;
+
+		start = info->dlpi_addr + phdr->p_vaddr;
+		end = start + phdr->p_memsz;
+		if ((phdr->p_flags & PF_W) && relro_end > start)
+			start = relro_end;
+		start = ALIGN(start, seg_psize);
+		end = ALIGN_DOWN(end, seg_psize);
+		if (arch_has_slice_support()) {
+			start = hugetlb_next_slice_start(start);
+			end = hugetlb_prev_slice_end(end) + 1;
+		}
+		if (end <= start) {
+			INFO("%s: segment %d has no aligned %ld kB pages\n",
+			     name, i, seg_psize / 1024);
+			continue;
+		}
+
+		seg = new_lib_seg();
+		if (!seg) {
+			WARNING("Out of memory for the segments of %s\n", name);
+			return;
+		}
+		set_seg_info(seg, i, info->dlpi_addr, phdr);
+		seg->vaddr = (void *)start;
+		seg->filesz = seg->memsz = end - start;
+		seg->page_size = seg_psize;
+		seg->thp = thp_elfmap;
+		if (info->dlpi_name[0])
+			seg->name = info->dlpi_name;
+		if (__hugetlb_opts.sharing && !seg->thp)
+			read_build_id(info, seg->build_id);
+
+		INFO("%s: segment %d (phdr %d): %#0lx-%#0lx (prot = %#0x)\n",
+		     name, lib_num_segs, i, start, end, seg->prot);
+		lib_num_segs++;
+	}
+}
+
+/*
+ * Find the segments of a newly loaded library to remap. The program
+ * itself, the vDSO, the dynamic loader and the libraries whose code runs
+ * while segments are unmapped, this one and the C library, are skipped.
+ */
+static int parse_lib(struct dl_phdr_info *info, size_t size, void *data)
+{
+	if (!info->dlpi_name || !strchr(info->dlpi_name, '/') ||
+	    info->dlpi_addr == getauxval(AT_BASE) ||
+	    object_contains(info, (unsigned long)parse_lib) ||
+	    object_contains(info, (unsigned long)munmap) ||
+	    !lib_selected(info->dlpi_name) || !add_lib(info->dlpi_addr))
+		return 0;
+
+	add_object_segments(info);
+	return 0;
+}
+
+/*
+ * With HUGETLB_ELFMAP=thp, the program's read-only segments are remapped
+ * as a library's are, whether or not it was relinked. As in
+ * parse_elf_partial(), the program comes first.
+ */
+static int parse_elf_thp(struct dl_phdr_info *info, size_t size, void *data)
+{
+	add_object_segments(info);
+	return 1;
+}
+
 /*
  * Verify that a range of memory is unoccupied and usable
  */
@@ -847,6 +1161,66 @@ static void check_range_empty(void *addr, unsigned long len)
 		munmap(p, len);
 }
 
+struct copy_work {
+	pthread_t thread;
+	bool started;
+	void *dst;
+	const void *src;
+	size_t len;
+};
+
+static void *copy_worker(void *arg)
+{
+	struct copy_work *work = arg;
+
+	hugetlbfs_copy(work->dst, work->src, work->len);
+	return NULL;
+}
+
+/*
+ * Copy len bytes of segment data, split into hugepage aligned pieces for
+ * up to copy_threads threads. The calling thread takes the first piece
+ * and any piece whose worker cannot be started.
+ */
+static void copy_segment_data(void *dst, const void *src, size_t len,
+			      long hpage_size)
+{
+	struct copy_work work[COPY_MAX_THREADS];
+	size_t chunk, offset;
+	int nr_threads = copy_threads;
+	int i;
+
+	if (nr_threads > len / COPY_MIN_CHUNK)
+		nr_threads = len / COPY_MIN_CHUNK;
+	if (nr_threads <= 1) {
+		hugetlbfs_copy(dst, src, len);
+		return;
+	}
+
+	chunk = ALIGN(len / nr_threads, hpage_size);
+	for (i = 0, offset = 0; i < nr_threads && offset < len; i++) {
+		work[i].dst = dst + offset;
+		work[i].src = src + offset;
+		work[i].len = chunk;
+		if (offset + chunk > len)
+			work[i].len = len - offset;
+		work[i].started = false;
+		offset += work[i].len;
+
+		if (i && pthread_create(&work[i].thread, NULL, copy_worker,
+					&work[i]) == 0)
+			work[i].started = true;
+	}
+	nr_threads = i;
+
+	for (i = 0; i < nr_threads; i++)
+		if (!work[i].started)
+			copy_worker(&work[i]);
+	for (i = 0; i < nr_threads; i++)
+		if (work[i].started)
+			pthread_join(work[i].thread, NULL);
+}
+
 /*
  * Copy a program segment into a huge page. If possible, try to copy the
  * smallest amount of data possible, unless the user disables this
@@ -891,6 +1265,13 @@ static int prepare_segment(struct seg_info *seg)
 	if (end != new_end)
 		check_range_empty(end, new_end - end);
 
+	/* Allocate the hugepages up front rather than die copying */
+	if (hugetlbfs_populate_fd(seg->fd, 0, size) != 0) {
+		WARNING("Not enough hugepages for %ld kB segment\n",
+			size / 1024);
+		return -1;
+	}
+
 	/* Create the temporary huge page mmap */
 	p = mmap(NULL, size, PROT_READ|PROT_WRITE,
 				MAP_SHARED|mmap_reserve, seg->fd, 0);
@@ -911,7 +1292,8 @@ static int prepare_segment(struct seg_info *seg)
 	 */
 	INFO("Mapped hugeseg at %p. Copying %#0lx bytes and %#0lx extra bytes"
 		" from %p...", p, seg->filesz, seg->extrasz, seg->vaddr);
-	memcpy(p + offset, seg->vaddr, seg->filesz + seg->extrasz);
+	copy_segment_data(p + offset, seg->vaddr, seg->filesz + seg->extrasz,
+			  hpage_size);
 	INFO_CONT("done\n");
 
 	munmap(p, size);
@@ -919,6 +1301,61 @@ static int prepare_segment(struct seg_info *seg)
 	return 0;
 }
 
+/*
+ * With HUGETLB_ELFMAP=thp, copy a read-only segment into anonymous memory
+ * aligned to the transparent hugepage size, for remap_segments() to move
+ * in its place. The copy is collapsed into hugepages now, rather than
+ * left to khugepaged, and made read-only before it is moved. This runs in
+ * the process itself, since the copy must end up in its address space,
+ * and takes no pages from the hugetlb pool.
+ */
+static int prepare_thp_segment(struct seg_info *seg)
+{
+	long thp_size = seg->page_size;
+	unsigned long offset, size;
+	char *reserve, *p;
+	void *start;
+
+	start = (void *)ALIGN_DOWN((unsigned long)seg->vaddr, thp_size);
+	offset = seg->vaddr - start;
+	size = ALIGN(offset + seg->memsz, thp_size);
+
+	reserve = mmap(NULL, size + thp_size, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (reserve == MAP_FAILED) {
+		WARNING("Couldn't map THP segment to copy data: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	p = (char *)ALIGN((unsigned long)reserve, thp_size);
+	if (p != reserve)
+		munmap(reserve, p - reserve);
+	munmap(p + size, reserve + thp_size - p);
+
+	if (madvise(p, size, MADV_HUGEPAGE) != 0)
+		INFO("MADV_HUGEPAGE of THP segment failed: %s\n",
+		     strerror(errno));
+
+	INFO("Mapped THP segment at %p. Copying %#0lx bytes from %p...", p,
+	     seg->filesz + seg->extrasz, seg->vaddr);
+	copy_segment_data(p + offset, seg->vaddr, seg->filesz + seg->extrasz,
+			  thp_size);
+	INFO_CONT("done\n");
+
+	if (madvise(p, size, MADV_COLLAPSE) != 0)
+		INFO("MADV_COLLAPSE of THP segment failed: %s, part of it "
+		     "uses base pages\n", strerror(errno));
+	if (mprotect(p, size, seg->prot) != 0) {
+		WARNING("Couldn't protect THP segment: %s\n", strerror(errno));
+		munmap(p, size);
+		return -1;
+	}
+
+	seg->staging = p;
+	STAT_ADD(elflink_bytes_copied, seg->filesz + seg->extrasz);
+	return 0;
+}
+
 /*
  * [PPC] Prior to 2.6.22 (which added slices), our temporary hugepage
  * mappings are placed in the segment before the stack. This 'taints' that
@@ -927,10 +1364,18 @@ static int prepare_segment(struct seg_info *seg)
  * mappings in a child process, we can avoid this problem.
  *
  * This does not adversely affect non-PPC platforms so do it everywhere.
+ * It also lets every segment be prepared at once, each by its own child:
+ * fork_prepare_segment() starts the child and wait_prepared_segment()
+ * collects it.
+ *
+ * returns:
+ *  -1, on error
+ *  the pid of the child preparing the segment, on success
  */
-static int fork_and_prepare_segment(struct seg_info *htlb_seg_info)
+static pid_t fork_prepare_segment(struct seg_info *htlb_seg_info)
 {
-	int pid, ret, status;
+	pid_t pid;
+	int ret;
 
 	if ((pid = fork()) < 0) {
 		WARNING("fork failed");
@@ -945,6 +1390,13 @@ static int fork_and_prepare_segment(struct seg_info *htlb_seg_info)
 		else
 			exit(0);
 	}
+	return pid;
+}
+
+static int wait_prepared_segment(struct seg_info *htlb_seg_info, pid_t pid)
+{
+	int ret, status;
+
 	ret = waitpid(pid, &status, 0);
 	if (ret == -1) {
 		WARNING("waitpid failed");
@@ -954,10 +1406,51 @@ static int fork_and_prepare_segment(struct seg_info *htlb_seg_info)
 	if (WEXITSTATUS(status) != 0)
 		return -1;
 
+	/* The child did the copy, count it here where it is seen */
+	STAT_ADD(elflink_bytes_copied,
+		 htlb_seg_info->filesz + htlb_seg_info->extrasz);
 	INFO("Prepare succeeded\n");
 	return 0;
 }
 
+static int fork_and_prepare_segment(struct seg_info *htlb_seg_info)
+{
+	pid_t pid = fork_prepare_segment(htlb_seg_info);
+
+	if (pid < 0)
+		return -1;
+	return wait_prepared_segment(htlb_seg_info, pid);
+}
+
+/*
+ * Whether a shared file already prepared holds this segment: it must be
+ * as large as prepare_segment() makes it, for the same page size, and
+ * start and end with the same data.
+ */
+static int shared_file_matches(struct seg_info *seg, int fd)
+{
+	unsigned long offset, len;
+	char buf[4096];
+	struct stat sb;
+
+	offset = seg->vaddr - (void *)ALIGN_DOWN((unsigned long)seg->vaddr,
+						 seg->page_size);
+	if (fstat(fd, &sb) != 0 || sb.st_blksize != seg->page_size ||
+	    sb.st_size != ALIGN(offset + seg->filesz + seg->extrasz,
+				seg->page_size))
+		return 0;
+
+	len = seg->filesz < sizeof(buf) ? seg->filesz : sizeof(buf);
+	if (pread(fd, buf, len, offset) != len ||
+	    memcmp(buf, seg->vaddr, len))
+		return 0;
+	offset += seg->filesz - len;
+	if (pread(fd, buf, len, offset) != len ||
+	    memcmp(buf, seg->vaddr + seg->filesz - len, len))
+		return 0;
+	return 1;
+}
+
 /**
  * find_or_prepare_shared_file - get one shareable file
  * @htlb_seg_info: pointer to program's segment data
@@ -1012,6 +1505,19 @@ static int find_or_prepare_shared_file(struct seg_info *htlb_seg_info)
 		fds = open(final_path, O_RDONLY);
 		errnos = errno;
 
+		if (fds >= 0 && !shared_file_matches(htlb_seg_info, fds)) {
+			/* Left by another build, prepare it again */
+			WARNING("shared_file: %s does not match this program, "
+				"replacing it\n", final_path);
+			close(fds);
+			fds = -1;
+			errnos = ENOENT;
+			/* Whoever holds the lock file renames over it */
+			if (fdx < 0 && unlink(final_path) != 0)
+				WARNING("shared_file: unable to remove %s: "
+					"%s\n", final_path, strerror(errno));
+		}
+
 		if (fds >= 0) {
 			/* Got an already-prepared file -> use it */
 			if (fdx > 0) {
@@ -1080,11 +1586,16 @@ static int find_or_prepare_shared_file(struct seg_info *htlb_seg_info)
  * sharing or not
  * @htlb_seg_info: pointer to program's segment data
  *
+ * Shared files are ready on return. Unlinked ones are still being
+ * prepared by a child that must be waited for with
+ * wait_prepared_segment().
+ *
  * returns:
  *  -1, on error
- *  0, on success
+ *  0, on success, with the file ready
+ *  the pid of the child preparing the file, on success
  */
-static int obtain_prepared_file(struct seg_info *htlb_seg_info)
+static pid_t obtain_prepared_file(struct seg_info *htlb_seg_info)
 {
 	int fd = -1;
 	int ret;
@@ -1104,7 +1615,30 @@ static int obtain_prepared_file(struct seg_info *htlb_seg_info)
 		return -1;
 	htlb_seg_info->fd = fd;
 
-	return fork_and_prepare_segment(htlb_seg_info);
+	return fork_prepare_segment(htlb_seg_info);
+}
+
+/* The flags, other than MAP_FIXED, to map a segment's file with */
+static int segment_mmap_flags(struct seg_info *seg)
+{
+	int mmap_flags = MAP_PRIVATE;
+
+	/* If requested, make no reservations */
+	if (__hugetlb_opts.no_reserve)
+		mmap_flags |= MAP_NORESERVE;
+
+	/*
+	 * If this is a read-only mapping whose contents are
+	 * entirely contained within the file, then use MAP_NORESERVE.
+	 * The assumption is that the pages already exist in the
+	 * page cache for the hugetlbfs file since it was prepared
+	 * earlier and that mprotect() will not be called which would
+	 * require a COW
+	 */
+	if (!(seg->prot & PROT_WRITE) && seg->filesz == seg->memsz)
+		mmap_flags |= MAP_NORESERVE;
+
+	return mmap_flags;
 }
 
 static void remap_segments(struct seg_info *seg, int num)
@@ -1114,7 +1648,6 @@ static void remap_segments(struct seg_info *seg, int num)
 	unsigned long start, offset, mapsize;
 	long page_size = getpagesize();
 	long hpage_size;
-	int mmap_flags;
 
 	/*
 	 * XXX: The bogus call to mmap below forces ld.so to resolve the
@@ -1130,6 +1663,9 @@ static void remap_segments(struct seg_info *seg, int num)
 	 * (ie. essentially any library function...)
 	 */
 	for (i = 0; i < num; i++) {
+		/* mremap() below replaces staged segments in one go */
+		if (seg[i].staging)
+			continue;
 		start = ALIGN_DOWN((unsigned long)seg[i].vaddr, page_size);
 		offset = (unsigned long)(seg[i].vaddr - start);
 		mapsize = ALIGN(offset + seg[i].memsz, page_size);
@@ -1145,26 +1681,26 @@ static void remap_segments(struct seg_info *seg, int num)
 		start = ALIGN_DOWN((unsigned long)seg[i].vaddr, hpage_size);
 		offset = (unsigned long)(seg[i].vaddr - start);
 		mapsize = ALIGN(offset + seg[i].memsz, hpage_size);
-		mmap_flags = MAP_PRIVATE|MAP_FIXED;
-
-		/* If requested, make no reservations */
-		if (__hugetlb_opts.no_reserve)
-			mmap_flags |= MAP_NORESERVE;
 
 		/*
-		 * If this is a read-only mapping whose contents are
-		 * entirely contained within the file, then use MAP_NORESERVE.
-		 * The assumption is that the pages already exist in the
-		 * page cache for the hugetlbfs file since it was prepared
-		 * earlier and that mprotect() will not be called which would
-		 * require a COW
+		 * A staged copy replaces the old pages in one step, so a
+		 * failure leaves them where they were.
 		 */
-		if (!(seg[i].prot & PROT_WRITE) &&
-				seg[i].filesz == seg[i].memsz)
-			mmap_flags |= MAP_NORESERVE;
-
-		p = mmap((void *) start, mapsize, seg[i].prot,
-			 mmap_flags, seg[i].fd, 0);
+		if (seg[i].staging) {
+			p = mremap(seg[i].staging, mapsize, mapsize,
+				   MREMAP_MAYMOVE|MREMAP_FIXED, (void *) start);
+			if (p == MAP_FAILED) {
+				WARNING("Failed to move hugepage segment %u "
+					"to %p: %s\n", i, (void *) start,
+					strerror(errno));
+				munmap(seg[i].staging, mapsize);
+				continue;
+			}
+		} else {
+			p = mmap((void *) start, mapsize, seg[i].prot,
+				 segment_mmap_flags(&seg[i]) | MAP_FIXED,
+				 seg[i].fd, 0);
+		}
 		if (p == MAP_FAILED)
 			unmapped_abort("Failed to map hugepage segment %u: "
 					"%p-%p (errno=%u)\n", i, start,
@@ -1231,7 +1767,19 @@ static int check_env(void)
 		      "segments\n", __hugetlb_opts.elfmap);
 		return -1;
 	}
-	if (__hugetlb_opts.elfmap && set_hpage_sizes(__hugetlb_opts.elfmap)) {
+	if (__hugetlb_opts.elfmap &&
+		(strcasecmp(__hugetlb_opts.elfmap, "thp") == 0)) {
+		hpage_readonly_size = thp_page_size();
+		if (!hpage_readonly_size) {
+			WARNING("HUGETLB_ELFMAP=thp, but transparent hugepages "
+				"are unavailable\n");
+			return -1;
+		}
+		INFO("HUGETLB_ELFMAP=thp, remapping read-only segments onto "
+		     "transparent hugepages\n");
+		thp_elfmap = true;
+	} else if (__hugetlb_opts.elfmap &&
+		   set_hpage_sizes(__hugetlb_opts.elfmap)) {
 		WARNING("Cannot set elfmap page sizes: %s", strerror(errno));
 		return -1;
 	}
@@ -1246,8 +1794,14 @@ static int check_env(void)
 					"binaries\n");
 			INFO("Disabling filesz copy optimization\n");
 			__hugetlb_opts.min_copy = false;
-		} else {
-			if (&__executable_start) {
+		} else if (&__executable_start && !thp_elfmap) {
+			/* HUGETLB_ELFMAP=thp does not need relinking */
+			if (__hugetlb_opts.elfmap_libs) {
+				INFO("LD_PRELOAD is incompatible with "
+				     "remapping the program, remapping only "
+				     "shared libraries\n");
+				remap_program = false;
+			} else {
 				WARNING("LD_PRELOAD is incompatible with "
 					"segment remapping\n");
 				WARNING("Segment remapping has been "
@@ -1285,6 +1839,9 @@ static int check_env(void)
  */
 static int parse_elf()
 {
+	if (__hugetlb_opts.sharing)
+		dl_iterate_phdr(find_build_id, NULL);
+
 	if (force_remap)
 		dl_iterate_phdr(parse_elf_partial, NULL);
 	else
@@ -1298,50 +1855,260 @@ static int parse_elf()
 	return 0;
 }
 
-void hugetlbfs_setup_elflink(void)
+/* Find a share directory, once */
+static int setup_share_path(void)
 {
-	int i, ret;
+	static int ret = -1;
+	long page_size;
 
-	if (check_env())
-		return;
+	if (ret == 0)
+		return 0;
 
-	if (parse_elf())
-		return;
+	/*
+	 * If HUGETLB_ELFMAP is undefined but a shareable segment has
+	 * PF_LINUX_HUGETLB set, segment remapping will occur using the
+	 * default huge page size.
+	 */
+	page_size = hpage_readonly_size ? hpage_readonly_size :
+		gethugepagesize();
 
-	INFO("libhugetlbfs version: %s\n", VERSION);
+	ret = find_or_create_share_path(page_size);
+	if (ret != 0)
+		WARNING("Segment remapping is disabled");
+	return ret;
+}
 
-	/* Do we need to find a share directory */
-	if (__hugetlb_opts.sharing) {
-		/*
-		 * If HUGETLB_ELFMAP is undefined but a shareable segment has
-		 * PF_LINUX_HUGETLB set, segment remapping will occur using the
-		 * default huge page size.
-		 */
-		long page_size = hpage_readonly_size ?
-			hpage_readonly_size : gethugepagesize();
+/* Drop the file or staging copy of a segment that was not remapped */
+static void release_segment(struct seg_info *seg)
+{
+	unsigned long start;
 
-		ret = find_or_create_share_path(page_size);
-		if (ret != 0) {
-			WARNING("Segment remapping is disabled");
-			return;
-		}
+	if (seg->staging) {
+		start = ALIGN_DOWN((unsigned long)seg->vaddr, seg->page_size);
+		munmap(seg->staging, ALIGN((unsigned long)seg->vaddr - start +
+					   seg->memsz, seg->page_size));
+	} else {
+		close(seg->fd);
 	}
+}
+
+/*
+ * Fill a hugetlbfs file, or a THP staging copy, with the data of each
+ * segment.
+ *
+ * returns:
+ *  -1, on failure, with every file closed
+ *  0, on success
+ */
+static int prepare_segments(struct seg_info *seg, int num)
+{
+	int i, n, ret, workers;
+
+	/*
+	 * Segments are prepared alongside each other, unless
+	 * HUGETLB_ELFMAP_THREADS=1, and the workers left over copy parts
+	 * of the large ones.
+	 */
+	workers = __hugetlb_opts.elfmap_threads;
+	if (!workers)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	copy_threads = workers / num;
+	if (copy_threads < 1)
+		copy_threads = 1;
+	if (copy_threads > COPY_MAX_THREADS)
+		copy_threads = COPY_MAX_THREADS;
 
 	/* Step 1.  Obtain hugepage files with our program data */
-	for (i = 0; i < htlb_num_segs; i++) {
-		ret = obtain_prepared_file(&htlb_seg_table[i]);
-		if (ret < 0) {
+	ret = 0;
+	for (n = 0; n < num; n++) {
+		if (seg[n].thp)
+			seg[n].pid = prepare_thp_segment(&seg[n]);
+		else
+			seg[n].pid = obtain_prepared_file(&seg[n]);
+		if (seg[n].pid < 0) {
+			WARNING("Failed to setup hugetlbfs file for segment "
+					"%d\n", n);
+			ret = -1;
+			break;
+		}
+		if (seg[n].pid && workers == 1) {
+			ret = wait_prepared_segment(&seg[n], seg[n].pid);
+			seg[n].pid = 0;
+			if (ret < 0) {
+				WARNING("Failed to setup hugetlbfs file for "
+					"segment %d\n", n);
+				n++;
+				break;
+			}
+		}
+	}
+
+	/* Step 2.  Wait for the children, all of them even after a failure */
+	for (i = 0; i < n; i++) {
+		if (seg[i].pid > 0 &&
+		    wait_prepared_segment(&seg[i], seg[i].pid) < 0) {
 			WARNING("Failed to setup hugetlbfs file for segment "
 					"%d\n", i);
+			ret = -1;
+		}
+	}
+	if (ret < 0) {
+		/* Close files we have already prepared */
+		for (i = n - 1; i >= 0; i--)
+			release_segment(&seg[i]);
+	}
+	return ret;
+}
 
-			/* Close files we have already prepared */
-			for (i--; i >= 0; i--)
-				close(htlb_seg_table[i].fd);
+/*
+ * Once startup is over, map the prepared files of the segments elsewhere
+ * first, so that remap_segments() moves each in place with mremap()
+ * rather than leave a hole that other threads could fault on, or map
+ * into, while the old pages are replaced.
+ *
+ * returns:
+ *  -1, on failure, with every file closed or unmapped
+ *  0, on success
+ */
+static int stage_segment_files(struct seg_info *seg, int num)
+{
+	unsigned long start, mapsize;
+	int i, ret = 0;
+	void *p;
 
+	for (i = 0; i < num; i++) {
+		if (seg[i].staging)
+			continue;
+		start = ALIGN_DOWN((unsigned long)seg[i].vaddr,
+				   seg[i].page_size);
+		mapsize = ALIGN((unsigned long)seg[i].vaddr - start +
+				seg[i].memsz, seg[i].page_size);
+		p = mmap(NULL, mapsize, seg[i].prot,
+			 segment_mmap_flags(&seg[i]), seg[i].fd, 0);
+		if (p == MAP_FAILED) {
+			WARNING("Couldn't map hugepage segment %d to move it: "
+				"%s\n", i, strerror(errno));
+			ret = -1;
+			continue;
+		}
+		close(seg[i].fd);
+		seg[i].staging = p;
+	}
+
+	if (ret < 0)
+		for (i = 0; i < num; i++)
+			release_segment(&seg[i]);
+	return ret;
+}
+
+/* Remap the segments that parse adds to lib_seg_table */
+static void remap_new_segments(int (*parse)(struct dl_phdr_info *info,
+					    size_t size, void *data))
+{
+	int i;
+
+	pthread_mutex_lock(&libs_lock);
+	lib_num_segs = 0;
+	dl_iterate_phdr(parse, NULL);
+	if (lib_num_segs == 0 ||
+	    (__hugetlb_opts.sharing && !thp_elfmap && setup_share_path()) ||
+	    prepare_segments(lib_seg_table, lib_num_segs) < 0 ||
+	    (libs_runtime &&
+	     stage_segment_files(lib_seg_table, lib_num_segs) < 0))
+		goto out;
+
+	remap_segments(lib_seg_table, lib_num_segs);
+	STAT_ADD(elflink_segments, lib_num_segs);
+	/* The mappings hold the files now */
+	for (i = 0; i < lib_num_segs; i++)
+		if (!lib_seg_table[i].staging)
+			close(lib_seg_table[i].fd);
+out:
+	pthread_mutex_unlock(&libs_lock);
+}
+
+void hugetlbfs_setup_elflink(void)
+{
+	if (check_env())
+		return;
+
+	if (remap_program && thp_elfmap) {
+		remap_new_segments(parse_elf_thp);
+	} else if (remap_program && parse_elf() == 0) {
+		INFO("libhugetlbfs version: %s\n", VERSION);
+
+		/* Do we need to find a share directory */
+		if (__hugetlb_opts.sharing && setup_share_path())
 			return;
+
+		if (prepare_segments(htlb_seg_table, htlb_num_segs) == 0) {
+			/* Step 3.  Unmap the old segments, map in the new ones */
+			remap_segments(htlb_seg_table, htlb_num_segs);
+			STAT_ADD(elflink_segments, htlb_num_segs);
+		}
+	}
+
+	if (__hugetlb_opts.elfmap_libs) {
+		INFO("HUGETLB_ELFMAP_LIBS=%s, remapping shared libraries\n",
+		     __hugetlb_opts.elfmap_libs);
+		libs_enabled = true;
+		hugetlbfs_remap_libs();
+
+		/*
+		 * Libraries loaded later are moved onto hugepages with
+		 * mremap(), which hugetlbfs mappings allow from Linux 5.16.
+		 * Before that the kernel unmaps the target range and only
+		 * then refuses, so the library would be lost.
+		 */
+		libs_runtime = true;
+		if (!thp_elfmap &&
+		    hugetlbfs_test_feature(HUGETLB_FEATURE_MREMAP) <= 0) {
+			INFO("Kernel cannot mremap() hugepages, libraries "
+			     "loaded later are not remapped\n");
+			libs_enabled = false;
 		}
 	}
+}
+
+/*
+ * Remap the segments of the libraries matching HUGETLB_ELFMAP_LIBS that
+ * have been loaded since the last call: at startup, and from
+ * hugetlb_remap_libs().
+ */
+void hugetlbfs_remap_libs(void)
+{
+	if (libs_enabled)
+		remap_new_segments(parse_lib);
+}
+
+static int mark_loaded_lib(struct dl_phdr_info *info, size_t size, void *data)
+{
+	int i;
+
+	for (i = 0; i < lib_num; i++)
+		if (lib_table[i].addr == info->dlpi_addr)
+			lib_table[i].loaded = true;
+	return 0;
+}
+
+/*
+ * Forget the libraries that have been unloaded, so that whatever is
+ * loaded at their address next is remapped.
+ */
+void hugetlbfs_forget_libs(void)
+{
+	int i, n;
+
+	if (!libs_enabled)
+		return;
 
-	/* Step 3.  Unmap the old segments, map in the new ones */
-	remap_segments(htlb_seg_table, htlb_num_segs);
+	pthread_mutex_lock(&libs_lock);
+	for (i = 0; i < lib_num; i++)
+		lib_table[i].loaded = false;
+	dl_iterate_phdr(mark_loaded_lib, NULL);
+	for (i = 0, n = 0; i < lib_num; i++)
+		if (lib_table[i].loaded)
+			lib_table[n++] = lib_table[i];
+	lib_num = n;
+	pthread_mutex_unlock(&libs_lock);
 }
@@ -0,0 +1,1110 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ * heap.c - malloc() replacement on a hugepage heap for glibc without
+ *          __morecore
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "hugetlbfs.h"
+#include "libhugetlbfs_internal.h"
+
+/*
+ * glibc 2.34 removed the __morecore hook that let glibc's malloc take its
+ * memory from hugetlbfs_morecore(). Instead, this file provides malloc()
+ * and friends, which the dynamic linker binds in place of glibc's when
+ * libhugetlbfs is preloaded or linked ahead of libc. Until
+ * hugetlbfs_setup_morecore() hands over a heap, and whenever the hugepage
+ * heap cannot satisfy a request, the calls are passed on to glibc, so
+ * pointers of both kinds are live at once. Ours are told apart by
+ * address, as the heap is a single range grown with sbrk() semantics by
+ * the same morecore functions glibc used to call.
+ *
+ * The heap is managed in pages of HEAP_PAGE_SIZE bytes. Requests above
+ * HEAP_MAX_SMALL get a span of whole pages. Smaller ones are rounded up
+ * to a size class, and each class carves its objects from runs of pages
+ * it takes from the page heap. A page map, indexed by page number,
+ * records the class of every page of a run and the length of every span
+ * at its first and last page, which is how free() finds the size of an
+ * object and how freed spans find free neighbours to merge with.
+ *
+ * Each thread keeps a magazine of objects for every class, as the slab
+ * arena does, so that most small allocations and frees take no lock.
+ * Lock order is class lock, then heap lock.
+ *
+ * Only the top of the heap can be unmapped, so large free spans in the
+ * middle have their hugepages released back to the pool instead, by
+ * malloc_trim() and, with HUGETLB_MORECORE_SHRINK, by free(). A released
+ * span is marked so that its pages are faulted back before it is used.
+ * The first page of a span, which links it into the free lists, is never
+ * released.
+ *
+ * When the heap cannot grow, because the pool is empty or something has
+ * been mapped above it, requests it cannot serve go to glibc and growing
+ * is not tried again until a backoff has passed. The backoff doubles
+ * from HEAP_BACKOFF_MIN with every failure, up to HUGETLB_MORECORE_BACKOFF
+ * milliseconds, and is cleared once the heap grows again, after which new
+ * requests are back on hugepages.
+ */
+#define HEAP_PAGE_SHIFT		13
+#define HEAP_PAGE_SIZE		(1UL << HEAP_PAGE_SHIFT)
+#define HEAP_MIN_ALIGN		16
+#define HEAP_NR_CLASSES		24
+#define HEAP_MAX_SMALL		(32UL * 1024)
+#define HEAP_RUN_SIZE		(64UL * 1024)
+#define HEAP_MAG_MAX		64
+#define HEAP_MAG_MIN		4
+#define HEAP_FREE_LISTS		128
+#define HEAP_BACKOFF_MIN	1000000ULL	/* ns */
+
+/* The page map is a two level table, each leaf covering 1GB of heap */
+#define MAP_LEAF_SHIFT		(30 - HEAP_PAGE_SHIFT)
+#define MAP_LEAF_PAGES		(1UL << MAP_LEAF_SHIFT)
+#define MAP_ROOT_SIZE		4096
+
+#define PM_TYPE_MASK		(3U << 30)
+#define PM_FREE			(1U << 30)	/* Free span of n pages */
+#define PM_LARGE		(2U << 30)	/* Allocated span of n pages */
+#define PM_SMALL		(3U << 30)	/* Run page of a size class */
+#define PM_VAL(e)		((e) & ~PM_TYPE_MASK)
+
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+struct heap_span {
+	struct heap_span *next;
+	struct heap_span *prev;
+	int released;		/* Some of its pages may be unbacked */
+};
+
+struct heap_class {
+	pthread_mutex_t lock;
+	void *free;		/* Intrusive list of freed objects */
+	char *bump;		/* Uncarved space in the current run */
+	char *bump_end;
+} __attribute__((aligned(64)));
+
+struct heap_magazine {
+	unsigned int count;
+	void *objs[HEAP_MAG_MAX];
+};
+
+struct heap_tcache {
+	struct heap_magazine mags[HEAP_NR_CLASSES];
+};
+
+static struct {
+	pthread_mutex_t lock;		/* Protects everything but classes */
+	void *(*grow)(ptrdiff_t);	/* morecore, sbrk() semantics */
+	long (*release)(void *, void *, void *, size_t);
+	long (*restore)(void *, void *, void *, size_t);
+	long hpage_size;
+	size_t trim_threshold;		/* 0 if the heap must not shrink */
+	char *start;
+	char *end;			/* Top of what grow() has given us */
+	unsigned long long fail_since;	/* When grow() began failing, or 0 */
+	unsigned long long retry_at;
+	unsigned long long backoff;
+	uint32_t *map[MAP_ROOT_SIZE];
+	struct heap_span *free[HEAP_FREE_LISTS];
+	pthread_key_t key;
+	size_t (*libc_usable_size)(void *);
+	int (*libc_trim)(size_t);
+	int enabled;
+	struct heap_class classes[HEAP_NR_CLASSES];
+} heap = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Initial-exec so that reaching them never allocates */
+#define HEAP_TLS __thread __attribute__((tls_model("initial-exec")))
+
+static HEAP_TLS struct heap_tcache *heap_tcache_tls;
+static HEAP_TLS int heap_busy;		/* Inside grow(), use glibc */
+
+/* Set on exit of a thread whose cache has been drained */
+#define TCACHE_DEAD	((struct heap_tcache *)1)
+
+static int heap_active(void)
+{
+	return __atomic_load_n(&heap.enabled, __ATOMIC_ACQUIRE) && !heap_busy;
+}
+
+static int heap_owns(void *ptr)
+{
+	char *start = __atomic_load_n(&heap.start, __ATOMIC_RELAXED);
+	char *end = __atomic_load_n(&heap.end, __ATOMIC_RELAXED);
+
+	return (char *)ptr >= start && (char *)ptr < end;
+}
+
+/*
+ * Size classes are 16 to 128 bytes in steps of 16, then the powers of two
+ * up to 32KB with one class half-way between each. Every power of two is
+ * a class, which memalign() relies on.
+ */
+static size_t class_size(int cls)
+{
+	int shift;
+
+	if (cls < 8)
+		return (cls + 1) * 16;
+	shift = (cls - 8) / 2 + 7;
+	if (cls & 1)
+		return 1UL << (shift + 1);
+	return 3UL << (shift - 1);
+}
+
+static int size_to_class(size_t size)
+{
+	int shift;
+
+	if (size <= 128)
+		return size ? (size - 1) >> 4 : 0;
+
+	/* size lies in (2^shift, 2^(shift+1)] */
+	shift = (sizeof(long) * 8 - 1) - __builtin_clzl(size - 1);
+	return 8 + (shift - 7) * 2 + (size > (3UL << (shift - 1)));
+}
+
+static unsigned long class_run_pages(int cls)
+{
+	size_t run = 8 * class_size(cls);
+
+	if (run < HEAP_RUN_SIZE)
+		run = HEAP_RUN_SIZE;
+	return ALIGN(run, HEAP_PAGE_SIZE) >> HEAP_PAGE_SHIFT;
+}
+
+static unsigned int mag_capacity(int cls)
+{
+	unsigned long cap = 2 * HEAP_RUN_SIZE / class_size(cls);
+
+	if (cap > HEAP_MAG_MAX)
+		return HEAP_MAG_MAX;
+	if (cap < HEAP_MAG_MIN)
+		return HEAP_MAG_MIN;
+	return cap;
+}
+
+static unsigned long page_index(void *ptr)
+{
+	return ((char *)ptr - heap.start) >> HEAP_PAGE_SHIFT;
+}
+
+static char *page_addr(unsigned long idx)
+{
+	return heap.start + (idx << HEAP_PAGE_SHIFT);
+}
+
+static uint32_t map_get(unsigned long idx)
+{
+	uint32_t *leaf = heap.map[idx >> MAP_LEAF_SHIFT];
+
+	return leaf ? leaf[idx & (MAP_LEAF_PAGES - 1)] : 0;
+}
+
+/* Called with the heap lock held. Leaves are only added. */
+static uint32_t *map_leaf(unsigned long root)
+{
+	uint32_t *leaf;
+
+	if (root >= MAP_ROOT_SIZE)
+		return NULL;
+	leaf = heap.map[root];
+	if (!leaf) {
+		leaf = mmap(NULL, MAP_LEAF_PAGES * sizeof(uint32_t),
+			    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+			    -1, 0);
+		if (leaf == MAP_FAILED)
+			return NULL;
+		__atomic_store_n(&heap.map[root], leaf, __ATOMIC_RELEASE);
+	}
+	return leaf;
+}
+
+static int map_set(unsigned long idx, uint32_t val)
+{
+	uint32_t *leaf = map_leaf(idx >> MAP_LEAF_SHIFT);
+
+	if (!leaf)
+		return -1;
+	leaf[idx & (MAP_LEAF_PAGES - 1)] = val;
+	return 0;
+}
+
+/* Make sure every page of [idx, idx + n) can be recorded */
+static int map_reserve(unsigned long idx, unsigned long n)
+{
+	unsigned long root;
+
+	for (root = idx >> MAP_LEAF_SHIFT;
+			root <= (idx + n - 1) >> MAP_LEAF_SHIFT; root++)
+		if (!map_leaf(root))
+			return -1;
+	return 0;
+}
+
+/* Mark the first and last page of a span, all pages for a run */
+static int map_span(unsigned long idx, unsigned long n, uint32_t type,
+		    uint32_t val)
+{
+	unsigned long i;
+
+	if (type == PM_SMALL) {
+		for (i = 0; i < n; i++)
+			if (map_set(idx + i, type | val))
+				return -1;
+		return 0;
+	}
+	if (map_set(idx, type | val) || map_set(idx + n - 1, type | val))
+		return -1;
+	return 0;
+}
+
+static struct heap_span **free_list(unsigned long n)
+{
+	return &heap.free[n < HEAP_FREE_LISTS ? n : HEAP_FREE_LISTS - 1];
+}
+
+static void span_unlink(unsigned long idx, unsigned long n)
+{
+	struct heap_span *span = (struct heap_span *)page_addr(idx);
+
+	if (span->prev)
+		span->prev->next = span->next;
+	else
+		*free_list(n) = span->next;
+	if (span->next)
+		span->next->prev = span->prev;
+}
+
+static void span_link(unsigned long idx, unsigned long n, int released)
+{
+	struct heap_span *span = (struct heap_span *)page_addr(idx);
+	struct heap_span **list = free_list(n);
+
+	map_span(idx, n, PM_FREE, n);
+	span->released = released;
+	span->prev = NULL;
+	span->next = *list;
+	if (span->next)
+		span->next->prev = span;
+	*list = span;
+}
+
+static int span_released(unsigned long idx)
+{
+	return ((struct heap_span *)page_addr(idx))->released;
+}
+
+/*
+ * Return a span to the free lists, merging it with free neighbours.
+ * Returns the index of the span it ends up in.
+ */
+static unsigned long span_free(unsigned long idx, unsigned long n)
+{
+	unsigned long top = page_index(heap.end);
+	int released = 0;
+	uint32_t e;
+
+	if (idx > 0) {
+		e = map_get(idx - 1);
+		if ((e & PM_TYPE_MASK) == PM_FREE) {
+			released |= span_released(idx - PM_VAL(e));
+			span_unlink(idx - PM_VAL(e), PM_VAL(e));
+			idx -= PM_VAL(e);
+			n += PM_VAL(e);
+		}
+	}
+	if (idx + n < top) {
+		e = map_get(idx + n);
+		if ((e & PM_TYPE_MASK) == PM_FREE) {
+			released |= span_released(idx + n);
+			span_unlink(idx + n, PM_VAL(e));
+			n += PM_VAL(e);
+		}
+	}
+	span_link(idx, n, released);
+	return idx;
+}
+
+/*
+ * Release the hugepages of the free span at idx that lie under pages
+ * [at, at + n), or the whole span if n is 0. Called with the heap lock
+ * held. Returns the bytes released.
+ */
+static long span_release(unsigned long idx, unsigned long at,
+			 unsigned long n)
+{
+	unsigned long m = PM_VAL(map_get(idx));
+	long ret;
+
+	if (!heap.release)
+		return 0;
+	if (!n) {
+		at = idx;
+		n = m;
+	}
+
+	heap_busy = 1;
+	ret = heap.release(page_addr(idx + 1), page_addr(idx + m),
+			   page_addr(at), n << HEAP_PAGE_SHIFT);
+	heap_busy = 0;
+	if (ret <= 0)
+		return 0;
+	((struct heap_span *)page_addr(idx))->released = 1;
+	return ret;
+}
+
+/*
+ * The free span [idx, idx + m) is about to have pages [at, at + n) put
+ * to use, with the page after them becoming the head of what is left.
+ * Fault back whatever of those was released. Called with the span off
+ * the free lists, as faulting may write to its pages.
+ */
+static int span_restore(unsigned long idx, unsigned long m,
+			unsigned long at, unsigned long n, int released)
+{
+	long ret;
+
+	if (!released)
+		return 0;
+	if (at + n < idx + m)
+		n++;
+
+	heap_busy = 1;
+	ret = heap.restore(page_addr(idx), page_addr(idx + m), page_addr(at),
+			   n << HEAP_PAGE_SHIFT);
+	heap_busy = 0;
+	return ret < 0 ? -1 : 0;
+}
+
+static unsigned long long heap_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Put off growing the heap again. Called with the heap lock held. */
+static void heap_grow_failed(unsigned long long now)
+{
+	unsigned long long max = __hugetlb_opts.morecore_backoff * 1000000ULL;
+
+	if (!heap.fail_since) {
+		heap.fail_since = now;
+		heap.backoff = HEAP_BACKOFF_MIN;
+	} else if (heap.backoff < max) {
+		heap.backoff *= 2;
+	}
+	if (heap.backoff > max)
+		heap.backoff = max;
+	heap.retry_at = now + heap.backoff;
+	INFO("Heap unable to grow, retrying in %llu us\n",
+		heap.backoff / 1000);
+}
+
+/*
+ * Extend the heap by at least n pages, in whole hugepages. Allocations
+ * made while morecore runs, for example by the debug output, go to glibc.
+ */
+static int heap_grow(unsigned long n)
+{
+	size_t len = ALIGN(n << HEAP_PAGE_SHIFT, heap.hpage_size);
+	unsigned long long now = 0;
+	char *p;
+
+	if (heap.fail_since) {
+		now = heap_now();
+		if (now < heap.retry_at)
+			return -1;
+		STAT_ADD(morecore_retries, 1);
+	}
+
+	/* Nothing may fail once the heap has grown, it would leak the pages */
+	if (map_reserve(heap.start ? page_index(heap.end) : 0,
+			len >> HEAP_PAGE_SHIFT) != 0) {
+		WARNING("Unable to map %zd bytes more heap\n", len);
+		return -1;
+	}
+
+	heap_busy = 1;
+	p = heap.grow(len);
+	heap_busy = 0;
+	if (!p) {
+		heap_grow_failed(now ? now : heap_now());
+		return -1;
+	}
+
+	if (!heap.start) {
+		__atomic_store_n(&heap.start, p, __ATOMIC_RELAXED);
+		heap.end = p;
+	} else if (p != heap.end) {
+		/* morecore has sbrk() semantics, so this cannot happen */
+		WARNING("Hugepage heap grew at %p instead of %p\n", p,
+			heap.end);
+		heap_busy = 1;
+		heap.grow(-(ptrdiff_t)len);
+		heap_busy = 0;
+		return -1;
+	}
+
+	if (heap.fail_since) {
+		STAT_ADD(morecore_fallback_ns, now - heap.fail_since);
+		INFO("Heap growing again after %llu ms\n",
+			(now - heap.fail_since) / 1000000);
+		heap.fail_since = 0;
+	}
+
+	__atomic_store_n(&heap.end, p + len, __ATOMIC_RELAXED);
+	span_free(page_index(p), len >> HEAP_PAGE_SHIFT);
+	return 0;
+}
+
+/* Give whole hugepages at the top of the heap back, as glibc would */
+static void heap_trim(void)
+{
+	unsigned long top = page_index(heap.end);
+	unsigned long n, idx;
+	int released;
+	size_t len;
+	uint32_t e;
+	char *end;
+
+	if (!heap.trim_threshold || !top)
+		return;
+	e = map_get(top - 1);
+	if ((e & PM_TYPE_MASK) != PM_FREE)
+		return;
+	n = PM_VAL(e);
+	if ((n << HEAP_PAGE_SHIFT) < heap.trim_threshold)
+		return;
+
+	len = ALIGN_DOWN(n << HEAP_PAGE_SHIFT, heap.hpage_size);
+	idx = top - n;
+	released = span_released(idx);
+	span_unlink(idx, n);
+	heap_busy = 1;
+	if (heap.grow(-(ptrdiff_t)len)) {
+		/* Larger pages at the top may have kept it from shrinking */
+		end = heap.grow(0);
+		n -= (heap.end - end) >> HEAP_PAGE_SHIFT;
+		__atomic_store_n(&heap.end, end, __ATOMIC_RELAXED);
+	}
+	heap_busy = 0;
+	if (n)
+		span_link(idx, n, released);
+}
+
+/*
+ * Take n pages off the free lists, growing the heap if no span is big
+ * enough. The map entries of the span are left to the caller. Called
+ * with the heap lock held. Returns the index of the first page or -1.
+ *
+ * Large allocations are carved from the high end of a span and runs
+ * from the low end, so that the runs which always exist do not end up
+ * above a large block and stop the heap shrinking when it is freed.
+ */
+static long span_alloc(unsigned long n, int high)
+{
+	struct heap_span *span, *best;
+	unsigned long i, idx, at, m;
+	int released;
+
+	for (;;) {
+		best = NULL;
+		for (i = n; i < HEAP_FREE_LISTS - 1 && !best; i++)
+			best = heap.free[i];
+
+		if (!best) {
+			/* First fit among the large spans */
+			for (span = heap.free[HEAP_FREE_LISTS - 1]; span;
+					span = span->next) {
+				if (PM_VAL(map_get(page_index(span))) >= n) {
+					best = span;
+					break;
+				}
+			}
+		}
+
+		if (best)
+			break;
+		/* Leave a large allocation room for runs below it */
+		if (heap_grow(high ? n + 1 : n) != 0)
+			return -1;
+	}
+
+	idx = page_index(best);
+	m = PM_VAL(map_get(idx));
+	released = best->released;
+	at = high ? idx + m - n : idx;
+	span_unlink(idx, m);
+	if (span_restore(idx, m, at, n, released) != 0) {
+		span_link(idx, m, released);
+		return -1;
+	}
+
+	if (m > n && high)
+		span_link(idx, m - n, released);
+	else if (m > n)
+		span_link(idx + n, m - n, released);
+	return at;
+}
+
+static void *large_alloc(size_t size, size_t align)
+{
+	unsigned long n = ALIGN(size, HEAP_PAGE_SIZE) >> HEAP_PAGE_SHIFT;
+	unsigned long extra = 0, lead;
+	long idx;
+
+	if (!n || n > PM_VAL(~0U) / 2)
+		return NULL;
+	if (align > HEAP_PAGE_SIZE)
+		extra = (align >> HEAP_PAGE_SHIFT) - 1;
+
+	pthread_mutex_lock(&heap.lock);
+	idx = span_alloc(n + extra, 1);
+	if (idx < 0) {
+		pthread_mutex_unlock(&heap.lock);
+		return NULL;
+	}
+
+	lead = (ALIGN((unsigned long)page_addr(idx), align) -
+		(unsigned long)page_addr(idx)) >> HEAP_PAGE_SHIFT;
+	map_span(idx + lead, n, PM_LARGE, n);
+	if (lead)
+		span_free(idx, lead);
+	if (extra - lead)
+		span_free(idx + lead + n, extra - lead);
+	pthread_mutex_unlock(&heap.lock);
+
+	return page_addr(idx + lead);
+}
+
+static void large_free(void *ptr, unsigned long n)
+{
+	unsigned long idx;
+
+	pthread_mutex_lock(&heap.lock);
+	idx = span_free(page_index(ptr), n);
+	heap_trim();
+	/* What could not be trimmed off the top goes back to the pool */
+	if (heap.trim_threshold && idx < page_index(heap.end) &&
+	    (PM_VAL(map_get(idx)) << HEAP_PAGE_SHIFT) >= heap.trim_threshold)
+		span_release(idx, page_index(ptr), n);
+	pthread_mutex_unlock(&heap.lock);
+}
+
+/* Give a class a fresh run. Called with the class lock held. */
+static int class_new_run(int cls)
+{
+	struct heap_class *class = &heap.classes[cls];
+	unsigned long n = class_run_pages(cls);
+	long idx;
+
+	pthread_mutex_lock(&heap.lock);
+	idx = span_alloc(n, 0);
+	if (idx >= 0 && map_span(idx, n, PM_SMALL, cls) != 0) {
+		span_free(idx, n);
+		idx = -1;
+	}
+	pthread_mutex_unlock(&heap.lock);
+	if (idx < 0)
+		return -1;
+
+	class->bump = page_addr(idx);
+	class->bump_end = class->bump + (n << HEAP_PAGE_SHIFT);
+	return 0;
+}
+
+/* Fill a magazine with up to want objects from the class */
+static unsigned int class_refill(int cls, struct heap_magazine *mag,
+				 unsigned int want)
+{
+	struct heap_class *class = &heap.classes[cls];
+	size_t size = class_size(cls);
+
+	pthread_mutex_lock(&class->lock);
+	while (mag->count < want) {
+		if (class->free) {
+			mag->objs[mag->count++] = class->free;
+			class->free = *(void **)class->free;
+			continue;
+		}
+		if (class->bump_end - class->bump < size &&
+		    class_new_run(cls) != 0)
+			break;
+		mag->objs[mag->count++] = class->bump;
+		class->bump += size;
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	return mag->count;
+}
+
+/* Return the oldest nr objects of a magazine to the class */
+static void class_drain(int cls, struct heap_magazine *mag, unsigned int nr)
+{
+	struct heap_class *class = &heap.classes[cls];
+	unsigned int i;
+
+	pthread_mutex_lock(&class->lock);
+	for (i = 0; i < nr; i++) {
+		*(void **)mag->objs[i] = class->free;
+		class->free = mag->objs[i];
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	mag->count -= nr;
+	memmove(mag->objs, mag->objs + nr, mag->count * sizeof(void *));
+}
+
+/* Thread exit: give the cached objects back */
+static void heap_tcache_destroy(void *arg)
+{
+	struct heap_tcache *tc = arg;
+	int cls;
+
+	for (cls = 0; cls < HEAP_NR_CLASSES; cls++)
+		if (tc->mags[cls].count)
+			class_drain(cls, &tc->mags[cls], tc->mags[cls].count);
+
+	/* Later destructors may still free, without a cache */
+	heap_tcache_tls = TCACHE_DEAD;
+	large_free(tc, PM_VAL(map_get(page_index(tc))));
+}
+
+static struct heap_tcache *heap_tcache(void)
+{
+	struct heap_tcache *tc = heap_tcache_tls;
+
+	if (tc == TCACHE_DEAD)
+		return NULL;
+	if (tc)
+		return tc;
+
+	/*
+	 * A cache is a large object, so that creating one never recurses.
+	 * It is not taken from glibc, whose brk() heap would otherwise grow
+	 * into the space above it meant for the hugepage heap before that
+	 * has been mapped.
+	 */
+	tc = large_alloc(sizeof(*tc), HEAP_PAGE_SIZE);
+	if (!tc)
+		return NULL;
+	memset(tc, 0, sizeof(*tc));
+	heap_tcache_tls = tc;
+	if (pthread_setspecific(heap.key, tc) != 0) {
+		heap_tcache_tls = NULL;
+		large_free(tc, PM_VAL(map_get(page_index(tc))));
+		return NULL;
+	}
+	return tc;
+}
+
+static void *small_alloc(int cls)
+{
+	struct heap_tcache *tc = heap_tcache();
+	struct heap_magazine *mag, tmp = { .count = 0 };
+
+	if (!tc)
+		return class_refill(cls, &tmp, 1) ? tmp.objs[0] : NULL;
+
+	mag = &tc->mags[cls];
+	if (mag->count == 0 &&
+	    class_refill(cls, mag, mag_capacity(cls) / 2) == 0)
+		return NULL;
+	return mag->objs[--mag->count];
+}
+
+static void small_free(void *ptr, int cls)
+{
+	struct heap_tcache *tc = heap_tcache();
+	struct heap_magazine *mag;
+	unsigned int cap;
+
+	if (!tc) {
+		/* No cache for this thread, hand it straight back */
+		struct heap_magazine tmp = { .count = 1, .objs = { ptr } };
+
+		class_drain(cls, &tmp, 1);
+		return;
+	}
+
+	mag = &tc->mags[cls];
+	cap = mag_capacity(cls);
+	if (mag->count == cap)
+		class_drain(cls, mag, cap / 2);
+	mag->objs[mag->count++] = ptr;
+}
+
+/* Usable size of an object on the heap, 0 if ptr is not one */
+static size_t heap_usable_size(void *ptr)
+{
+	uint32_t e = map_get(page_index(ptr));
+
+	switch (e & PM_TYPE_MASK) {
+	case PM_SMALL:
+		return class_size(PM_VAL(e));
+	case PM_LARGE:
+		return (size_t)PM_VAL(e) << HEAP_PAGE_SHIFT;
+	}
+	return 0;
+}
+
+static void heap_free(void *ptr)
+{
+	uint32_t e = map_get(page_index(ptr));
+
+	switch (e & PM_TYPE_MASK) {
+	case PM_SMALL:
+		small_free(ptr, PM_VAL(e));
+		break;
+	case PM_LARGE:
+		large_free(ptr, PM_VAL(e));
+		break;
+	default:
+		ERROR("free(): invalid pointer %p\n", ptr);
+	}
+}
+
+/*
+ * Allocate from the hugepage heap. Once hugepages run out, requests are
+ * served from base pages by glibc, as they were when glibc's malloc fell
+ * back from a failing morecore to mmap().
+ */
+static void *heap_memalign(size_t align, size_t size)
+{
+	size_t small = size > align ? size : align;
+	void *p = NULL;
+
+	if (align <= HEAP_MIN_ALIGN) {
+		if (size <= HEAP_MAX_SMALL)
+			p = small_alloc(size_to_class(size));
+		else
+			p = large_alloc(size, HEAP_PAGE_SIZE);
+		if (!p) {
+			STAT_ADD(morecore_fallback_allocs, 1);
+			p = __libc_malloc(size);
+		}
+		return p;
+	}
+
+	/* Power of two classes are aligned to their size within a page */
+	if (align <= HEAP_PAGE_SIZE && small <= HEAP_MAX_SMALL) {
+		small = 1UL << ((sizeof(long) * 8) - __builtin_clzl(small - 1));
+		p = small_alloc(size_to_class(small));
+	} else {
+		p = large_alloc(size ? size : 1, align > HEAP_PAGE_SIZE ?
+				align : HEAP_PAGE_SIZE);
+	}
+	if (!p) {
+		STAT_ADD(morecore_fallback_allocs, 1);
+		p = __libc_memalign(align, size);
+	}
+	return p;
+}
+
+/* Grow a large object into the free span that follows it */
+static int large_expand(void *ptr, size_t size)
+{
+	unsigned long idx = page_index(ptr);
+	unsigned long n = PM_VAL(map_get(idx));
+	unsigned long want = ALIGN(size, HEAP_PAGE_SIZE) >> HEAP_PAGE_SHIFT;
+	unsigned long m;
+	int released, ret = -1;
+	uint32_t e;
+
+	pthread_mutex_lock(&heap.lock);
+	if (idx + n < page_index(heap.end)) {
+		e = map_get(idx + n);
+		m = PM_VAL(e);
+		if ((e & PM_TYPE_MASK) == PM_FREE && n + m >= want) {
+			released = span_released(idx + n);
+			span_unlink(idx + n, m);
+			if (span_restore(idx + n, m, idx + n, want - n,
+					 released) != 0) {
+				span_link(idx + n, m, released);
+				goto out;
+			}
+			if (n + m > want)
+				span_link(idx + want, n + m - want, released);
+			map_span(idx, want, PM_LARGE, want);
+			ret = 0;
+		}
+	}
+out:
+	pthread_mutex_unlock(&heap.lock);
+	return ret;
+}
+
+static void heap_fork_prepare(void)
+{
+	int cls;
+
+	for (cls = 0; cls < HEAP_NR_CLASSES; cls++)
+		pthread_mutex_lock(&heap.classes[cls].lock);
+	pthread_mutex_lock(&heap.lock);
+}
+
+static void heap_fork_release(void)
+{
+	int cls;
+
+	pthread_mutex_unlock(&heap.lock);
+	for (cls = HEAP_NR_CLASSES - 1; cls >= 0; cls--)
+		pthread_mutex_unlock(&heap.classes[cls].lock);
+}
+
+/*
+ * Release every free span. Called with the heap lock held. Returns the
+ * bytes released.
+ */
+static long heap_release_all(void)
+{
+	struct heap_span *span;
+	long total = 0;
+	int i;
+
+	for (i = 0; i < HEAP_FREE_LISTS; i++)
+		for (span = heap.free[i]; span; span = span->next)
+			total += span_release(page_index(span), 0, 0);
+	return total;
+}
+
+/**
+ * hugetlbfs_setup_heap - Serve malloc() from a hugepage heap
+ * grow: morecore function extending the heap with sbrk() semantics
+ * release: Gives back the pages of free space [lo, hi) under [p, p + len)
+ * restore: Faults back the pages of free space [lo, hi) under [p, p + len)
+ * hpage_size: Page size of the heap, the unit it is grown by
+ *
+ * Called by hugetlbfs_setup_morecore() when glibc has no __morecore hook.
+ */
+void hugetlbfs_setup_heap(void *(*grow)(ptrdiff_t),
+		long (*release)(void *lo, void *hi, void *p, size_t len),
+		long (*restore)(void *lo, void *hi, void *p, size_t len),
+		long hpage_size)
+{
+	int cls;
+
+	if (pthread_key_create(&heap.key, heap_tcache_destroy) != 0) {
+		WARNING("Unable to create thread caches for the heap\n");
+		return;
+	}
+	for (cls = 0; cls < HEAP_NR_CLASSES; cls++)
+		pthread_mutex_init(&heap.classes[cls].lock, NULL);
+	if (pthread_atfork(heap_fork_prepare, heap_fork_release,
+			   heap_fork_release) != 0) {
+		WARNING("Unable to register fork handlers for the heap\n");
+		return;
+	}
+
+	heap.grow = grow;
+	heap.release = release;
+	heap.restore = restore;
+	heap.hpage_size = hpage_size;
+	if (__hugetlb_opts.shrink_ok)
+		heap.trim_threshold = hpage_size + hpage_size / 2;
+	__atomic_store_n(&heap.enabled, 1, __ATOMIC_RELEASE);
+	INFO("malloc() replaced by a heap of %ld kB pages\n",
+		hpage_size / 1024);
+}
+
+void *malloc(size_t size)
+{
+	if (!heap_active())
+		return __libc_malloc(size);
+	return heap_memalign(0, size);
+}
+
+void free(void *ptr)
+{
+	if (!ptr)
+		return;
+	if (heap_owns(ptr))
+		heap_free(ptr);
+	else
+		__libc_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	void *p;
+
+	if (!heap_active())
+		return __libc_calloc(nmemb, size);
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	p = heap_memalign(0, total);
+	if (p)
+		memset(p, 0, total);
+	return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	size_t old;
+	void *p;
+
+	if (!ptr)
+		return malloc(size);
+	if (!heap_owns(ptr))
+		return __libc_realloc(ptr, size);
+	if (size == 0) {
+		heap_free(ptr);
+		return NULL;
+	}
+
+	old = heap_usable_size(ptr);
+	if (old > HEAP_MAX_SMALL) {
+		if (ALIGN(size, HEAP_PAGE_SIZE) == old)
+			return ptr;
+		if (size > old && large_expand(ptr, size) == 0)
+			return ptr;
+	} else if (size <= old && size > old / 2) {
+		return ptr;
+	}
+
+	p = malloc(size);
+	if (!p)
+		return NULL;
+	hugetlbfs_copy(p, ptr, size < old ? size : old);
+	heap_free(ptr);
+	return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	if (alignment > SIZE_MAX / 2 + 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/* Like glibc, round a bad alignment up to a power of two */
+	if (alignment & (alignment - 1))
+		alignment = 1UL << ((sizeof(long) * 8) -
+				    __builtin_clzl(alignment));
+
+	if (!heap_active())
+		return __libc_memalign(alignment, size);
+	return heap_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *p;
+
+	if (alignment % sizeof(void *) || (alignment & (alignment - 1)) ||
+	    !alignment)
+		return EINVAL;
+
+	p = memalign(alignment, size);
+	if (!p)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	if (!alignment || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	return memalign(getpagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+	size_t pagesize = getpagesize();
+
+	if (size > SIZE_MAX - pagesize) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return memalign(pagesize, ALIGN(size, pagesize));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	size_t (*libc_usable_size)(void *);
+
+	if (!ptr)
+		return 0;
+	if (heap_owns(ptr))
+		return heap_usable_size(ptr);
+
+	/* glibc has no internal name for it, so look it up once */
+	libc_usable_size = __atomic_load_n(&heap.libc_usable_size,
+					   __ATOMIC_RELAXED);
+	if (!libc_usable_size) {
+		libc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+		if (!libc_usable_size)
+			return 0;
+		__atomic_store_n(&heap.libc_usable_size, libc_usable_size,
+				 __ATOMIC_RELAXED);
+	}
+	return libc_usable_size(ptr);
+}
+
+/* Give free hugepages back to the pool, wherever they are in the heap */
+int malloc_trim(size_t pad)
+{
+	int (*libc_trim)(size_t);
+	long released = 0;
+
+	if (heap_active()) {
+		pthread_mutex_lock(&heap.lock);
+		heap_trim();
+		released = heap_release_all();
+		pthread_mutex_unlock(&heap.lock);
+	}
+
+	libc_trim = __atomic_load_n(&heap.libc_trim, __ATOMIC_RELAXED);
+	if (!libc_trim) {
+		libc_trim = dlsym(RTLD_NEXT, "malloc_trim");
+		if (!libc_trim)
+			return released > 0;
+		__atomic_store_n(&heap.libc_trim, libc_trim, __ATOMIC_RELAXED);
+	}
+	return libc_trim(pad) || released > 0;
+}
@@ -46,16 +46,87 @@ int hugetlbfs_unlinked_fd_for_size(long page_size);
 /*
  * Direct hugepage allocation flags and types
  *
- * GHP_DEFAULT - Use the default hugepage size to back the region
+ * GHP_DEFAULT     - Use the default hugepage size to back the region
+ * GHP_LOCAL       - Place the region on the NUMA node of the calling CPU
+ * GHP_INTERLEAVE  - Interleave the region across all nodes with memory
+ * GHP_NODE_STRICT - Fail rather than use hugepages from another node when
+ *		     the requested node cannot supply the whole region
+ * GHP_ASYNC_PREFAULT - Return at once and populate the region in the
+ *		     background, see hugetlb_prefault_wait()
+ *
+ * The page size may be selected by or'ing in one of the GHP_HUGE_* sizes,
+ * which hold log2 of the size like the MAP_HUGE_* flags of mmap(). A
+ * hugetlbfs mount for the size is needed unless it is the kernel default.
+ * The sizes may also be used with get_hugepage_region().
  */
 typedef unsigned long ghp_t;
 #define GHP_DEFAULT	((ghp_t)0x01UL)
-#define GHP_MASK	(GHP_DEFAULT)
+#define GHP_LOCAL	((ghp_t)0x02UL)
+#define GHP_INTERLEAVE	((ghp_t)0x04UL)
+#define GHP_NODE_STRICT	((ghp_t)0x08UL)
+#define GHP_ASYNC_PREFAULT	((ghp_t)0x10UL)
+#define GHP_MASK	(GHP_DEFAULT|GHP_LOCAL|GHP_INTERLEAVE|GHP_NODE_STRICT|\
+			 GHP_ASYNC_PREFAULT)
+
+#define GHP_HUGE_SHIFT		16
+#define GHP_HUGE_SIZE_MASK	((ghp_t)0x3fUL << GHP_HUGE_SHIFT)
+#define GHP_HUGE_64KB		((ghp_t)16UL << GHP_HUGE_SHIFT)
+#define GHP_HUGE_2MB		((ghp_t)21UL << GHP_HUGE_SHIFT)
+#define GHP_HUGE_16MB		((ghp_t)24UL << GHP_HUGE_SHIFT)
+#define GHP_HUGE_1GB		((ghp_t)30UL << GHP_HUGE_SHIFT)
+#define GHP_HUGE_16GB		((ghp_t)34UL << GHP_HUGE_SHIFT)
 
 /* Direct alloc functions for hugepages */
 void *get_huge_pages(size_t len, ghp_t flags);
+void *get_huge_pages_onnode(size_t len, int node, ghp_t flags);
 void free_huge_pages(void *ptr);
 
+/* Unmap the regions kept by HUGETLB_REGION_CACHE */
+void hugetlb_region_cache_flush(void);
+
+/* Number of threads new regions are prefaulted with, 0 for one per CPU */
+int hugetlb_set_prefault_threads(int nr_threads);
+
+/* Wait for the background prefault of a GHP_ASYNC_PREFAULT region */
+int hugetlb_prefault_wait(void *ptr);
+
+/*
+ * Library counters, see hugetlbfs_get_stats(3). Regions are counted by
+ * log2 of their page size. Prefault latency bucket 0 counts prefaults
+ * under 1us and bucket i those under 2^i us, the last bucket everything
+ * longer.
+ */
+#define HUGETLB_STATS_SHIFTS		64
+#define HUGETLB_STATS_LATENCY_BUCKETS	24
+
+struct hugetlbfs_stats {
+	unsigned long long allocs[HUGETLB_STATS_SHIFTS];
+	unsigned long long frees[HUGETLB_STATS_SHIFTS];
+	unsigned long long thp_fallbacks;	/* Regions given THP */
+	unsigned long long base_fallbacks;	/* Regions given base pages */
+	unsigned long long prefaults;
+	unsigned long long prefault_bytes;
+	unsigned long long prefault_failures;
+	unsigned long long prefault_latency[HUGETLB_STATS_LATENCY_BUCKETS];
+	unsigned long long morecore_grows;
+	unsigned long long morecore_shrinks;
+	unsigned long long morecore_contig_failures;
+	unsigned long long elflink_segments;	/* Segments remapped */
+	unsigned long long elflink_bytes_copied;
+	unsigned long long morecore_grows_avoided; /* Served by growing ahead */
+	unsigned long long morecore_released;	/* Bytes given back unmapped */
+	unsigned long long morecore_restored;	/* Bytes of those faulted back */
+	unsigned long long thp_heap_rss;	/* Resident THP morecore heap */
+	unsigned long long thp_heap_huge;	/* Of which on hugepages */
+	unsigned long long morecore_fallback_allocs; /* Sent to glibc */
+	unsigned long long morecore_fallback_ns; /* Heap unable to grow */
+	unsigned long long morecore_retries;	/* Grows tried since */
+	unsigned long long morecore_prealloc;	/* Bytes mapped at startup */
+	unsigned long long morecore_prealloc_ns; /* Time that took */
+};
+
+int hugetlbfs_get_stats(struct hugetlbfs_stats *stats, size_t size);
+
 /*
  * Region alloc flags and types
  *
@@ -67,19 +138,54 @@ void free_huge_pages(void *ptr);
  * GHP_COLOR    - Use bytes wasted due to alignment to offset the buffer
  *		  by a random cache line. This gives better average
  *		  performance with many buffers
+ * GHR_MIXED    - Build the region from the largest page sizes that fit,
+ *		  then smaller sizes for the remainder. With GHR_FALLBACK
+ *		  the tail is backed by base pages. A GHP_HUGE_* size
+ *		  limits the largest page size used
+ *
+ * GHR_THP      - Use transparent hugepages if the hugetlb pool cannot
+ *		  supply the region. GHR_FALLBACK also tries them before
+ *		  base pages unless HUGETLB_THP_FALLBACK=no
  */
 typedef unsigned long ghr_t;
 #define GHR_STRICT	((ghr_t)0x10000000U)
 #define GHR_FALLBACK	((ghr_t)0x20000000U)
 #define GHR_COLOR	((ghr_t)0x40000000U)
+#define GHR_MIXED	((ghr_t)0x08000000U)
+#define GHR_THP		((ghr_t)0x04000000U)
 #define GHR_DEFAULT	(GHR_FALLBACK|GHR_COLOR)
 
-#define GHR_MASK	(GHR_FALLBACK|GHR_STRICT|GHR_COLOR)
+#define GHR_MASK	(GHR_FALLBACK|GHR_STRICT|GHR_COLOR|GHR_MIXED|GHR_THP)
 
 /* Allocation functions for regions backed by hugepages */
 void *get_hugepage_region(size_t len, ghr_t flags);
 void free_hugepage_region(void *ptr);
 
+/* The kind of pages that back a region, see hugetlb_region_tier() */
+#define HUGETLB_TIER_HUGETLB	1	/* hugetlbfs pages */
+#define HUGETLB_TIER_MIXED	2	/* GHR_MIXED, several page sizes */
+#define HUGETLB_TIER_THP	3	/* Transparent hugepages */
+#define HUGETLB_TIER_BASE	4	/* Base pages */
+
+int hugetlb_region_tier(void *ptr);
+
+/*
+ * Remap the libraries matching HUGETLB_ELFMAP_LIBS that were loaded since
+ * the last call, and forget those unloaded. libhugetlbfs_dlopen.so calls
+ * it after each dlopen() and dlclose().
+ */
+void hugetlb_remap_libs(void);
+
+/*
+ * Arenas of small objects (up to 64KB) carved from hugepage slabs. Slabs
+ * are allocated with get_huge_pages() using the flags given at creation.
+ */
+typedef struct hugetlb_arena hugetlb_arena_t;
+hugetlb_arena_t *hugetlb_arena_create(ghp_t flags);
+void *hugetlb_arena_alloc(hugetlb_arena_t *arena, size_t size);
+void hugetlb_arena_free(hugetlb_arena_t *arena, void *ptr);
+void hugetlb_arena_destroy(hugetlb_arena_t *arena);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,11 +36,14 @@
 #include <fcntl.h>
 #include <sys/vfs.h>
 #include <sys/statfs.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/file.h>
 #include <sys/uio.h>
 #include <sys/syscall.h>
+#include <pthread.h>
+#include <time.h>
 #include <linux/types.h>
 #include <linux/unistd.h>
 #include <dirent.h>
@@ -52,7 +55,6 @@ struct libhugeopts_t __hugetlb_opts;
 
 static int hugepagesize_errno; /* = 0 */
 
-#define MAX_HPAGE_SIZES 10
 static struct hpage_size hpage_sizes[MAX_HPAGE_SIZES];
 static int nr_hpage_sizes;
 static int hpage_sizes_default_idx = -1;
@@ -78,6 +80,32 @@ void kernel_default_hugepage_size_reset(void)
 	default_size = 0;
 }
 
+#define THP_ENABLED	"/sys/kernel/mm/transparent_hugepage/enabled"
+#define THP_PMD_SIZE	"/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+
+/* The transparent hugepage size, or 0 if THP is unavailable or disabled */
+long thp_page_size(void)
+{
+	char buf[64];
+	ssize_t len;
+	int fd;
+
+	fd = open(THP_ENABLED, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	if (strstr(buf, "[never]"))
+		return 0;
+
+	if (access(THP_PMD_SIZE, R_OK) != 0)
+		return 0;
+	return file_read_ulong(THP_PMD_SIZE, NULL);
+}
+
 #define BUF_SZ 256
 #define MEMINFO_SIZE	2048
 
@@ -284,11 +312,27 @@ static char *get_exe_name(char *buf, int size)
  * Reads the contents of hugetlb environment variables and save their
  * values for later use.
  */
+/*
+ * As parse_page_size(), but also accept a size of 0 for the variables
+ * where that turns the feature off
+ */
+static long parse_size_or_zero(const char *str)
+{
+	char *pos;
+
+	if (strtol(str, &pos, 0) == 0 && pos != str &&
+	    (!*pos || (strchr("KkMmGg", *pos) && !pos[1])))
+		return 0;
+	return parse_page_size(str);
+}
+
 void hugetlbfs_setup_env()
 {
 	char *env;
 
 	__hugetlb_opts.min_copy = true;
+	__hugetlb_opts.thp_fallback = true;
+	__hugetlb_opts.morecore_backoff = 1000;
 
 	env = getenv("HUGETLB_VERBOSE");
 	if (env)
@@ -329,12 +373,14 @@ void hugetlbfs_setup_env()
 
 	__hugetlb_opts.share_path = getenv("HUGETLB_SHARE_PATH");
 	__hugetlb_opts.elfmap = getenv("HUGETLB_ELFMAP");
+	__hugetlb_opts.elfmap_libs = getenv("HUGETLB_ELFMAP_LIBS");
 	__hugetlb_opts.ld_preload = getenv("LD_PRELOAD");
 	__hugetlb_opts.def_page_size = getenv("HUGETLB_DEFAULT_PAGE_SIZE");
 	__hugetlb_opts.path = getenv("HUGETLB_PATH");
 	__hugetlb_opts.features = getenv("HUGETLB_FEATURES");
 	__hugetlb_opts.morecore = getenv("HUGETLB_MORECORE");
 	__hugetlb_opts.heapbase = getenv("HUGETLB_MORECORE_HEAPBASE");
+	__hugetlb_opts.stats = getenv("HUGETLB_STATS");
 
 	if (__hugetlb_opts.morecore)
 		__hugetlb_opts.thp_morecore =
@@ -379,11 +425,184 @@ void hugetlbfs_setup_env()
 	if (env && strcasecmp(env, "yes") == 0)
 		__hugetlb_opts.shrink_ok = true;
 
+	/* Address space set aside for the morecore heap to grow into */
+	env = getenv("HUGETLB_MORECORE_RESERVE");
+	if (env) {
+		long size = parse_page_size(env);
+
+		if (size <= 0)
+			WARNING("Invalid HUGETLB_MORECORE_RESERVE %s\n", env);
+		else
+			__hugetlb_opts.heap_reserve = size;
+	}
+
+	/* Map, fault and perhaps lock this much of the heap at startup */
+	env = getenv("HUGETLB_MORECORE_PREALLOC");
+	if (env) {
+		char *flag = strchr(env, ',');
+		long size = parse_page_size(env);
+
+		if (size <= 0 || (flag && strcasecmp(flag + 1, "lock"))) {
+			WARNING("Invalid HUGETLB_MORECORE_PREALLOC %s\n", env);
+		} else {
+			__hugetlb_opts.heap_prealloc = size;
+			__hugetlb_opts.heap_lock = flag != NULL;
+		}
+	}
+
+	/* Grow the morecore heap ahead of malloc() by a factor of its size */
+	env = getenv("HUGETLB_MORECORE_GROWTH");
+	if (env && !strncasecmp(env, "geometric", 9)) {
+		char *ep = env + 9;
+
+		__hugetlb_opts.growth_factor = 2;
+		__hugetlb_opts.growth_max = 1UL << 30;
+		if (*ep == ':')
+			__hugetlb_opts.growth_factor = strtod(ep + 1, &ep);
+		if (*ep == ',')
+			__hugetlb_opts.growth_max = parse_page_size(ep + 1);
+		else if (*ep)
+			__hugetlb_opts.growth_factor = 0;
+		if (__hugetlb_opts.growth_factor <= 1 ||
+		    (long)__hugetlb_opts.growth_max <= 0) {
+			WARNING("Invalid HUGETLB_MORECORE_GROWTH %s\n", env);
+			__hugetlb_opts.growth_factor = 0;
+		}
+	} else if (env && strcasecmp(env, "exact")) {
+		WARNING("Invalid HUGETLB_MORECORE_GROWTH %s\n", env);
+	}
+
+	/* Longest wait in ms before a heap that could not grow is retried */
+	env = getenv("HUGETLB_MORECORE_BACKOFF");
+	if (env) {
+		char *ep;
+		unsigned long ms = strtoul(env, &ep, 10);
+
+		if (ep == env || *ep)
+			WARNING("Invalid HUGETLB_MORECORE_BACKOFF %s\n", env);
+		else
+			__hugetlb_opts.morecore_backoff = ms;
+	}
+
+	/* glibc's thread arenas are never on hugepages, see setup_morecore */
+	env = getenv("HUGETLB_MORECORE_ARENAS");
+	if (env) {
+		if (!strcasecmp(env, "main"))
+			__hugetlb_opts.morecore_arenas = ARENAS_MAIN;
+		else
+			WARNING("Invalid HUGETLB_MORECORE_ARENAS %s\n", env);
+	}
+
+	/* NUMA placement of the morecore heap, as an MPOL_* mode */
+	env = getenv("HUGETLB_MORECORE_NUMA");
+	if (env) {
+		char *ep;
+		long node;
+
+		if (!strcasecmp(env, "interleave")) {
+			__hugetlb_opts.morecore_mpol = MPOL_INTERLEAVE;
+		} else if (!strcasecmp(env, "local")) {
+			__hugetlb_opts.morecore_mpol = MPOL_PREFERRED;
+		} else if (!strncasecmp(env, "node:", 5)) {
+			node = strtol(env + 5, &ep, 10);
+			if (ep == env + 5 || *ep || node < 0 ||
+			    node >= HUGETLB_MAX_NODES) {
+				WARNING("Invalid HUGETLB_MORECORE_NUMA node "
+					"%s\n", env + 5);
+			} else {
+				__hugetlb_opts.morecore_mpol = MPOL_BIND;
+				__hugetlb_opts.morecore_node = node;
+			}
+		} else {
+			WARNING("Invalid HUGETLB_MORECORE_NUMA %s\n", env);
+		}
+	}
+
+	/* Transparent hugepages for get_hugepage_region(GHR_FALLBACK) */
+	env = getenv("HUGETLB_THP_FALLBACK");
+	if (env && !strcasecmp(env, "no"))
+		__hugetlb_opts.thp_fallback = false;
+
+	env = getenv("HUGETLB_THP_COLLAPSE");
+	if (env && !strcasecmp(env, "yes"))
+		__hugetlb_opts.thp_collapse = true;
+
 	/* Determine if shmget() calls should be overridden */
 	env = getenv("HUGETLB_SHM");
 	if (env && !strcasecmp(env, "yes"))
 		__hugetlb_opts.shm_enabled = true;
 
+	/* Number of threads used to prefault large regions */
+	env = getenv("HUGETLB_PREFAULT_THREADS");
+	if (env) {
+		char *ep;
+		long nr = strtol(env, &ep, 10);
+
+		if (ep == env || *ep || nr < 0 || nr > INT_MAX)
+			WARNING("Invalid HUGETLB_PREFAULT_THREADS %s\n", env);
+		else
+			hugetlb_set_prefault_threads(nr);
+	}
+
+	/* How large copies are made, normally the widest streaming stores */
+	env = getenv("HUGETLB_COPY_METHOD");
+	if (env) {
+		if (!strcasecmp(env, "memcpy"))
+			__hugetlb_opts.copy_method = COPY_MEMCPY;
+		else if (!strcasecmp(env, "sse2"))
+			__hugetlb_opts.copy_method = COPY_SSE2;
+		else if (!strcasecmp(env, "avx2"))
+			__hugetlb_opts.copy_method = COPY_AVX2;
+		else if (!strcasecmp(env, "avx512"))
+			__hugetlb_opts.copy_method = COPY_AVX512;
+		else if (strcasecmp(env, "auto"))
+			WARNING("Invalid HUGETLB_COPY_METHOD %s\n", env);
+	}
+
+	/* Workers preparing remapped segments, 0 for one per CPU */
+	env = getenv("HUGETLB_ELFMAP_THREADS");
+	if (env) {
+		int nr = atoi(env);
+
+		if (nr < 0)
+			WARNING("Invalid HUGETLB_ELFMAP_THREADS %s\n", env);
+		else
+			__hugetlb_opts.elfmap_threads = nr;
+	}
+
+	/* How regions are prefaulted, normally MADV_POPULATE_WRITE */
+	env = getenv("HUGETLB_PREFAULT_METHOD");
+	if (env) {
+		if (!strcasecmp(env, "madvise"))
+			__hugetlb_opts.prefault_method = PREFAULT_MADVISE;
+		else if (!strcasecmp(env, "readv"))
+			__hugetlb_opts.prefault_method = PREFAULT_READV;
+		else
+			WARNING("Invalid HUGETLB_PREFAULT_METHOD %s\n", env);
+	}
+
+	/* Bytes per second GHP_ASYNC_PREFAULT regions are populated at */
+	env = getenv("HUGETLB_PREFAULT_RATE");
+	if (env) {
+		long rate = parse_size_or_zero(env);
+
+		if (rate < 0)
+			WARNING("Invalid HUGETLB_PREFAULT_RATE %s\n", env);
+		else
+			__hugetlb_opts.prefault_rate = rate;
+	}
+
+	/* Size of the cache of freed get_huge_pages() regions */
+	env = getenv("HUGETLB_REGION_CACHE");
+	if (env) {
+		long size = parse_size_or_zero(env);
+
+		if (size < 0)
+			WARNING("Invalid HUGETLB_REGION_CACHE size %s\n", env);
+		else
+			__hugetlb_opts.region_cache = size;
+	}
+
 	/* Determine if all reservations should be avoided */
 	env = getenv("HUGETLB_NO_RESERVE");
 	if (env && !strcasecmp(env, "yes"))
@@ -405,6 +624,12 @@ void hugetlbfs_setup_kernel_page_size()
 	nr_hpage_sizes = 1;
 }
 
+/*
+ * Set on kernels with MAP_PRIVATE reservations, where regions are only
+ * prefaulted when more than one thread does it
+ */
+static bool prefault_by_threads;
+
 void hugetlbfs_check_priv_resv()
 {
 	/*
@@ -413,6 +638,12 @@ void hugetlbfs_check_priv_resv()
 	 * guarantees them.  This can help NUMA performance quite a bit.
 	 */
 	if (hugetlbfs_test_feature(HUGETLB_FEATURE_PRIVATE_RESV) > 0) {
+		prefault_by_threads = __hugetlbfs_prefault;
+		if (__hugetlb_opts.prefault_threads > 1 && __hugetlbfs_prefault) {
+			INFO("Kernel has MAP_PRIVATE reservations.  Keeping "
+				"heap prefaulting for HUGETLB_PREFAULT_THREADS\n");
+			return;
+		}
 		INFO("Kernel has MAP_PRIVATE reservations.  Disabling "
 			"heap prefaulting.\n");
 		__hugetlbfs_prefault = false;
@@ -455,6 +686,35 @@ void hugetlbfs_check_map_hugetlb()
 #endif
 }
 
+void hugetlbfs_check_populate_write()
+{
+	void *p;
+	int ret;
+
+	if (__hugetlb_opts.prefault_method == PREFAULT_READV)
+		return;
+
+	/*
+	 * MADV_POPULATE_WRITE is Linux 5.14 and later, older kernels reject
+	 * the advice with EINVAL. Ask once on a page we own, so that an
+	 * EINVAL from a real prefault is reported as the failure it is.
+	 */
+	p = mmap(NULL, getpagesize(), PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return;
+	ret = madvise(p, getpagesize(), MADV_POPULATE_WRITE);
+	munmap(p, getpagesize());
+
+	if (ret == 0) {
+		__hugetlb_opts.prefault_method = PREFAULT_MADVISE;
+		return;
+	}
+
+	INFO("Kernel lacks MADV_POPULATE_WRITE, prefaulting with readv\n");
+	__hugetlb_opts.prefault_method = PREFAULT_READV;
+}
+
 /*
  * Pool counters are typically exposed in sysfs in modern kernels, the
  * counters for the default page size are exposed in procfs in all kernels
@@ -1063,8 +1323,99 @@ int hugetlbfs_unlinked_fd(void)
 		return -1;
 }
 
+/*
+ * Read a list of ranges such as "0-3,8" from a sysfs file into a bitmap.
+ * Returns the number of bits set, or -1 if the file could not be read.
+ */
+static int read_node_list(const char *path, unsigned long *mask,
+			  int max_nodes)
+{
+	char buf[256], *p, *end;
+	long first, last, n;
+	int nr = 0;
+	FILE *f;
+
+	memset(mask, 0, max_nodes / 8);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	for (p = buf; *p && *p != '\n'; p = end) {
+		first = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (n = first; n <= last && n < max_nodes; n++) {
+			mask[n / (8 * sizeof(long))] |=
+				1UL << (n % (8 * sizeof(long)));
+			nr++;
+		}
+		if (*end == ',')
+			end++;
+	}
+
+	return nr;
+}
+
+/* Each prefault worker is given at least this much of the region */
+#define PREFAULT_MIN_CHUNK	(32UL << 20)
+#define PREFAULT_MAX_THREADS	64
 #define IOV_LEN 64
-int hugetlbfs_prefault(void *addr, size_t length)
+
+struct prefault_work {
+	pthread_t thread;
+	bool started;
+	void *addr;
+	size_t length;
+	long page_size;
+	int ret;
+};
+
+/*
+ * /dev/zero, kept open for the readv() method rather than opened on every
+ * prefault. The application may close the descriptor behind our back and
+ * reuse the number, so it is only trusted while it still refers to the
+ * device it was opened on.
+ */
+static int prefault_zero_fd = -1;
+static dev_t prefault_zero_rdev;
+
+static int prefault_zero_fd_get(void)
+{
+	struct stat st;
+	int fd, new_fd;
+
+	fd = __atomic_load_n(&prefault_zero_fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) &&
+	    st.st_rdev == prefault_zero_rdev)
+		return fd;
+
+	new_fd = open("/dev/zero", O_RDONLY|O_CLOEXEC);
+	if (new_fd < 0) {
+		ERROR("Failed to open /dev/zero for reading\n");
+		return -1;
+	}
+	if (fstat(new_fd, &st) == 0)
+		prefault_zero_rdev = st.st_rdev;
+
+	/* Another thread may have reopened it first, use theirs */
+	if (!__atomic_compare_exchange_n(&prefault_zero_fd, &fd, new_fd, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(new_fd);
+		return fd;
+	}
+	return new_fd;
+}
+
+/* Touch one byte in each hugepage of a range with readv(2) of /dev/zero */
+static int prefault_readv(void *addr, size_t length, long page_size)
 {
 	size_t offset;
 	struct iovec iov[IOV_LEN];
@@ -1072,54 +1423,324 @@ int hugetlbfs_prefault(void *addr, size_t length)
 	int i;
 	int fd;
 
+	fd = prefault_zero_fd_get();
+	if (fd < 0)
+		return -ENOMEM;
+
+	for (offset = 0; offset < length; ) {
+		for (i = 0; i < IOV_LEN && offset < length; i++) {
+			iov[i].iov_base = addr + offset;
+			iov[i].iov_len = 1;
+			offset += page_size;
+		}
+		ret = readv(fd, iov, i);
+		if (ret != i) {
+			DEBUG("Got %d of %d requested; err=%d\n", ret,
+					i, ret < 0 ? errno : 0);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Fault a range with MADV_POPULATE_WRITE (Linux 5.14), which instantiates
+ * every page in one call and reports a shortage of hugepages as an error.
+ */
+static int prefault_madvise(void *addr, size_t length)
+{
+	while (madvise(addr, length, MADV_POPULATE_WRITE) != 0) {
+		if (errno == EINTR)
+			continue;
+		DEBUG("MADV_POPULATE_WRITE of %p+%zu failed: %s\n", addr,
+			length, strerror(errno));
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Fault a range with the method chosen by HUGETLB_PREFAULT_METHOD, or by
+ * hugetlbfs_check_populate_write() when that is unset
+ */
+static int prefault_range(void *addr, size_t length, long page_size)
+{
+	if (__hugetlb_opts.prefault_method == PREFAULT_MADVISE)
+		return prefault_madvise(addr, length);
+
+	return prefault_readv(addr, length, page_size);
+}
+
+int hugetlbfs_prefault(void *addr, size_t length, long page_size, int node)
+{
 	if (!__hugetlbfs_prefault)
 		return 0;
 
+	return hugetlbfs_populate(addr, length, page_size, node);
+}
+
+static void *prefault_worker(void *arg)
+{
+	struct prefault_work *work = arg;
+
+	work->ret = prefault_range(work->addr, work->length, work->page_size);
+	return NULL;
+}
+
+/*
+ * Restrict the prefault workers to the CPUs of the node that should own
+ * the pages so that the kernel zeroes them locally. Failing to do so
+ * only costs performance, so errors are not reported.
+ */
+static void prefault_pin_node(pthread_attr_t *attr, int node)
+{
+	unsigned long mask[CPU_SETSIZE / (8 * sizeof(long))];
+	char path[PATH_MAX+1];
+	cpu_set_t cpus;
+	int cpu;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 node);
+	if (read_node_list(path, mask, CPU_SETSIZE) <= 0)
+		return;
+
+	CPU_ZERO(&cpus);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (mask[cpu / (8 * sizeof(long))] &
+		    (1UL << (cpu % (8 * sizeof(long)))))
+			CPU_SET(cpu, &cpus);
+	pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+}
+
+/*
+ * Split a range into page aligned pieces, one per prefault thread, and
+ * fault them concurrently. The calling thread takes the first piece. A
+ * worker that cannot be started has its piece done by the caller.
+ */
+static int prefault_parallel(void *addr, size_t length, long page_size,
+			     int node, int nr_threads)
+{
+	struct prefault_work work[PREFAULT_MAX_THREADS];
+	pthread_attr_t attr;
+	size_t chunk, offset;
+	int i, ret = 0;
+
+	chunk = ALIGN(length / nr_threads, page_size);
+
+	pthread_attr_init(&attr);
+	if (node >= 0)
+		prefault_pin_node(&attr, node);
+
+	for (i = 0, offset = 0; i < nr_threads && offset < length; i++) {
+		work[i].addr = addr + offset;
+		work[i].page_size = page_size;
+		work[i].length = chunk;
+		if (offset + chunk > length)
+			work[i].length = length - offset;
+		work[i].ret = 0;
+		work[i].started = false;
+		offset += work[i].length;
+
+		if (i == 0)
+			continue;
+		if (pthread_create(&work[i].thread, &attr, prefault_worker,
+				   &work[i]) == 0)
+			work[i].started = true;
+		else
+			DEBUG("Prefault worker %d failed to start\n", i);
+	}
+	nr_threads = i;
+	pthread_attr_destroy(&attr);
+
+	for (i = 0; i < nr_threads; i++)
+		if (!work[i].started)
+			prefault_worker(&work[i]);
+
+	/* Wait for every worker even after a failure, the caller unmaps */
+	for (i = 0; i < nr_threads; i++) {
+		if (work[i].started)
+			pthread_join(work[i].thread, NULL);
+		if (work[i].ret != 0)
+			ret = work[i].ret;
+	}
+
+	return ret;
+}
+
+/*
+ * Instantiate the hugepages of a region whether or not prefaulting is
+ * enabled, for callers that must learn now that the pages cannot be had,
+ * for example because they were bound to a node with too few free.
+ * page_size is the page size of the mapping and node is the NUMA node the
+ * pages should come from, or -1 if there is none.
+ */
+int hugetlbfs_populate(void *addr, size_t length, long page_size, int node)
+{
+	struct timespec start, end;
+	size_t min_chunk;
+	int nr_threads;
+	int ret;
+
 	/*
 	 * The NUMA users of libhugetlbfs' malloc feature are
 	 * expected to use the numactl program to specify an
 	 * appropriate policy for hugepage allocation
 	 *
-	 * Use readv(2) to instantiate the hugepages unless HUGETLB_NO_PREFAULT
-	 * is set. If we instead returned a hugepage mapping with insufficient
-	 * hugepages, the VM system would kill the process when the
-	 * process tried to access the missing memory.
+	 * Instantiate the hugepages with MADV_POPULATE_WRITE, or readv(2)
+	 * on older kernels, unless HUGETLB_NO_PREFAULT is set. If we instead
+	 * returned a hugepage mapping with insufficient hugepages, the VM
+	 * system would kill the process when the process tried to access
+	 * the missing memory.
 	 *
 	 * The value of this environment variable is read during library
 	 * initialisation and sets __hugetlbfs_prefault accordingly. If
 	 * prefaulting is enabled and we can't get all that were requested,
 	 * -ENOMEM is returned. The caller is expected to release the entire
 	 * mapping and optionally it may recover by mapping base pages instead.
+	 *
+	 * Large regions are split across HUGETLB_PREFAULT_THREADS threads;
+	 * the region is only good if every thread got all of its pages.
 	 */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	min_chunk = page_size > PREFAULT_MIN_CHUNK ? page_size :
+		PREFAULT_MIN_CHUNK;
+	nr_threads = __atomic_load_n(&__hugetlb_opts.prefault_threads,
+				     __ATOMIC_RELAXED);
+	if (nr_threads > length / min_chunk)
+		nr_threads = length / min_chunk;
+
+	if (nr_threads > 1)
+		ret = prefault_parallel(addr, length, page_size, node,
+					nr_threads);
+	else
+		ret = prefault_range(addr, length, page_size);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	hugetlbfs_stat_prefault(length, (end.tv_sec - start.tv_sec) *
+				1000000000ULL + end.tv_nsec - start.tv_nsec,
+				ret != 0);
+	if (ret != 0)
+		WARNING("Failed to reserve %ld huge pages "
+				"for new region\n",
+				length / page_size);
+
+	return ret;
+}
 
-	fd = open("/dev/zero", O_RDONLY);
-	if (fd < 0) {
-		ERROR("Failed to open /dev/zero for reading\n");
-		return -ENOMEM;
+/*
+ * Allocate the hugepages backing part of a hugetlbfs file that is about
+ * to be mapped MAP_SHARED, so that a shortage is reported here instead of
+ * by SIGBUS when the mapping is written. Kernels without fallocate(2) on
+ * hugetlbfs (before 4.3) leave the pages to be faulted as they are used.
+ */
+int hugetlbfs_populate_fd(int fd, off_t offset, size_t length)
+{
+	if (fallocate(fd, 0, offset, length) == 0)
+		return 0;
+	if (errno == EOPNOTSUPP || errno == ENOSYS)
+		return 0;
+
+	DEBUG("fallocate(%d, %ld, %zu) failed: %s\n", fd, (long)offset,
+		length, strerror(errno));
+	return -ENOMEM;
+}
+
+/*
+ * Set the number of threads hugepage regions are prefaulted with, 0
+ * meaning one per online CPU. Returns the previous setting.
+ */
+int hugetlb_set_prefault_threads(int nr_threads)
+{
+	int old;
+
+	if (nr_threads < 0) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	for (offset = 0; offset < length; ) {
-		for (i = 0; i < IOV_LEN && offset < length; i++) {
-			iov[i].iov_base = addr + offset;
-			iov[i].iov_len = 1;
-			offset += gethugepagesize();
-		}
-		ret = readv(fd, iov, i);
-		if (ret != i) {
-			DEBUG("Got %d of %d requested; err=%d\n", ret,
-					i, ret < 0 ? errno : 0);
-			WARNING("Failed to reserve %ld huge pages "
-					"for new region\n",
-					length / gethugepagesize());
-			close(fd);
-			return -ENOMEM;
+	if (nr_threads == 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > PREFAULT_MAX_THREADS)
+		nr_threads = PREFAULT_MAX_THREADS;
+
+	old = __atomic_exchange_n(&__hugetlb_opts.prefault_threads, nr_threads,
+				  __ATOMIC_RELAXED);
+
+	/*
+	 * As with HUGETLB_PREFAULT_THREADS, more than one thread prefaults
+	 * even where MAP_PRIVATE reservations made it unnecessary, but not
+	 * against HUGETLB_NO_PREFAULT.
+	 */
+	if (prefault_by_threads)
+		__atomic_store_n(&__hugetlbfs_prefault, nr_threads > 1,
+				 __ATOMIC_RELAXED);
+	return old ? old : 1;
+}
+
+/*
+ * Apply a NUMA memory policy to a range before it is faulted. A node of
+ * -1 selects every node with memory, which is what MPOL_INTERLEAVE
+ * wants; MPOL_PREFERRED and MPOL_BIND take the single node given. The
+ * raw system call is used so that libnuma is not needed.
+ */
+int hugetlbfs_mbind(void *addr, size_t length, int mode, int node)
+{
+	unsigned long mask[HUGETLB_MAX_NODES / (8 * sizeof(long))];
+
+	if (node >= HUGETLB_MAX_NODES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (node < 0) {
+		if (read_node_list("/sys/devices/system/node/has_memory",
+				   mask, HUGETLB_MAX_NODES) <= 0) {
+			/* Not a NUMA system, there is nothing to place */
+			return 0;
 		}
+	} else {
+		memset(mask, 0, sizeof(mask));
+		mask[node / (8 * sizeof(long))] |=
+			1UL << (node % (8 * sizeof(long)));
+	}
+
+	/* The kernel expects one more than the number of bits in the mask */
+	if (syscall(__NR_mbind, addr, length, mode, mask,
+		    HUGETLB_MAX_NODES + 1, 0) != 0) {
+		DEBUG("mbind(%p, %zu, %d, node %d) failed: %s\n", addr,
+			length, mode, node, strerror(errno));
+		return -1;
 	}
 
-	close(fd);
 	return 0;
 }
 
+/* The node of the CPU the caller is running on */
+int hugetlbfs_local_node(void)
+{
+	unsigned int cpu, node;
+
+	if (syscall(__NR_getcpu, &cpu, &node, NULL) != 0)
+		return 0;
+	return node;
+}
+
+/* Free hugepages of the given size in one node's pool, -1 if unknown */
+long hugetlbfs_node_free_hugepages(int node, long page_size)
+{
+	char path[PATH_MAX+1];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/"
+		 "hugepages/hugepages-%lukB/free_hugepages", node,
+		 page_size / 1024);
+	if (access(path, R_OK) != 0)
+		return -1;
+	return file_read_ulong(path, NULL);
+}
+
 long get_huge_page_counter(long pagesize, unsigned int counter)
 {
 	char file[PATH_MAX+1];
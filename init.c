@@ -32,8 +32,17 @@ static void __attribute__ ((constructor)) setup_libhugetlbfs(void)
 	hugetlbfs_check_priv_resv();
 	hugetlbfs_check_safe_noreserve();
 	hugetlbfs_check_map_hugetlb();
+	hugetlbfs_check_populate_write();
 #ifndef NO_ELFLINK
 	hugetlbfs_setup_elflink();
 #endif
 	hugetlbfs_setup_morecore();
 }
+
+void hugetlb_remap_libs(void)
+{
+#ifndef NO_ELFLINK
+	hugetlbfs_forget_libs();
+	hugetlbfs_remap_libs();
+#endif
+}
@@ -48,6 +48,10 @@ static struct feature kernel_features[] = {
 	[HUGETLB_FEATURE_MAP_HUGETLB] = {
 		.name			= "map_hugetlb",
 		.required_version	= "2.6.32",
+	},
+	[HUGETLB_FEATURE_MREMAP] = {
+		.name			= "hugetlb_mremap",
+		.required_version	= "5.16.0",
 	}
 };
 
@@ -34,11 +34,13 @@
 #include <link.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifndef __LIBHUGETLBFS__
 #error This header should not be included by library users.
 #endif /* __LIBHUGETLBFS__ */
 
+#include "hugetlbfs.h"
 #include "libhugetlbfs_privutils.h"
 #include "libhugetlbfs_testprobes.h"
 
@@ -49,6 +51,8 @@
 #define ALIGN_UP(x,a)	ALIGN(x,a)
 #define ALIGN_DOWN(x,a) ((x) & ~((a) - 1))
 
+#define MAX_HPAGE_SIZES 10
+
 #if defined(__powerpc64__) || \
 	(defined(__powerpc__) && !defined(PPC_NO_SEGMENTS))
 #define SLICE_LOW_SHIFT		28
@@ -57,6 +61,41 @@
 #define SLICE_HIGH_SHIFT	63
 #endif
 
+/* NUMA memory policy modes for hugetlbfs_mbind(), see mbind(2) */
+#define HUGETLB_MAX_NODES	1024
+#define MPOL_PREFERRED		1
+#define MPOL_BIND		2
+#define MPOL_INTERLEAVE		3
+
+/* Where threads' malloc()s come from, see HUGETLB_MORECORE_ARENAS */
+#define ARENAS_GLIBC		0
+#define ARENAS_MAIN		1
+
+/* Transparent hugepage advice missing from older headers */
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE		14
+#endif
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE		25
+#endif
+
+/* Prefaulting advice of Linux 5.14, see hugetlbfs_check_populate_write() */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+/* How hugetlbfs_populate() faults pages, see HUGETLB_PREFAULT_METHOD */
+#define PREFAULT_AUTO		0
+#define PREFAULT_MADVISE	1
+#define PREFAULT_READV		2
+
+/* How large copies are made, see HUGETLB_COPY_METHOD */
+#define COPY_AUTO		0
+#define COPY_MEMCPY		1
+#define COPY_SSE2		2
+#define COPY_AVX2		3
+#define COPY_AVX512		4
+
 struct libhugeopts_t {
 	int		sharing;
 	bool		min_copy;
@@ -65,15 +104,34 @@ struct libhugeopts_t {
 	bool		no_reserve;
 	bool		map_hugetlb;
 	bool		thp_morecore;
+	bool		thp_fallback;
+	bool		thp_collapse;
+	bool		heap_lock;
+	int		morecore_arenas;
+	int		morecore_mpol;
+	int		morecore_node;
 	unsigned long	force_elfmap;
+	unsigned long	heap_reserve;
+	unsigned long	heap_prealloc;
+	double		growth_factor;
+	unsigned long	growth_max;
+	unsigned long	morecore_backoff;
+	unsigned long	region_cache;
+	int		prefault_threads;
+	int		elfmap_threads;
+	int		prefault_method;
+	int		copy_method;
+	unsigned long	prefault_rate;
 	char		*ld_preload;
 	char		*elfmap;
+	char		*elfmap_libs;
 	char		*share_path;
 	char 		*features;
 	char		*path;
 	char		*def_page_size;
 	char		*morecore;
 	char		*heapbase;
+	char		*stats;
 };
 
 /*
@@ -95,8 +153,20 @@ extern bool __hugetlbfs_prefault;
 extern void hugetlbfs_setup_env();
 #define hugetlbfs_setup_elflink __lh_hugetlbfs_setup_elflink
 extern void hugetlbfs_setup_elflink();
+#define hugetlbfs_remap_libs __lh_hugetlbfs_remap_libs
+extern void hugetlbfs_remap_libs(void);
+#define hugetlbfs_forget_libs __lh_hugetlbfs_forget_libs
+extern void hugetlbfs_forget_libs(void);
 #define hugetlbfs_setup_morecore __lh_hugetlbfs_setup_morecore
 extern void hugetlbfs_setup_morecore();
+#define hugetlbfs_setup_heap __lh_hugetlbfs_setup_heap
+extern void hugetlbfs_setup_heap(void *(*grow)(ptrdiff_t),
+		long (*release)(void *, void *, void *, size_t),
+		long (*restore)(void *, void *, void *, size_t),
+		long hpage_size);
+#define hugetlbfs_morecore_coverage __lh_hugetlbfs_morecore_coverage
+extern void hugetlbfs_morecore_coverage(unsigned long long *rss,
+					unsigned long long *thp);
 #define hugetlbfs_setup_debug __lh_hugetlbfs_setup_debug
 extern void hugetlbfs_setup_debug();
 #define setup_mounts __lh_setup_mounts
@@ -109,10 +179,37 @@ extern void hugetlbfs_check_priv_resv();
 extern void hugetlbfs_check_safe_noreserve();
 #define hugetlbfs_check_map_hugetlb __lh_hugetblfs_check_map_hugetlb
 extern void hugetlbfs_check_map_hugetlb();
+#define hugetlbfs_check_populate_write __lh_hugetlbfs_check_populate_write
+extern void hugetlbfs_check_populate_write();
 #define __hugetlbfs_hostname __lh___hugetlbfs_hostname
 extern char __hugetlbfs_hostname[];
 #define hugetlbfs_prefault __lh_hugetlbfs_prefault
-extern int hugetlbfs_prefault(void *addr, size_t length);
+extern int hugetlbfs_prefault(void *addr, size_t length, long page_size,
+			      int node);
+#define hugetlbfs_populate __lh_hugetlbfs_populate
+extern int hugetlbfs_populate(void *addr, size_t length, long page_size,
+			      int node);
+#define hugetlbfs_populate_fd __lh_hugetlbfs_populate_fd
+extern int hugetlbfs_populate_fd(int fd, off_t offset, size_t length);
+#define hugetlbfs_copy __lh_hugetlbfs_copy
+extern void hugetlbfs_copy(void *dst, const void *src, size_t len);
+#define hugetlbfs_mbind __lh_hugetlbfs_mbind
+extern int hugetlbfs_mbind(void *addr, size_t length, int mode, int node);
+#define hugetlbfs_local_node __lh_hugetlbfs_local_node
+extern int hugetlbfs_local_node(void);
+#define hugetlbfs_node_free_hugepages __lh_hugetlbfs_node_free_hugepages
+extern long hugetlbfs_node_free_hugepages(int node, long page_size);
+#define hugetlbfs_stat_add __lh_hugetlbfs_stat_add
+extern void hugetlbfs_stat_add(size_t offset, unsigned long long n);
+#define hugetlbfs_stat_alloc __lh_hugetlbfs_stat_alloc
+extern void hugetlbfs_stat_alloc(long page_size);
+#define hugetlbfs_stat_free __lh_hugetlbfs_stat_free
+extern void hugetlbfs_stat_free(long page_size);
+#define hugetlbfs_stat_prefault __lh_hugetlbfs_stat_prefault
+extern void hugetlbfs_stat_prefault(size_t len, unsigned long long ns,
+				    int failed);
+#define STAT_ADD(field, n) \
+	hugetlbfs_stat_add(offsetof(struct hugetlbfs_stats, field), (n))
 #define parse_page_size __lh_parse_page_size
 extern long parse_page_size(const char *str);
 #define probe_default_hpage_size __lh__probe_default_hpage_size
@@ -182,6 +279,10 @@ extern unsigned long long size_to_smaller_unit(unsigned long long size);
 
 #define file_read_ulong __lh_file_read_ulong
 extern long file_read_ulong(char *file, const char *tag);
+#define thp_page_size __lh_thp_page_size
+extern long thp_page_size(void);
+#define flags_page_size __lh_flags_page_size
+extern long flags_page_size(unsigned long flags);
 #define file_write_ulong __lh_file_write_ulong
 extern int file_write_ulong(char *file, unsigned long val);
 
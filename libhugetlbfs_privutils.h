@@ -86,6 +86,9 @@ enum {
 	/* If the kernel has the ability to mmap(MAP_HUGETLB)*/
 	HUGETLB_FEATURE_MAP_HUGETLB,
 
+	/* Whether hugetlb mappings can be moved with mremap() */
+	HUGETLB_FEATURE_MREMAP,
+
 	HUGETLB_FEATURE_NR,
 };
 #define hugetlbfs_test_feature __pu_hugetlbfs_test_feature
@@ -28,26 +28,48 @@
 #include <dlfcn.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "hugetlbfs.h"
 
 #include "libhugetlbfs_internal.h"
 
-#ifndef HAS_MORECORE
-void hugetlbfs_setup_morecore(void)
-{
-	INFO("Not setting up morecore because it's not available (see issue #52).\n");
-}
-#else
+/* heap.o, which replaces malloc(), is only part of the shared library */
+extern void hugetlbfs_setup_heap(void *(*grow)(ptrdiff_t),
+		long (*release)(void *, void *, void *, size_t),
+		long (*restore)(void *, void *, void *, size_t),
+		long hpage_size) __attribute__((weak));
 
 static int heap_fd;
 
 static void *heapbase;
 static void *heaptop;
 static long mapsize;
+/* How far the heap would be mapped had it not grown ahead */
+static long exact_size;
 static long hpage_size;
+static void *reserve_end;	/* End of HUGETLB_MORECORE_RESERVE space */
+static long prealloc_size;	/* Heap kept from HUGETLB_MORECORE_PREALLOC */
 
-static long hugetlbfs_next_addr(long addr)
+/*
+ * HUGETLB_MORECORE may list larger page sizes for the heap to move on to
+ * as it grows. Each tier takes over once the heap is threshold bytes
+ * long, from the first address after that which suits its pages. Until
+ * then the smaller pages fill the gap, so the heap stays contiguous.
+ * heap_fd and hpage_size are those of the tier currently growing.
+ */
+#define MORECORE_MAX_TIERS	4
+
+static struct morecore_tier {
+	long page_size;
+	long threshold;
+	long start;		/* Offset of the tier's first page in the heap */
+	int fd;
+} tiers[MORECORE_MAX_TIERS];
+static int nr_tiers = 1;
+static int cur_tier;
+
+static long hugetlbfs_next_addr(long addr, long page_size)
 {
 #if defined(__powerpc64__)
 	return ALIGN(addr, 1L << SLICE_HIGH_SHIFT);
@@ -57,12 +79,170 @@ static long hugetlbfs_next_addr(long addr)
 	if (addr < (1UL << SLICE_HIGH_SHIFT))
 		return ALIGN(addr, 1UL << SLICE_HIGH_SHIFT);
 	else
-		return ALIGN(addr, hpage_size);
+		return ALIGN(addr, page_size);
 #else
-	return ALIGN(addr, hpage_size);
+	return ALIGN(addr, page_size);
 #endif
 }
 
+/*
+ * Unmap part of the heap. What lies in the reserved address space is
+ * put back to PROT_NONE instead, so that nothing else is mapped there
+ * before the heap grows into it again.
+ */
+static int hugetlbfs_morecore_unmap(void *p, long len)
+{
+	long reserved = 0;
+
+	if ((char *)p < (char *)reserve_end)
+		reserved = (char *)reserve_end - (char *)p;
+	if (reserved > len)
+		reserved = len;
+
+	if (reserved && mmap(p, reserved, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|
+			     MAP_NORESERVE|MAP_FIXED, -1, 0) == MAP_FAILED)
+		return -1;
+	if (len > reserved)
+		return munmap(p + reserved, len - reserved);
+	return 0;
+}
+
+static void tier_select(int tier)
+{
+	cur_tier = tier;
+	heap_fd = tiers[tier].fd;
+	hpage_size = tiers[tier].page_size;
+}
+
+/*
+ * Apply the HUGETLB_MORECORE_NUMA policy to a piece of heap before its
+ * pages are faulted. "local" prefers the node of the thread growing the
+ * heap, rather than wherever the prefault happens to run. Returns the
+ * node the pages should come from, or -1 for any.
+ */
+static int hugetlbfs_morecore_mbind(void *p, long len)
+{
+	int mode = __hugetlb_opts.morecore_mpol;
+	int node = -1;
+
+	if (!mode)
+		return -1;
+	if (mode == MPOL_PREFERRED)
+		node = hugetlbfs_local_node();
+	else if (mode == MPOL_BIND)
+		node = __hugetlb_opts.morecore_node;
+
+	if (hugetlbfs_mbind(p, len, mode, node) != 0)
+		WARNING("Unable to place heap at %p: %s\n", p,
+			strerror(errno));
+	return node;
+}
+
+/*
+ * Map delta more bytes of the current tier at the top of the heap.
+ * Returns 0, or -1 if the pages could not be had where they are needed.
+ */
+static int hugetlbfs_morecore_map(long delta)
+{
+	void *p;
+	int mmap_reserve = __hugetlb_opts.no_reserve ? MAP_NORESERVE : 0;
+	int mmap_hugetlb = 0;
+	int mmap_fixed = 0;
+	int using_default_pagesize =
+		(hpage_size == kernel_default_hugepage_size());
+	long offset = mapsize - tiers[cur_tier].start;
+	int node, ret;
+
+	/* Replace the reservation, where nobody else can have mapped */
+	if ((char *)heapbase + mapsize + delta <= (char *)reserve_end)
+		mmap_fixed = MAP_FIXED;
+
+#ifdef MAP_HUGETLB
+	mmap_hugetlb = MAP_HUGETLB;
+#endif
+
+	INFO("Attempting to map %ld bytes\n", delta);
+
+	/* map in (extend) more of the file at the end of our last map */
+	if (__hugetlb_opts.map_hugetlb && using_default_pagesize)
+		p = mmap(heapbase + mapsize, delta, PROT_READ|PROT_WRITE,
+			 mmap_hugetlb|MAP_ANONYMOUS|MAP_PRIVATE|mmap_reserve|
+			 mmap_fixed, heap_fd, offset);
+	else
+		p = mmap(heapbase + mapsize, delta, PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|mmap_reserve|mmap_fixed, heap_fd, offset);
+
+	if (p == MAP_FAILED) {
+		WARNING("New heap segment map at %p failed: %s\n",
+			heapbase+mapsize, strerror(errno));
+		/* A failed MAP_FIXED may have taken the reservation with it */
+		if (mmap_fixed)
+			hugetlbfs_morecore_unmap(heapbase + mapsize, delta);
+		return -1;
+	}
+
+	/* if this is the first map */
+	if (! mapsize) {
+		if (heapbase && (heapbase != p)) {
+			WARNING("Heap originates at %p instead of %p\n",
+				p, heapbase);
+			STAT_ADD(morecore_contig_failures, 1);
+			if (__hugetlbfs_debug)
+				dump_proc_pid_maps();
+		}
+		/* then setup the heap variables */
+		heapbase = heaptop = p;
+	} else if (p != (heapbase + mapsize)) {
+		/* Couldn't get the mapping where we wanted */
+		munmap(p, delta);
+		WARNING("New heap segment mapped at %p instead of %p\n",
+		      p, heapbase + mapsize);
+		STAT_ADD(morecore_contig_failures, 1);
+		if (__hugetlbfs_debug)
+			dump_proc_pid_maps();
+		return -1;
+	}
+
+	/*
+	 * Fault the region to ensure accesses succeed. A heap bound to a
+	 * node is always faulted, as a fault the node cannot satisfy would
+	 * kill the process later.
+	 */
+	node = hugetlbfs_morecore_mbind(p, delta);
+	if (__hugetlb_opts.morecore_mpol == MPOL_BIND)
+		ret = hugetlbfs_populate(p, delta, hpage_size, node);
+	else
+		ret = hugetlbfs_prefault(p, delta, hpage_size, node);
+	if (ret != 0) {
+		hugetlbfs_morecore_unmap(p, delta);
+		return -1;
+	}
+
+	/* we now have mmap'd further */
+	mapsize += delta;
+	STAT_ADD(morecore_grows, 1);
+	return 0;
+}
+
+/*
+ * How far to grow a heap that is delta bytes short. With
+ * HUGETLB_MORECORE_GROWTH=geometric, the heap grows by a factor of its
+ * size up to a limit, so a growing heap needs fewer mmap()s and prefaults.
+ * Callers still see the heap grow by just what they ask for.
+ */
+static long hugetlbfs_morecore_step(long delta)
+{
+	long step;
+
+	if (!__hugetlb_opts.growth_factor)
+		return delta;
+
+	step = mapsize * (__hugetlb_opts.growth_factor - 1);
+	if (step > __hugetlb_opts.growth_max)
+		step = __hugetlb_opts.growth_max;
+	return step > delta ? step : delta;
+}
+
 /*
  * Our plan is to ask for pages 'roughly' at the BASE.  We expect and
  * require the kernel to offer us sequential pages from wherever it
@@ -77,11 +257,9 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 {
 	int ret;
 	void *p;
-	long delta;
-	int mmap_reserve = __hugetlb_opts.no_reserve ? MAP_NORESERVE : 0;
-	int mmap_hugetlb = 0;
-	int using_default_pagesize =
-		(hpage_size == kernel_default_hugepage_size());
+	long delta, want, target, chunk, start;
+	struct morecore_tier *next;
+	int tier_end;
 
 	INFO("hugetlbfs_morecore(%ld) = ...\n", (long)increment);
 
@@ -89,67 +267,92 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 	 * how much to grow the heap by =
 	 * 	(size of heap) + malloc request - mmap'd space
 	 */
-	delta = (heaptop-heapbase) + increment - mapsize;
+	want = (heaptop-heapbase) + increment;
+	delta = want - mapsize;
 
 	INFO("heapbase = %p, heaptop = %p, mapsize = %lx, delta=%ld\n",
 	      heapbase, heaptop, mapsize, delta);
 
+	/* A tier that has not mapped anything yet has nothing to give back */
+	while (delta < 0 && cur_tier && tiers[cur_tier].start == mapsize)
+		tier_select(cur_tier - 1);
+
 	/* align to multiple of hugepagesize. */
 	delta = ALIGN(delta, hpage_size);
 
-#ifdef MAP_HUGETLB
-	mmap_hugetlb = MAP_HUGETLB;
-#endif
+	/* The preallocated heap stays mapped */
+	if (delta < 0 && mapsize + delta < prealloc_size)
+		delta = prealloc_size - mapsize;
 
+	target = want;
 	if (delta > 0) {
-		/* growing the heap */
-
-		INFO("Attempting to map %ld bytes\n", delta);
+		target = mapsize + hugetlbfs_morecore_step(delta);
+		delta = ALIGN(target - mapsize, hpage_size);
+		exact_size = ALIGN(want, hpage_size);
+	} else if (increment >= 0) {
+		/* Never give back what was mapped ahead while growing */
+		delta = 0;
+		if (want > exact_size) {
+			STAT_ADD(morecore_grows_avoided, 1);
+			exact_size = ALIGN(want, hpage_size);
+		}
+	}
 
-		/* map in (extend) more of the file at the end of our last map */
-		if (__hugetlb_opts.map_hugetlb && using_default_pagesize)
-			p = mmap(heapbase + mapsize, delta, PROT_READ|PROT_WRITE,
-				 mmap_hugetlb|MAP_ANONYMOUS|MAP_PRIVATE|mmap_reserve,
-				 heap_fd, mapsize);
-		else
-			p = mmap(heapbase + mapsize, delta, PROT_READ|PROT_WRITE,
-				 MAP_PRIVATE|mmap_reserve, heap_fd, mapsize);
+	while (delta > 0) {
+		/* growing the heap */
+		chunk = delta;
+		tier_end = 0;
+		next = cur_tier + 1 < nr_tiers ? &tiers[cur_tier + 1] : NULL;
+		if (next && mapsize + delta > next->threshold) {
+			/* Stop where the next tier's pages can begin */
+			start = hugetlbfs_next_addr((long)heapbase +
+					(mapsize > next->threshold ?
+					 mapsize : next->threshold),
+					next->page_size) - (long)heapbase;
+			if (start < mapsize + delta) {
+				chunk = start - mapsize;
+				tier_end = 1;
+			}
+		}
 
-		if (p == MAP_FAILED) {
-			WARNING("New heap segment map at %p failed: %s\n",
-				heapbase+mapsize, strerror(errno));
-			return NULL;
+		/*
+		 * Stop at the end of the reservation too. Only the space
+		 * inside it can be mapped MAP_FIXED, and a hint inside it
+		 * would be refused.
+		 */
+		start = (char *)reserve_end - (char *)heapbase;
+		if (mapsize < start && mapsize + chunk > start) {
+			chunk = start - mapsize;
+			tier_end = 0;
 		}
 
-		/* if this is the first map */
-		if (! mapsize) {
-			if (heapbase && (heapbase != p)) {
-				WARNING("Heap originates at %p instead of %p\n",
-					p, heapbase);
-				if (__hugetlbfs_debug)
-					dump_proc_pid_maps();
+		if (chunk && hugetlbfs_morecore_map(chunk) != 0) {
+			if (target > want) {
+				/* Try again without growing ahead */
+				target = want;
+			} else if (!cur_tier ||
+				   tiers[cur_tier].start != mapsize) {
+				return NULL;
+			} else {
+				/* The larger pages are not to be had */
+				WARNING("Unable to grow heap with %ld kB pages, "
+					"continuing with %ld kB pages\n",
+					hpage_size / 1024,
+					tiers[cur_tier - 1].page_size / 1024);
+				nr_tiers = cur_tier;
+				tier_select(cur_tier - 1);
 			}
-			/* then setup the heap variables */
-			heapbase = heaptop = p;
-		} else if (p != (heapbase + mapsize)) {
-			/* Couldn't get the mapping where we wanted */
-			munmap(p, delta);
-			WARNING("New heap segment mapped at %p instead of %p\n",
-			      p, heapbase + mapsize);
-			if (__hugetlbfs_debug)
-				dump_proc_pid_maps();
-			return NULL;
+		} else if (tier_end) {
+			tiers[cur_tier + 1].start = mapsize;
+			tier_select(cur_tier + 1);
+			INFO("Heap is %ld bytes, growing it with %ld kB pages\n",
+				mapsize, hpage_size / 1024);
 		}
 
-		/* Fault the region to ensure accesses succeed */
-		if (hugetlbfs_prefault(p, delta) != 0) {
-			munmap(p, delta);
-			return NULL;
-		}
+		delta = ALIGN(target - mapsize, hpage_size);
+	}
 
-		/* we now have mmap'd further */
-		mapsize += delta;
-	} else if (delta < 0) {
+	if (delta < 0) {
 		/* shrinking the heap */
 
 		if (!__hugetlb_opts.shrink_ok) {
@@ -179,14 +382,21 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 			/* we need heaptop + increment == heapbase, so: */
 			increment = heapbase - heaptop;
 		}
+		/* Only pages of the current tier are given back at once */
+		if (mapsize + delta < tiers[cur_tier].start)
+			delta = tiers[cur_tier].start - mapsize;
 		INFO("Attempting to unmap %ld bytes @ %p\n", -delta,
 			heapbase + mapsize + delta);
-		ret = munmap(heapbase + mapsize + delta, -delta);
+		ret = hugetlbfs_morecore_unmap(heapbase + mapsize + delta,
+					       -delta);
 		if (ret) {
 			WARNING("Unmapping failed while shrinking heap: "
 				"%s\n", strerror(errno));
 		} else {
 			mapsize += delta;
+			if (exact_size > mapsize)
+				exact_size = mapsize;
+			STAT_ADD(morecore_shrinks, 1);
 			/*
 			* the glibc assumes by default that newly allocated
 			* memory by morecore() will be zeroed.  It would be
@@ -195,17 +405,21 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 			*/
 			increment = heapbase - heaptop + mapsize;
 
-			if (!__hugetlb_opts.map_hugetlb && !using_default_pagesize){
+			if (!__hugetlb_opts.map_hugetlb &&
+			    hpage_size != kernel_default_hugepage_size()) {
 
 				/*
 				* Now shrink the hugetlbfs file.
 				*/
-				ret = ftruncate(heap_fd, mapsize);
+				ret = ftruncate(heap_fd,
+						mapsize - tiers[cur_tier].start);
 				if (ret) {
 					WARNING("Could not truncate hugetlbfs file to "
 						"shrink heap: %s\n", strerror(errno));
 				}
 			}
+			if (cur_tier && tiers[cur_tier].start == mapsize)
+				tier_select(cur_tier - 1);
 		}
 
 	}
@@ -229,46 +443,86 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 static void *thp_morecore(ptrdiff_t increment)
 {
 	void *p;
-	long delta;
+	long delta, want, step, pad;
 
 	INFO("thp_morecore(%ld) = ...\n", (long)increment);
 
-	delta = (heaptop - heapbase) + increment - mapsize;
-	delta = ALIGN(delta, hpage_size);
+	want = (heaptop - heapbase) + increment;
+	delta = ALIGN(want - mapsize, hpage_size);
+	if (delta > 0) {
+		exact_size = ALIGN(want, hpage_size);
+	} else if (increment >= 0) {
+		/* Never give back what was mapped ahead while growing */
+		delta = 0;
+		if (want > exact_size) {
+			STAT_ADD(morecore_grows_avoided, 1);
+			exact_size = ALIGN(want, hpage_size);
+		}
+	}
+	if (delta < 0 && mapsize + delta < prealloc_size)
+		delta = prealloc_size - mapsize;
 
 	if (delta > 0) {
 		/*
-		 * This first time we expand the mapping we need to account for
-		 * the initial heap mapping not necessarily being huge page
-		 * aligned
+		 * The first time we expand the mapping, the break need not be
+		 * huge page aligned. Start the heap at the next hugepage
+		 * boundary so that all of it can be backed by hugepages,
+		 * leaving the space below unused.
 		 */
-		if (!mapsize)
-			delta = hugetlbfs_next_addr((long)heapbase + delta) -
-					(unsigned long)heapbase;
+		pad = 0;
+		if (!mapsize) {
+			p = sbrk(0);
+			pad = hugetlbfs_next_addr((long)p, hpage_size) - (long)p;
+		}
 
-		INFO("Adding %ld bytes to heap\n", delta);
+		INFO("Adding %ld bytes to heap\n", pad + delta);
 
-		p = sbrk(delta);
+		step = ALIGN(hugetlbfs_morecore_step(delta), hpage_size);
+		p = sbrk(pad + step);
+		if (p == (void *)-1 && step > delta)
+			p = sbrk(pad + (step = delta));
 		if (p == (void *)-1) {
 			WARNING("sbrk returned ENOMEM\n");
 			return NULL;
 		}
+		delta = step;
+
+		/* glibc shares the break, and may have moved it since */
+		if (mapsize && p != heapbase + mapsize) {
+			sbrk(-delta);
+			WARNING("Heap grew at %p instead of %p, the break has "
+				"been moved by someone else\n", p,
+				heapbase + mapsize);
+			STAT_ADD(morecore_contig_failures, 1);
+			if (__hugetlbfs_debug)
+				dump_proc_pid_maps();
+			return NULL;
+		}
 
 		if (!mapsize) {
 			if (heapbase && (heapbase != p)) {
 				WARNING("Heap was expected at %p instead of %p, "
 					"heap has been modified by someone else!\n",
 					heapbase, p);
+				STAT_ADD(morecore_contig_failures, 1);
 				if (__hugetlbfs_debug)
 					dump_proc_pid_maps();
 			}
+			p += pad;
 			heapbase = heaptop = p;
 		}
 
 		mapsize += delta;
-#ifdef MADV_HUGEPAGE
+		STAT_ADD(morecore_grows, 1);
+		hugetlbfs_morecore_mbind(p, delta);
 		madvise(p, delta, MADV_HUGEPAGE);
-#endif
+
+		/* Rather than wait for khugepaged to find the range */
+		if (__hugetlb_opts.thp_collapse &&
+		    hugetlbfs_populate(p, delta, hpage_size, -1) == 0 &&
+		    madvise(p, delta, MADV_COLLAPSE) != 0)
+			INFO("MADV_COLLAPSE of heap at %p failed: %s\n", p,
+				strerror(errno));
 	} else if (delta < 0) {
 		/* shrinking the heap */
 		if (!mapsize) {
@@ -285,6 +539,9 @@ static void *thp_morecore(ptrdiff_t increment)
 		}
 
 		mapsize += delta;
+		if (exact_size > mapsize)
+			exact_size = mapsize;
+		STAT_ADD(morecore_shrinks, 1);
 	}
 
 	p = heaptop;
@@ -293,6 +550,330 @@ static void *thp_morecore(ptrdiff_t increment)
 	return p;
 }
 
+/*
+ * Call fn on the pages of each tier that lie wholly within [lo, hi) and
+ * overlap [p, p + len). Pages only partly in [lo, hi) hold memory still
+ * in use and are left alone. Returns the bytes fn was called on, or -1.
+ */
+static long hugetlbfs_morecore_pages(char *lo, char *hi, char *p, size_t len,
+		int (*fn)(struct morecore_tier *tier, char *p, long len))
+{
+	struct morecore_tier *tier;
+	unsigned long start, end, tier_end;
+	long total = 0;
+	int t;
+
+	for (t = 0; t <= cur_tier; t++) {
+		tier = &tiers[t];
+		tier_end = (unsigned long)heapbase +
+			(t < cur_tier ? tiers[t + 1].start : mapsize);
+
+		start = ALIGN((unsigned long)lo, tier->page_size);
+		if (start < ALIGN_DOWN((unsigned long)p, tier->page_size))
+			start = ALIGN_DOWN((unsigned long)p, tier->page_size);
+		if (start < (unsigned long)heapbase + tier->start)
+			start = (unsigned long)heapbase + tier->start;
+		/* The preallocated heap is never released */
+		if (start < (unsigned long)heapbase + prealloc_size)
+			start = ALIGN((unsigned long)heapbase + prealloc_size,
+				      tier->page_size);
+
+		end = ALIGN_DOWN((unsigned long)hi, tier->page_size);
+		if (end > ALIGN((unsigned long)p + len, tier->page_size))
+			end = ALIGN((unsigned long)p + len, tier->page_size);
+		if (end > tier_end)
+			end = tier_end;
+
+		if (start >= end)
+			continue;
+		if (fn(tier, (char *)start, end - start) != 0)
+			return -1;
+		total += end - start;
+	}
+	return total;
+}
+
+static int release_pages(struct morecore_tier *tier, char *p, long len)
+{
+	int flags = MAP_PRIVATE|MAP_FIXED|MAP_NORESERVE;
+	void *q;
+
+	/* Under THP the heap is anonymous memory, which is simply dropped */
+	if (__hugetlb_opts.thp_morecore)
+		return madvise(p, len, MADV_DONTNEED);
+
+	/*
+	 * Zapped hugepages would stay reserved for the heap, so the range
+	 * is mapped afresh instead, without a reservation.
+	 */
+	if (tier->fd < 0) {
+#ifdef MAP_HUGETLB
+		flags |= MAP_HUGETLB;
+#endif
+		q = mmap(p, len, PROT_READ|PROT_WRITE, flags|MAP_ANONYMOUS,
+			 -1, 0);
+	} else {
+		q = mmap(p, len, PROT_READ|PROT_WRITE, flags, tier->fd,
+			 p - (char *)heapbase - tier->start);
+	}
+	if (q == MAP_FAILED) {
+		WARNING("Unable to release heap pages at %p: %s\n", p,
+			strerror(errno));
+		return -1;
+	}
+	/* The new mapping has the default policy */
+	hugetlbfs_morecore_mbind(p, len);
+
+	/* Drop the file's own pages too, should a read have faulted any */
+	if (tier->fd >= 0)
+		fallocate(tier->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			  p - (char *)heapbase - tier->start, len);
+	return 0;
+}
+
+/* Released hugepages have no reservation, so they are faulted now */
+static int restore_pages(struct morecore_tier *tier, char *p, long len)
+{
+	/* Anonymous memory under THP just faults back in */
+	if (__hugetlb_opts.thp_morecore)
+		return 0;
+	return hugetlbfs_populate(p, len, tier->page_size, -1);
+}
+
+/*
+ * Give the pages backing free space in the middle of the heap back to
+ * the pool. The mapping stays, so the heap is still contiguous, and the
+ * pages are faulted back by hugetlbfs_morecore_restore() before reuse.
+ * [lo, hi) is the free space and [p, p + len) the part of it that may
+ * still be backed. Returns the bytes released or -1.
+ */
+static long hugetlbfs_morecore_release(void *lo, void *hi, void *p,
+				       size_t len)
+{
+	long ret;
+
+	ret = hugetlbfs_morecore_pages(lo, hi, p, len, release_pages);
+	if (ret > 0) {
+		INFO("Released %ld bytes of heap from %p to %p\n", ret, lo, hi);
+		STAT_ADD(morecore_released, ret);
+	}
+	return ret;
+}
+
+/*
+ * Fault back the pages that [p, p + len) is about to use from free space
+ * [lo, hi), of which some may have been released. Returns -1 if they
+ * cannot be had.
+ */
+static long hugetlbfs_morecore_restore(void *lo, void *hi, void *p,
+				       size_t len)
+{
+	long ret;
+
+	ret = hugetlbfs_morecore_pages(lo, hi, p, len, restore_pages);
+	if (ret > 0)
+		STAT_ADD(morecore_restored, ret);
+	return ret;
+}
+
+/*
+ * How much of the THP morecore heap is resident, and how much of that is
+ * backed by transparent hugepages, from the Rss and AnonHugePages of the
+ * mappings it lies in. Both are 0 for a hugetlbfs heap, which is always
+ * on hugepages.
+ */
+void hugetlbfs_morecore_coverage(unsigned long long *rss,
+				 unsigned long long *thp)
+{
+	unsigned long start, end, kb;
+	int in_heap = 0;
+	char line[256];
+	FILE *f;
+
+	*rss = *thp = 0;
+	if (!__hugetlb_opts.thp_morecore || !mapsize)
+		return;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+			in_heap = start < (unsigned long)heapbase + mapsize &&
+				end > (unsigned long)heapbase;
+		else if (in_heap && sscanf(line, "Rss: %lu kB", &kb) == 1)
+			*rss += kb * 1024ULL;
+		else if (in_heap &&
+			 sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+			*thp += kb * 1024ULL;
+	}
+	fclose(f);
+}
+
+#ifdef HAS_MORECORE
+/* Have glibc's malloc() take its main arena from our morecore */
+static void setup_glibc_morecore(void)
+{
+	if (__hugetlb_opts.thp_morecore)
+		__morecore = &thp_morecore;
+	else
+		__morecore = &hugetlbfs_morecore;
+
+	/* Set some allocator options more appropriate for hugepages */
+
+	if (__hugetlb_opts.shrink_ok)
+		mallopt(M_TRIM_THRESHOLD, hpage_size + hpage_size / 2);
+	else
+		mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_TOP_PAD, hpage_size / 2);
+	/* we always want to use our morecore, not ordinary mmap().
+	 * This doesn't appear to prohibit malloc() from falling back
+	 * to mmap() if we run out of hugepages. */
+	mallopt(M_MMAP_MAX, 0);
+#ifdef M_ARENA_MAX
+	/* Threads share the hugepage main arena instead of their own */
+	if (__hugetlb_opts.morecore_arenas == ARENAS_MAIN)
+		mallopt(M_ARENA_MAX, 1);
+#endif
+}
+#endif /* HAS_MORECORE */
+
+/*
+ * Set aside HUGETLB_MORECORE_RESERVE bytes of address space for the heap,
+ * as close to heapaddr as the kernel allows and aligned for the largest
+ * page size. Returns the address the heap should start at.
+ */
+static unsigned long setup_morecore_reserve(unsigned long heapaddr)
+{
+	long align = tiers[nr_tiers - 1].page_size;
+	unsigned long len = ALIGN(__hugetlb_opts.heap_reserve, align);
+	unsigned long start, end;
+	char *p;
+
+	p = mmap((void *)heapaddr, len + align, PROT_NONE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		WARNING("Unable to reserve %lu bytes for the heap: %s\n",
+			len, strerror(errno));
+		return heapaddr;
+	}
+
+	start = hugetlbfs_next_addr((unsigned long)p, align);
+	end = (unsigned long)p + len + align;
+	if (start + len > end) {
+		WARNING("Unable to reserve %lu aligned bytes for the heap\n",
+			len);
+		munmap(p, len + align);
+		return heapaddr;
+	}
+
+	/* Give back what the alignment did not need */
+	if (start > (unsigned long)p)
+		munmap(p, start - (unsigned long)p);
+	if (end > start + len)
+		munmap((void *)(start + len), end - (start + len));
+
+	reserve_end = (void *)(start + len);
+	INFO("Reserved %lu bytes for the heap at 0x%lx\n", len, start);
+	return start;
+}
+
+/*
+ * Map, fault and, if asked, lock HUGETLB_MORECORE_PREALLOC bytes of heap
+ * now, so that malloc() can take them later without a system call or a
+ * page fault. They are handed out as if mapped ahead by an earlier grow,
+ * and are never given back.
+ */
+static void setup_morecore_prealloc(void *(*morecore)(ptrdiff_t))
+{
+	struct timespec start, end;
+	unsigned long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!morecore(__hugetlb_opts.heap_prealloc)) {
+		WARNING("Unable to preallocate %lu bytes of heap\n",
+			__hugetlb_opts.heap_prealloc);
+		return;
+	}
+	/* Growing may have left the faults to the first touch */
+	if (hugetlbfs_populate(heapbase, mapsize, hpage_size, -1) != 0)
+		WARNING("Unable to fault preallocated heap\n");
+	/* hugetlbfs pages are never reclaimed, only a THP heap needs locking */
+	if (__hugetlb_opts.heap_lock && __hugetlb_opts.thp_morecore &&
+	    mlock(heapbase, mapsize) != 0)
+		WARNING("Unable to lock preallocated heap: %s\n",
+			strerror(errno));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	prealloc_size = mapsize;
+	heaptop = heapbase;
+	exact_size = 0;
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+		end.tv_nsec - start.tv_nsec;
+	STAT_ADD(morecore_prealloc, mapsize);
+	STAT_ADD(morecore_prealloc_ns, ns);
+	INFO("Preallocated %ld bytes of heap at %p in %llu us\n", mapsize,
+	     heapbase, ns / 1000);
+}
+
+/*
+ * Parse the page sizes the heap moves on to, the ",size@threshold" list
+ * that may follow the first size in HUGETLB_MORECORE, and open their
+ * files. Tiers after one that is invalid or unavailable are ignored.
+ */
+static void setup_morecore_tiers(const char *spec)
+{
+	struct morecore_tier *tier, *prev;
+	const char *at;
+	long page_size, threshold;
+
+	for (; spec; spec = strchr(spec, ',')) {
+		if (*spec == ',')
+			spec++;
+		if (nr_tiers == MORECORE_MAX_TIERS) {
+			WARNING("Too many page sizes in HUGETLB_MORECORE, "
+				"ignoring %s\n", spec);
+			return;
+		}
+
+		tier = &tiers[nr_tiers];
+		prev = &tiers[nr_tiers - 1];
+		at = strpbrk(spec, "@,");
+		page_size = parse_page_size(spec);
+		threshold = (at && *at == '@') ? parse_page_size(at + 1) : -1;
+		if (page_size <= prev->page_size ||
+		    threshold <= prev->threshold ||
+		    page_size & (page_size - 1)) {
+			WARNING("Invalid page size or heap size at %s in "
+				"HUGETLB_MORECORE\n", spec);
+			return;
+		}
+
+		if (__hugetlb_opts.map_hugetlb &&
+		    page_size == kernel_default_hugepage_size()) {
+			tier->fd = -1;
+		} else {
+			if (!hugetlbfs_find_path_for_size(page_size)) {
+				WARNING("Hugepage size %li unavailable", page_size);
+				return;
+			}
+			tier->fd = hugetlbfs_unlinked_fd_for_size(page_size);
+			if (tier->fd < 0) {
+				WARNING("Couldn't open hugetlbfs file for "
+					"morecore\n");
+				return;
+			}
+		}
+
+		tier->page_size = page_size;
+		tier->threshold = threshold;
+		nr_tiers++;
+		INFO("Heap will grow with %ld kB pages from %ld bytes\n",
+			page_size / 1024, threshold);
+	}
+}
+
 void hugetlbfs_setup_morecore(void)
 {
 	char *ep;
@@ -305,6 +886,13 @@ void hugetlbfs_setup_morecore(void)
 						__hugetlb_opts.morecore);
 		return;
 	}
+#ifndef HAS_MORECORE
+	if (!hugetlbfs_setup_heap) {
+		INFO("Not setting up morecore because it's not available "
+			"(see issue #52).\n");
+		return;
+	}
+#endif
 
 	/*
 	 * Determine the page size that will be used for the heap.
@@ -350,6 +938,11 @@ void hugetlbfs_setup_morecore(void)
 		}
 	}
 
+	tiers[0].page_size = hpage_size;
+	tiers[0].fd = heap_fd;
+	if (!__hugetlb_opts.thp_morecore)
+		setup_morecore_tiers(strchr(__hugetlb_opts.morecore, ','));
+
 	/*
 	 * THP morecore uses sbrk to allocate more heap space, counting on the
 	 * kernel to back the area with THP.  So setting heapbase is
@@ -364,28 +957,39 @@ void hugetlbfs_setup_morecore(void)
 		}
 	} else {
 		heapaddr = (unsigned long)sbrk(0);
+		/* Start where the largest pages line up with the thresholds */
 		if (!__hugetlb_opts.thp_morecore)
-			heapaddr = hugetlbfs_next_addr(heapaddr);
+			heapaddr = hugetlbfs_next_addr(heapaddr,
+					tiers[nr_tiers - 1].page_size);
 	}
 
+	/* THP morecore grows the heap with sbrk, which needs no reservation */
+	if (__hugetlb_opts.heap_reserve && !__hugetlb_opts.thp_morecore)
+		heapaddr = setup_morecore_reserve(heapaddr);
+
 	INFO("setup_morecore(): heapaddr = 0x%lx\n", heapaddr);
 
 	heaptop = heapbase = (void *)heapaddr;
-	if (__hugetlb_opts.thp_morecore)
-		__morecore = &thp_morecore;
-	else
-		__morecore = &hugetlbfs_morecore;
-
-	/* Set some allocator options more appropriate for hugepages */
 
-	if (__hugetlb_opts.shrink_ok)
-		mallopt(M_TRIM_THRESHOLD, hpage_size + hpage_size / 2);
+	if (__hugetlb_opts.heap_prealloc)
+		setup_morecore_prealloc(__hugetlb_opts.thp_morecore ?
+					&thp_morecore : &hugetlbfs_morecore);
+#ifdef HAS_MORECORE
+	/*
+	 * glibc only calls morecore for its main arena. The arenas it
+	 * gives other threads are mmap()ed by malloc itself, where no
+	 * hook or interposed mmap() can reach, so they stay on base pages
+	 * unless threads are kept out of them.
+	 */
+	setup_glibc_morecore();
+	return;
+#endif
+	/* glibc does not call morecore, so malloc() is replaced instead */
+	if (__hugetlb_opts.thp_morecore)
+		hugetlbfs_setup_heap(&thp_morecore, &hugetlbfs_morecore_release,
+				     &hugetlbfs_morecore_restore, hpage_size);
 	else
-		mallopt(M_TRIM_THRESHOLD, -1);
-	mallopt(M_TOP_PAD, hpage_size / 2);
-	/* we always want to use our morecore, not ordinary mmap().
-	 * This doesn't appear to prohibit malloc() from falling back
-	 * to mmap() if we run out of hugepages. */
-	mallopt(M_MMAP_MAX, 0);
+		hugetlbfs_setup_heap(&hugetlbfs_morecore,
+				     &hugetlbfs_morecore_release,
+				     &hugetlbfs_morecore_restore, hpage_size);
 }
-#endif /* HAS_MORECORE */
@@ -0,0 +1,300 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ * stats.c - Counters of what the library has done, for hugetlbfs_get_stats()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "hugetlbfs.h"
+#include "libhugetlbfs_internal.h"
+
+/* morecore.o is not part of the utilities library */
+extern void hugetlbfs_morecore_coverage(unsigned long long *rss,
+					unsigned long long *thp)
+	__attribute__((weak));
+
+/*
+ * Every thread counts into a block of its own, so that updates are a
+ * plain load and store to a cache line no other thread writes. Readers
+ * sum the blocks of all threads. The stores are relaxed atomics so that a
+ * reader never sees a torn counter. A block is never freed: when its
+ * thread exits it is marked unused and handed to the next new thread,
+ * which carries on adding to the same counters.
+ */
+struct stats_block {
+	struct hugetlbfs_stats stats;
+	int in_use;
+	struct stats_block *next;
+} __attribute__((aligned(64)));
+
+#define NR_COUNTERS (sizeof(struct hugetlbfs_stats) / sizeof(unsigned long long))
+
+static struct {
+	pthread_mutex_t lock;		/* Protects adding to blocks */
+	struct stats_block *blocks;
+	pthread_key_t key;
+	int key_valid;
+} stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct stats_block *stats_tls;
+static __thread int stats_exited;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Once its block is handed back the thread stops counting: whatever it
+ * does in later destructors would otherwise race with the block's next
+ * owner, whose updates are not atomic read-modify-writes.
+ */
+static void stats_thread_exit(void *arg)
+{
+	struct stats_block *block = arg;
+
+	stats_tls = NULL;
+	stats_exited = 1;
+	__atomic_store_n(&block->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_key_init(void)
+{
+	if (pthread_key_create(&stats.key, stats_thread_exit) == 0)
+		stats.key_valid = 1;
+}
+
+/*
+ * The calling thread's block, or NULL if one could not be allocated or
+ * the thread is exiting
+ */
+static struct stats_block *stats_block(void)
+{
+	struct stats_block *block = stats_tls;
+	int unused = 0;
+
+	if (block)
+		return block;
+	if (stats_exited)
+		return NULL;
+
+	pthread_once(&stats_once, stats_key_init);
+
+	for (block = __atomic_load_n(&stats.blocks, __ATOMIC_ACQUIRE); block;
+			block = block->next)
+		if (__atomic_compare_exchange_n(&block->in_use, &unused, 1,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		else
+			unused = 0;
+
+	if (!block) {
+		/*
+		 * Not from malloc(), as counting happens inside morecore,
+		 * where glibc's malloc() would move the brk() THP heap.
+		 */
+		block = mmap(NULL, sizeof(*block), PROT_READ|PROT_WRITE,
+			     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (block == MAP_FAILED)
+			return NULL;
+		block->in_use = 1;
+
+		pthread_mutex_lock(&stats.lock);
+		block->next = stats.blocks;
+		__atomic_store_n(&stats.blocks, block, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&stats.lock);
+	}
+
+	if (stats.key_valid)
+		pthread_setspecific(stats.key, block);
+	stats_tls = block;
+	return block;
+}
+
+static void counter_add(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+/* Add n to the counter at offset bytes into struct hugetlbfs_stats */
+void hugetlbfs_stat_add(size_t offset, unsigned long long n)
+{
+	struct stats_block *block = stats_block();
+
+	if (block)
+		counter_add((void *)&block->stats + offset, n);
+}
+
+static int page_shift(long page_size)
+{
+	return page_size > 0 ? __builtin_ctzl(page_size) : 0;
+}
+
+void hugetlbfs_stat_alloc(long page_size)
+{
+	struct stats_block *block = stats_block();
+
+	if (block)
+		counter_add(&block->stats.allocs[page_shift(page_size)], 1);
+}
+
+void hugetlbfs_stat_free(long page_size)
+{
+	struct stats_block *block = stats_block();
+
+	if (block)
+		counter_add(&block->stats.frees[page_shift(page_size)], 1);
+}
+
+/* Record a prefault of len bytes that took ns nanoseconds */
+void hugetlbfs_stat_prefault(size_t len, unsigned long long ns, int failed)
+{
+	struct stats_block *block = stats_block();
+	unsigned long long us = ns / 1000;
+	int bucket = 0;
+
+	if (!block)
+		return;
+
+	/* Bucket 0 is under 1us, bucket i from 2^(i-1)us to 2^i us */
+	while (us && bucket < HUGETLB_STATS_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	counter_add(&block->stats.prefaults, 1);
+	counter_add(&block->stats.prefault_bytes, len);
+	counter_add(&block->stats.prefault_latency[bucket], 1);
+	if (failed)
+		counter_add(&block->stats.prefault_failures, 1);
+}
+
+/**
+ * hugetlbfs_get_stats - Read the library's counters
+ * stats: Filled in with the sums of the counters of every thread
+ * size: sizeof(struct hugetlbfs_stats) as the caller was built with
+ *
+ * Only the first size bytes of stats are written, so that programs built
+ * against an older, shorter structure keep working. Returns 0, or -1 with
+ * errno set to EINVAL if stats is NULL.
+ */
+int hugetlbfs_get_stats(struct hugetlbfs_stats *stats_out, size_t size)
+{
+	unsigned long long sum[NR_COUNTERS];
+	struct stats_block *block;
+	unsigned long long *c;
+	int i;
+
+	if (!stats_out) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(sum, 0, sizeof(sum));
+	for (block = __atomic_load_n(&stats.blocks, __ATOMIC_ACQUIRE); block;
+			block = block->next) {
+		c = (unsigned long long *)&block->stats;
+		for (i = 0; i < NR_COUNTERS; i++)
+			sum[i] += __atomic_load_n(&c[i], __ATOMIC_RELAXED);
+	}
+
+	/* Not counters but the state of the THP heap right now */
+	if (hugetlbfs_morecore_coverage &&
+	    size > offsetof(struct hugetlbfs_stats, thp_heap_rss))
+		hugetlbfs_morecore_coverage(
+			&sum[offsetof(struct hugetlbfs_stats, thp_heap_rss) /
+			     sizeof(sum[0])],
+			&sum[offsetof(struct hugetlbfs_stats, thp_heap_huge) /
+			     sizeof(sum[0])]);
+
+	if (size > sizeof(sum))
+		size = sizeof(sum);
+	memcpy(stats_out, sum, size);
+	return 0;
+}
+
+static void stats_print(FILE *f, struct hugetlbfs_stats *s)
+{
+	int i;
+
+	fprintf(f, "libhugetlbfs [%s:%d] stats:\n", __hugetlbfs_hostname,
+		getpid());
+	for (i = 0; i < HUGETLB_STATS_SHIFTS; i++)
+		if (s->allocs[i] || s->frees[i])
+			fprintf(f, "  %llu kB pages: %llu allocs %llu frees\n",
+				(1ULL << i) / 1024, s->allocs[i], s->frees[i]);
+	fprintf(f, "  fallbacks: %llu thp %llu base\n", s->thp_fallbacks,
+		s->base_fallbacks);
+	fprintf(f, "  prefaults: %llu (%llu bytes, %llu failed)\n",
+		s->prefaults, s->prefault_bytes, s->prefault_failures);
+	for (i = 0; i < HUGETLB_STATS_LATENCY_BUCKETS - 1; i++)
+		if (s->prefault_latency[i])
+			fprintf(f, "    < %llu us: %llu\n", 1ULL << i,
+				s->prefault_latency[i]);
+	if (s->prefault_latency[i])
+		fprintf(f, "    >= %llu us: %llu\n", 1ULL << (i - 1),
+			s->prefault_latency[i]);
+	fprintf(f, "  morecore: %llu grows (%llu avoided) %llu shrinks "
+		"%llu contiguity failures\n", s->morecore_grows,
+		s->morecore_grows_avoided, s->morecore_shrinks,
+		s->morecore_contig_failures);
+	fprintf(f, "  morecore: %llu bytes released %llu restored\n",
+		s->morecore_released, s->morecore_restored);
+	fprintf(f, "  morecore: %llu fallback allocs, %llu ms unable to grow, "
+		"%llu retries\n", s->morecore_fallback_allocs,
+		s->morecore_fallback_ns / 1000000, s->morecore_retries);
+	if (s->morecore_prealloc)
+		fprintf(f, "  morecore: %llu bytes preallocated in %llu ms\n",
+			s->morecore_prealloc, s->morecore_prealloc_ns / 1000000);
+	if (s->thp_heap_rss)
+		fprintf(f, "  thp heap: %llu of %llu resident bytes on "
+			"hugepages\n", s->thp_heap_huge, s->thp_heap_rss);
+	fprintf(f, "  elflink: %llu segments %llu bytes copied\n",
+		s->elflink_segments, s->elflink_bytes_copied);
+}
+
+/* Dump the counters at exit if HUGETLB_STATS asks for it */
+static void __attribute__ ((destructor)) stats_dump(void)
+{
+	struct hugetlbfs_stats s;
+	char *dest = __hugetlb_opts.stats;
+	FILE *f;
+
+	if (!dest)
+		return;
+
+	hugetlbfs_get_stats(&s, sizeof(s));
+	if (!strcmp(dest, "stderr")) {
+		stats_print(stderr, &s);
+		return;
+	}
+
+	f = fopen(dest, "a");
+	if (!f) {
+		WARNING("Unable to open %s for HUGETLB_STATS: %s\n", dest,
+			strerror(errno));
+		return;
+	}
+	stats_print(f, &s);
+	fclose(f);
+}
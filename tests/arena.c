@@ -0,0 +1,212 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Allocate objects of every size class from several threads at once,
+ * check they are hugepage backed and do not overlap, then free them from
+ * a different thread to the one that allocated them. Destroying the
+ * arena must give every hugepage back. Arenas asking for each mounted
+ * page size with GHP_HUGE_* must be backed by pages of that size.
+ */
+#define NR_THREADS	4
+#define NR_OBJS		512
+#define MAX_OBJ		(64 * 1024)
+
+long hpage_size;
+hugetlb_arena_t *arena;
+
+struct thread_objs {
+	int id;
+	unsigned char *objs[NR_OBJS];
+	size_t sizes[NR_OBJS];
+};
+
+static struct thread_objs tobjs[NR_THREADS];
+
+void cleanup(void)
+{
+}
+
+static size_t obj_size(int id, int i)
+{
+	/* Walk the sizes so that every class is used */
+	return 1 + ((i * 97 + id * 31) * 61) % MAX_OBJ;
+}
+
+static void *alloc_thread(void *arg)
+{
+	struct thread_objs *t = arg;
+	int i;
+
+	for (i = 0; i < NR_OBJS; i++) {
+		t->sizes[i] = obj_size(t->id, i);
+		t->objs[i] = hugetlb_arena_alloc(arena, t->sizes[i]);
+		if (!t->objs[i])
+			return (void *)1;
+		memset(t->objs[i], t->id + 1, t->sizes[i]);
+	}
+	return NULL;
+}
+
+static void *free_thread(void *arg)
+{
+	struct thread_objs *t = arg;
+	int i;
+
+	for (i = 0; i < NR_OBJS; i++)
+		hugetlb_arena_free(arena, t->objs[i]);
+	return NULL;
+}
+
+static void run_threads(void *(*fn)(void *), int shift)
+{
+	pthread_t threads[NR_THREADS];
+	void *ret;
+	int i;
+
+	for (i = 0; i < NR_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, fn,
+				   &tobjs[(i + shift) % NR_THREADS]))
+			FAIL("pthread_create(): %s", strerror(errno));
+	for (i = 0; i < NR_THREADS; i++) {
+		if (pthread_join(threads[i], &ret))
+			FAIL("pthread_join(): %s", strerror(errno));
+		if (ret)
+			FAIL("Arena allocation failed in thread %d", i);
+	}
+}
+
+static void check_objects(void)
+{
+	int t, i;
+	size_t j;
+
+	for (t = 0; t < NR_THREADS; t++) {
+		for (i = 0; i < NR_OBJS; i++) {
+			unsigned char *p = tobjs[t].objs[i];
+
+			for (j = 0; j < tobjs[t].sizes[i]; j++)
+				if (p[j] != t + 1)
+					FAIL("Object %d of thread %d was "
+						"overwritten", i, t);
+			if ((i % 64) == 0 &&
+			    get_mapping_page_size(p) != hpage_size)
+				FAIL("Object %p is not hugepage backed", p);
+		}
+	}
+}
+
+#define MAX_PAGE_SIZES	10
+#define NR_SIZED_OBJS	64
+static void test_page_sizes(void)
+{
+	long sizes[MAX_PAGE_SIZES];
+	unsigned char *objs[NR_SIZED_OBJS];
+	hugetlb_arena_t *sized;
+	long free_before;
+	int nr_sizes, i, j, shift;
+
+	nr_sizes = gethugepagesizes(sizes, MAX_PAGE_SIZES);
+	for (i = 0; i < nr_sizes; i++) {
+		if (!hugetlbfs_find_path_for_size(sizes[i]) ||
+		    get_huge_page_counter(sizes[i], HUGEPAGES_FREE) < 1)
+			continue;
+
+		free_before = get_huge_page_counter(sizes[i], HUGEPAGES_FREE);
+		shift = __builtin_ctzl(sizes[i]);
+		sized = hugetlb_arena_create(GHP_DEFAULT |
+					     ((ghp_t)shift << GHP_HUGE_SHIFT));
+		if (!sized)
+			FAIL("hugetlb_arena_create() for %ld kB pages: %s",
+			     sizes[i] / 1024, strerror(errno));
+
+		/* Several classes, so that objects lie in different runs */
+		for (j = 0; j < NR_SIZED_OBJS; j++) {
+			objs[j] = hugetlb_arena_alloc(sized, obj_size(0, j));
+			if (!objs[j])
+				FAIL("hugetlb_arena_alloc() from %ld kB pages: "
+				     "%s", sizes[i] / 1024, strerror(errno));
+			memset(objs[j], j, obj_size(0, j));
+			if (get_mapping_page_size(objs[j]) != sizes[i])
+				FAIL("Object is not backed by %ld kB pages",
+				     sizes[i] / 1024);
+		}
+		for (j = 0; j < NR_SIZED_OBJS; j++)
+			hugetlb_arena_free(sized, objs[j]);
+		hugetlb_arena_destroy(sized);
+
+		if (get_huge_page_counter(sizes[i], HUGEPAGES_FREE) !=
+		    free_before)
+			FAIL("Arena of %ld kB pages leaked hugepages",
+			     sizes[i] / 1024);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long free_before, free_after;
+	void *p;
+	int i;
+
+	test_init(argc, argv);
+	hpage_size = check_hugepagesize();
+	/* Objects average 32KB, allow for the rounding up to a size class */
+	check_free_huge_pages(NR_THREADS * NR_OBJS * (MAX_OBJ / 2) /
+				hpage_size * 3 / 2);
+
+	free_before = get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+
+	arena = hugetlb_arena_create(GHP_DEFAULT);
+	if (!arena)
+		FAIL("hugetlb_arena_create(): %s", strerror(errno));
+
+	p = hugetlb_arena_alloc(arena, MAX_OBJ + 1);
+	if (p || errno != EINVAL)
+		FAIL("Oversized allocation was not rejected");
+
+	for (i = 0; i < NR_THREADS; i++)
+		tobjs[i].id = i;
+
+	run_threads(alloc_thread, 0);
+	check_objects();
+
+	/* Cross-thread free, then allocate again to reuse freed objects */
+	run_threads(free_thread, 1);
+	run_threads(alloc_thread, 0);
+	check_objects();
+	run_threads(free_thread, 2);
+
+	hugetlb_arena_destroy(arena);
+
+	free_after = get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+	if (free_after != free_before)
+		FAIL("Arena leaked %ld hugepages", free_before - free_after);
+
+	test_page_sizes();
+
+	PASS();
+}
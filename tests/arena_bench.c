@@ -0,0 +1,149 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Compare hugetlb_arena_alloc() against malloc() for a TLB bound
+ * workload: many small objects linked into a list in random order and
+ * then chased. With base pages nearly every hop misses in the TLB.
+ */
+#define NR_OBJS		(1UL << 20)
+#define OBJ_SIZE	64
+#define NR_PASSES	8
+
+struct node {
+	struct node *next;
+	unsigned long payload[OBJ_SIZE / sizeof(long) - 1];
+};
+
+static struct node **nodes;
+hugetlb_arena_t *arena;
+
+void cleanup(void)
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *bench_malloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void bench_free(void *p)
+{
+	free(p);
+}
+
+static void *bench_arena_alloc(size_t size)
+{
+	return hugetlb_arena_alloc(arena, size);
+}
+
+static void bench_arena_free(void *p)
+{
+	hugetlb_arena_free(arena, p);
+}
+
+static void run(const char *name, void *(*alloc)(size_t),
+		void (*release)(void *))
+{
+	double start, t_alloc, t_chase, t_free;
+	unsigned long i, sum = 0;
+	struct node *n;
+	int pass;
+
+	start = now();
+	for (i = 0; i < NR_OBJS; i++) {
+		nodes[i] = alloc(sizeof(struct node));
+		if (!nodes[i])
+			FAIL("%s allocation %lu failed", name, i);
+		nodes[i]->payload[0] = i;
+	}
+	t_alloc = now() - start;
+
+	/* Shuffle and link the objects so each hop lands somewhere new */
+	srandom(1);
+	for (i = NR_OBJS - 1; i > 0; i--) {
+		unsigned long j = random() % (i + 1);
+		struct node *tmp = nodes[i];
+
+		nodes[i] = nodes[j];
+		nodes[j] = tmp;
+	}
+	for (i = 0; i < NR_OBJS - 1; i++)
+		nodes[i]->next = nodes[i + 1];
+	nodes[NR_OBJS - 1]->next = NULL;
+
+	start = now();
+	for (pass = 0; pass < NR_PASSES; pass++)
+		for (n = nodes[0]; n; n = n->next)
+			sum += n->payload[0];
+	t_chase = now() - start;
+
+	start = now();
+	for (i = 0; i < NR_OBJS; i++)
+		release(nodes[i]);
+	t_free = now() - start;
+
+	if (sum != NR_PASSES * (NR_OBJS * (NR_OBJS - 1) / 2))
+		FAIL("%s list was corrupted", name);
+
+	printf("%-8s alloc %6.1f ns/obj  chase %6.1f ns/hop  "
+		"free %6.1f ns/obj\n", name,
+		t_alloc * 1e9 / NR_OBJS,
+		t_chase * 1e9 / (NR_OBJS * NR_PASSES),
+		t_free * 1e9 / NR_OBJS);
+}
+
+int main(int argc, char *argv[])
+{
+	long hpage_size;
+
+	test_init(argc, argv);
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(NR_OBJS * OBJ_SIZE / hpage_size + 2);
+
+	nodes = malloc(NR_OBJS * sizeof(*nodes));
+	if (!nodes)
+		FAIL("malloc(): %s", strerror(errno));
+
+	arena = hugetlb_arena_create(GHP_DEFAULT);
+	if (!arena)
+		FAIL("hugetlb_arena_create(): %s", strerror(errno));
+
+	run("arena", bench_arena_alloc, bench_arena_free);
+	run("malloc", bench_malloc, bench_free);
+
+	hugetlb_arena_destroy(arena);
+	free(nodes);
+	PASS();
+}
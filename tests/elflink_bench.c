@@ -0,0 +1,134 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "hugetests.h"
+
+/*
+ * Time the startup of a program with large read-only and writable
+ * segments, remapped onto hugepages or not. Segment remapping happens
+ * before main(), so each run is a fresh copy of this program started
+ * with HUGETLB_ELFMAP and HUGETLB_ELFMAP_THREADS set, and is timed from
+ * fork() to exit. With HUGETLB_ELFMAP_THREADS=1 the segments are
+ * prepared one after the other by a single copy; otherwise they are
+ * prepared together and the large one is copied by several threads.
+ */
+#define RO_SIZE		(16 << 20)
+#define RW_SIZE		(48 << 20)
+#define NR_PASSES	4
+
+/* Initialised, so that they are copied rather than left to be zeroed */
+const char big_const[RO_SIZE] = { 1, [RO_SIZE - 1] = 2 };
+char big_data[RW_SIZE] = { 3, [RW_SIZE - 1] = 4 };
+
+static struct {
+	const char *name;
+	const char *elfmap;
+	const char *threads;
+} modes[] = {
+	{ "base pages",		"no",	NULL },
+	{ "one at a time",	"RW",	"1" },
+	{ "4 workers",		"RW",	"4" },
+	{ "one per CPU",	"RW",	NULL },
+};
+#define NR_MODES	(sizeof(modes) / sizeof(modes[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Started as a child: check the segments and exit */
+static void check_segments(const char *elfmap)
+{
+	int huge = strcmp(elfmap, "no") != 0;
+
+	if (big_const[0] != 1 || big_const[RO_SIZE - 1] != 2 ||
+	    big_data[0] != 3 || big_data[RW_SIZE - 1] != 4)
+		FAIL("Segment contents corrupted");
+	if (huge && (!test_addr_huge((void *)big_const) ||
+		     !test_addr_huge(big_data)))
+		FAIL("Segments were not remapped");
+	exit(RC_PASS);
+}
+
+static double run_once(int mode, char *argv[])
+{
+	double start;
+	int status;
+	pid_t pid;
+
+	start = now();
+	pid = fork();
+	if (pid < 0)
+		FAIL("fork(): %s", strerror(errno));
+	if (pid == 0) {
+		setenv("ELFLINK_BENCH_CHILD", "1", 1);
+		setenv("HUGETLB_ELFMAP", modes[mode].elfmap, 1);
+		if (modes[mode].threads)
+			setenv("HUGETLB_ELFMAP_THREADS", modes[mode].threads,
+			       1);
+		else
+			unsetenv("HUGETLB_ELFMAP_THREADS");
+		setenv("QUIET_TEST", "1", 1);
+		execv("/proc/self/exe", argv);
+		FAIL("execv(): %s", strerror(errno));
+	}
+	if (waitpid(pid, &status, 0) != pid)
+		FAIL("waitpid(): %s", strerror(errno));
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != RC_PASS)
+		FAIL("Startup with %s failed", modes[mode].name);
+	return now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	double total;
+	char *elfmap;
+	int i, pass;
+
+	test_init(argc, argv);
+
+	elfmap = getenv("HUGETLB_ELFMAP");
+	if (getenv("ELFLINK_BENCH_CHILD"))
+		check_segments(elfmap ? elfmap : "no");
+
+	check_hugepagesize();
+	check_free_huge_pages((RO_SIZE + RW_SIZE) / gethugepagesize() + 2);
+
+	for (i = 0; i < NR_MODES; i++) {
+		total = 0;
+		for (pass = 0; pass < NR_PASSES; pass++)
+			total += run_once(i, argv);
+		printf("%-14s %5d MB of segments: %8.1f ms to start\n",
+		       modes[i].name, (RO_SIZE + RW_SIZE) >> 20,
+		       total * 1e3 / NR_PASSES);
+		fflush(stdout);
+	}
+
+	PASS();
+}
@@ -0,0 +1,124 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <sys/utsname.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_ELFMAP_LIBS, the middle of each segment of a matching
+ * shared library is moved onto hugepages, whether the library is loaded
+ * at startup (run with LD_PRELOAD=libelfmaplib.so) or by dlopen(). Check
+ * the segments of libelfmaplib.so that HUGETLB_ELFMAP selects, all of
+ * them by default, are huge and still hold their data, and that the
+ * library is remapped again when it is loaded a second time. Loaded by
+ * dlopen(), only its read-only segment is remapped, and only on kernels
+ * that can mremap() hugepages. That is done by libhugetlbfs_dlopen.so
+ * when it is preloaded, and otherwise by calling hugetlb_remap_libs().
+ */
+#define BLOCK_SIZE	(8 << 20)
+#define LIBNAME		"libelfmaplib.so"
+
+static int want_ro, want_rw;
+static int wrapped;
+
+static void check_lib(void *handle, const char *when, int runtime)
+{
+	const char *ro = dlsym(handle, "elfmaplib_const");
+	char *rw = dlsym(handle, "elfmaplib_data");
+
+	if (!ro || !rw)
+		FAIL("dlsym(): %s", dlerror());
+	verbose_printf("%s: %s at %p, data at %p\n", when, LIBNAME, ro, rw);
+
+	if (ro[0] != 1 || ro[BLOCK_SIZE - 1] != 2 ||
+	    rw[0] != 3 || rw[BLOCK_SIZE - 1] != 4)
+		FAIL("%s: library data corrupted", when);
+	if (want_ro && !test_addr_huge((void *)&ro[BLOCK_SIZE / 2]))
+		FAIL("%s: read-only segment was not remapped", when);
+	if (runtime && test_addr_huge(&rw[BLOCK_SIZE / 2]))
+		FAIL("%s: writable segment was remapped", when);
+	if (!runtime && want_rw && !test_addr_huge(&rw[BLOCK_SIZE / 2]))
+		FAIL("%s: writable segment was not remapped", when);
+
+	rw[BLOCK_SIZE / 2] = 5;
+	if (rw[BLOCK_SIZE / 2] != 5)
+		FAIL("%s: writable segment is not writable", when);
+	rw[BLOCK_SIZE / 2] = 0;
+}
+
+static void *load_lib(void)
+{
+	void *handle = dlopen(LIBNAME, RTLD_NOW);
+
+	if (!handle)
+		FAIL("dlopen(%s): %s", LIBNAME, dlerror());
+	if (!wrapped)
+		hugetlb_remap_libs();
+	return handle;
+}
+
+int main(int argc, char *argv[])
+{
+	struct utsname buf;
+	char *elfmap, *preload;
+	void *handle;
+	int preloaded;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_ELFMAP_LIBS"))
+		CONFIG("Needs HUGETLB_ELFMAP_LIBS");
+
+	elfmap = getenv("HUGETLB_ELFMAP");
+	want_ro = !elfmap || strcasestr(elfmap, "R");
+	want_rw = !elfmap || strcasestr(elfmap, "W");
+	preload = getenv("LD_PRELOAD");
+	wrapped = preload && strstr(preload, "libhugetlbfs_dlopen.so");
+
+	handle = dlopen(LIBNAME, RTLD_NOW | RTLD_NOLOAD);
+	preloaded = handle != NULL;
+	if (preloaded) {
+		check_lib(handle, "startup", 0);
+		PASS();
+	}
+
+	if (uname(&buf) != 0)
+		FAIL("uname failed %s", strerror(errno));
+	if (test_compare_kver(buf.release, "5.16.0") < 0)
+		want_ro = 0;
+
+	handle = load_lib();
+	check_lib(handle, "dlopen", 1);
+
+	/* Unloaded and loaded again, it is remapped again */
+	if (dlclose(handle) != 0)
+		FAIL("dlclose(): %s", dlerror());
+	if (!wrapped)
+		hugetlb_remap_libs();
+	handle = load_lib();
+	check_lib(handle, "reopen", 1);
+
+	PASS();
+}
@@ -0,0 +1,122 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_ELFMAP=thp, the read-only segments of the program, and of
+ * the libraries matching HUGETLB_ELFMAP_LIBS, are copied to transparent
+ * hugepages instead of hugetlbfs files. This program is not relinked.
+ * The middle of the segment holding big_const, and of the one holding
+ * the constant of libelfmaplib.so once it is loaded, must be anonymous,
+ * read-only and backed by hugepages, and keep their contents.
+ */
+#define BLOCK_SIZE	(8 << 20)
+#define THP_PMD_SIZE	"/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+#define LIBNAME		"libelfmaplib.so"
+
+const char big_const[BLOCK_SIZE] = { 1, [BLOCK_SIZE - 1] = 2 };
+
+static long thp_size;
+
+/* Check the mapping holding addr in /proc/self/smaps */
+static void check_mapping(const char *what, const void *addr)
+{
+	unsigned long start, end, kb, huge = 0;
+	char line[512], perms[8], path[256];
+	int found = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		FAIL("fopen(/proc/self/smaps): %s", strerror(errno));
+	while (fgets(line, sizeof(line), f)) {
+		path[0] = '\0';
+		if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %255s", &start, &end,
+			   perms, path) >= 3) {
+			found = (unsigned long)addr >= start &&
+				(unsigned long)addr < end;
+			if (!found)
+				continue;
+			verbose_printf("%s: %lx-%lx %s %s\n", what, start, end,
+				       perms, path);
+			if (strcmp(perms, "r--p") || path[0])
+				FAIL("%s is not in read-only anonymous memory",
+				     what);
+		} else if (found &&
+			   sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+			huge = kb * 1024;
+			break;
+		}
+	}
+	fclose(f);
+
+	verbose_printf("%s: %lu bytes on hugepages\n", what, huge);
+	if (huge < thp_size)
+		FAIL("%s is not on transparent hugepages", what);
+}
+
+int main(int argc, char *argv[])
+{
+	struct hugetlbfs_stats s;
+	const char *lib_const;
+	char *elfmap;
+	void *handle;
+	FILE *f;
+
+	test_init(argc, argv);
+
+	elfmap = getenv("HUGETLB_ELFMAP");
+	if (!elfmap || strcasecmp(elfmap, "thp"))
+		CONFIG("Needs HUGETLB_ELFMAP=thp");
+	f = fopen(THP_PMD_SIZE, "r");
+	if (!f || fscanf(f, "%ld", &thp_size) != 1)
+		CONFIG("No transparent hugepage size");
+	fclose(f);
+
+	if (big_const[0] != 1 || big_const[BLOCK_SIZE - 1] != 2)
+		FAIL("big_const corrupted");
+	check_mapping("big_const", &big_const[BLOCK_SIZE / 2]);
+
+	if (getenv("HUGETLB_ELFMAP_LIBS")) {
+		handle = dlopen(LIBNAME, RTLD_NOW);
+		if (!handle)
+			FAIL("dlopen(%s): %s", LIBNAME, dlerror());
+		lib_const = dlsym(handle, "elfmaplib_const");
+		if (!lib_const)
+			FAIL("dlsym(): %s", dlerror());
+		if (lib_const[0] != 1 || lib_const[BLOCK_SIZE - 1] != 2)
+			FAIL("elfmaplib_const corrupted");
+		check_mapping("elfmaplib_const", &lib_const[BLOCK_SIZE / 2]);
+	}
+
+	if (hugetlbfs_get_stats(&s, sizeof(s)) != 0)
+		FAIL("hugetlbfs_get_stats(): %s", strerror(errno));
+	if (!s.elflink_segments)
+		FAIL("No segments counted as remapped");
+
+	PASS();
+}
@@ -0,0 +1,23 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Large enough that each segment has whole hugepages in the middle */
+#define BLOCK_SIZE	(8 << 20)
+
+const char elfmaplib_const[BLOCK_SIZE] = { 1, [BLOCK_SIZE - 1] = 2 };
+char elfmaplib_data[BLOCK_SIZE] = { 3, [BLOCK_SIZE - 1] = 4 };
@@ -64,6 +64,71 @@ void test_get_huge_pages(int num_hugepages)
 		FAIL("hugepage was not correctly freed");
 }
 
+/*
+ * Hold several regions at once and release them in an order different to
+ * the one they were allocated in, each must be found and freed on its own
+ */
+#define NR_REGIONS 4
+void test_many_regions(void)
+{
+	void *p[NR_REGIONS];
+	int order[NR_REGIONS] = { 1, 3, 0, 2 };
+	int i;
+
+	for (i = 0; i < NR_REGIONS; i++) {
+		p[i] = get_huge_pages(hpage_size, GHP_DEFAULT);
+		if (p[i] == NULL)
+			FAIL("get_huge_pages() for region %d", i);
+		memset(p[i], i, hpage_size);
+	}
+
+	for (i = 0; i < NR_REGIONS; i++) {
+		free_and_confirm_region_free(p[order[i]], __LINE__);
+		if (i + 1 < NR_REGIONS &&
+		    get_mapping_page_size(p[order[i + 1]]) != hpage_size)
+			FAIL("Region %d was freed along with region %d",
+				order[i + 1], order[i]);
+	}
+}
+
+/*
+ * Request each mounted hugepage size explicitly with GHP_HUGE_* and check
+ * the region is backed by pages of that size
+ */
+#define MAX_PAGE_SIZES 10
+void test_page_sizes(void)
+{
+	long sizes[MAX_PAGE_SIZES];
+	int nr_sizes, i, shift;
+	void *p;
+
+	nr_sizes = gethugepagesizes(sizes, MAX_PAGE_SIZES);
+	for (i = 0; i < nr_sizes; i++) {
+		if (!hugetlbfs_find_path_for_size(sizes[i]) ||
+		    get_huge_page_counter(sizes[i], HUGEPAGES_FREE) < 1)
+			continue;
+
+		shift = __builtin_ctzl(sizes[i]);
+		p = get_huge_pages(sizes[i],
+				   GHP_DEFAULT | ((ghp_t)shift << GHP_HUGE_SHIFT));
+		if (p == NULL)
+			FAIL("get_huge_pages() for a %ld kB page",
+			     sizes[i] / 1024);
+		memset(p, 1, getpagesize());
+		if (get_mapping_page_size(p) != sizes[i])
+			FAIL("Region is not backed by %ld kB pages",
+			     sizes[i] / 1024);
+		free_and_confirm_region_free(p, __LINE__);
+
+		/* The length must be a multiple of an explicit size */
+		p = get_huge_pages(sizes[i] / 2,
+				   GHP_DEFAULT | ((ghp_t)shift << GHP_HUGE_SHIFT));
+		if (p != NULL || errno != EINVAL)
+			FAIL("get_huge_pages() accepted half a %ld kB page",
+			     sizes[i] / 1024);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	test_init(argc, argv);
@@ -71,6 +136,8 @@ int main(int argc, char *argv[])
 	check_free_huge_pages(4);
 	test_get_huge_pages(1);
 	test_get_huge_pages(4);
+	test_many_regions();
+	test_page_sizes();
 
 	PASS();
 }
@@ -0,0 +1,184 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Check the NUMA placement of regions from get_huge_pages_onnode() and
+ * get_huge_pages() with GHP_LOCAL and GHP_INTERLEAVE as reported by
+ * /proc/self/numa_maps, and that a strict request for more hugepages
+ * than a node has fails instead of using another node.
+ */
+#define MAX_NODES	64
+
+long hpage_size;
+
+void cleanup(void)
+{
+}
+
+static long node_free_hugepages(int node)
+{
+	char path[128];
+	long val = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/"
+		 "hugepages/hugepages-%ldkB/free_hugepages", node,
+		 hpage_size / 1024);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld", &val) != 1)
+		val = -1;
+	fclose(f);
+	return val;
+}
+
+/*
+ * Find the numa_maps line for p and return the policy and the number of
+ * pages of the mapping on each node.
+ */
+static void read_numa_maps(void *p, char *policy, long *pages)
+{
+	char line[1024], *tok, *save;
+	unsigned long start;
+	FILE *f;
+	int node;
+
+	memset(pages, 0, MAX_NODES * sizeof(long));
+	f = fopen("/proc/self/numa_maps", "r");
+	if (!f)
+		FAIL("fopen(/proc/self/numa_maps): %s", strerror(errno));
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx", &start) != 1 ||
+		    start != (unsigned long)p)
+			continue;
+
+		strtok_r(line, " \n", &save);
+		tok = strtok_r(NULL, " \n", &save);
+		strcpy(policy, tok);
+		while ((tok = strtok_r(NULL, " \n", &save)))
+			if (sscanf(tok, "N%d=", &node) == 1 &&
+			    node < MAX_NODES)
+				pages[node] = atol(strchr(tok, '=') + 1);
+		fclose(f);
+		return;
+	}
+
+	FAIL("No numa_maps entry for %p", p);
+}
+
+/* Fault every hugepage of a region and check it landed on node */
+static void check_on_node(void *p, int nr_hpages, int node, const char *what)
+{
+	char policy[256];
+	long pages[MAX_NODES];
+	int i;
+
+	for (i = 0; i < nr_hpages; i++)
+		*((char *)p + i * hpage_size) = 1;
+
+	read_numa_maps(p, policy, pages);
+	if (pages[node] != nr_hpages)
+		FAIL("%s: %ld of %d hugepages on node %d (policy %s)", what,
+		     pages[node], nr_hpages, node, policy);
+}
+
+int main(int argc, char *argv[])
+{
+	long pages[MAX_NODES], nr_free;
+	char policy[256], expect[32];
+	unsigned int cpu, local;
+	int node, tested = 0;
+	void *p;
+
+	test_init(argc, argv);
+	hpage_size = check_hugepagesize();
+
+	if (access("/proc/self/numa_maps", R_OK) != 0)
+		CONFIG("Kernel does not report /proc/self/numa_maps");
+
+	for (node = 0; node < MAX_NODES; node++) {
+		nr_free = node_free_hugepages(node);
+		if (nr_free < 1)
+			continue;
+
+		p = get_huge_pages_onnode(hpage_size, node,
+					  GHP_DEFAULT|GHP_NODE_STRICT);
+		if (!p)
+			FAIL("get_huge_pages_onnode(node %d): %s", node,
+			     strerror(errno));
+		check_on_node(p, 1, node, "GHP_NODE_STRICT");
+		read_numa_maps(p, policy, pages);
+		snprintf(expect, sizeof(expect), "bind:%d", node);
+		if (strcmp(policy, expect) != 0)
+			FAIL("Policy is %s, expected %s", policy, expect);
+		free_huge_pages(p);
+
+		p = get_huge_pages_onnode(hpage_size, node, GHP_DEFAULT);
+		if (!p)
+			FAIL("get_huge_pages_onnode(node %d): %s", node,
+			     strerror(errno));
+		check_on_node(p, 1, node, "preferred");
+		free_huge_pages(p);
+
+		/* More than the node has must fail when strict */
+		p = get_huge_pages_onnode((nr_free + 1) * hpage_size, node,
+					  GHP_DEFAULT|GHP_NODE_STRICT);
+		if (p)
+			FAIL("Strict allocation beyond node %d pool succeeded",
+			     node);
+
+		tested++;
+	}
+	if (!tested)
+		CONFIG("No node has free hugepages");
+
+	if (syscall(__NR_getcpu, &cpu, &local, NULL) != 0)
+		FAIL("getcpu(): %s", strerror(errno));
+	if (node_free_hugepages(local) >= 1) {
+		p = get_huge_pages(hpage_size, GHP_DEFAULT|GHP_LOCAL);
+		if (!p)
+			FAIL("get_huge_pages(GHP_LOCAL): %s", strerror(errno));
+		check_on_node(p, 1, local, "GHP_LOCAL");
+		free_huge_pages(p);
+	}
+
+	p = get_huge_pages(hpage_size, GHP_DEFAULT|GHP_INTERLEAVE);
+	if (!p)
+		FAIL("get_huge_pages(GHP_INTERLEAVE): %s", strerror(errno));
+	*(char *)p = 1;
+	read_numa_maps(p, policy, pages);
+	if (strncmp(policy, "interleave", strlen("interleave")) != 0)
+		FAIL("Policy is %s, expected interleave", policy);
+	free_huge_pages(p);
+
+	if (get_huge_pages_onnode(hpage_size, -1, GHP_DEFAULT) ||
+	    errno != EINVAL)
+		FAIL("get_huge_pages_onnode() accepted node -1");
+
+	PASS();
+}
@@ -100,7 +100,10 @@ void test_GHR_FALLBACK(void)
 	if (p != NULL)
 		FAIL("test_GHR_FALLBACK() for %ld expected fail, got success", num_hugepages);
 
-	/* GHR_FALLBACK should succeed by allocating base pages */
+	/*
+	 * GHR_FALLBACK should succeed by allocating transparent hugepages
+	 * or base pages
+	 */
 	p = get_hugepage_region(TESTLEN, GHR_FALLBACK);
 	if (p == NULL)
 		FAIL("test_GHR_FALLBACK(GHR_FALLBACK) failed for %ld hugepages",
@@ -109,6 +112,9 @@ void test_GHR_FALLBACK(void)
 	err = test_unaligned_addr_huge(p + (num_hugepages - 1) * hpage_size);
 	if (err == 1)
 		FAIL("Returned page is not a base page");
+	err = hugetlb_region_tier(p);
+	if (err != HUGETLB_TIER_THP && err != HUGETLB_TIER_BASE)
+		FAIL("Fallback region reports tier %d", err);
 
 	/*
 	 * We allocate a second fallback region to see can they be told apart
@@ -124,6 +130,109 @@ void test_GHR_FALLBACK(void)
 	free_and_confirm_region_free(p, __LINE__);
 }
 
+/* Is THP enabled for madvise() regions, which GHR_THP relies on */
+static int thp_enabled(void)
+{
+	char buf[128] = "";
+	FILE *f;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (!f)
+		return 0;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+	return buf[0] && !strstr(buf, "[never]");
+}
+
+/* The transparent hugepage size, or 0 if the kernel does not report it */
+static long thp_size(void)
+{
+	long size = 0;
+	FILE *f;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld", &size) != 1)
+		size = 0;
+	fclose(f);
+	return size;
+}
+
+/*
+ * A GHR_THP region comes from the hugetlb pool while it lasts, then from
+ * transparent hugepages aligned so that all of the region can use them.
+ * Without GHR_FALLBACK nothing else is used.
+ */
+void test_GHR_THP(void)
+{
+	long num_hugepages = get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+	size_t len = (num_hugepages + 1) * hpage_size;
+	long align = thp_size();
+	void *p;
+
+	p = get_hugepage_region(hpage_size, GHR_THP);
+	if (p == NULL)
+		FAIL("get_hugepage_region(GHR_THP) failed for one hugepage");
+	if (hugetlb_region_tier(p) != HUGETLB_TIER_HUGETLB)
+		FAIL("Region within the pool reports tier %d",
+		     hugetlb_region_tier(p));
+	free_and_confirm_region_free(p, __LINE__);
+
+	p = get_hugepage_region(len, GHR_THP);
+	if (!thp_enabled()) {
+		if (p != NULL)
+			FAIL("GHR_THP beyond the pool succeeded without THP");
+		return;
+	}
+	if (p == NULL)
+		FAIL("get_hugepage_region(GHR_THP) failed beyond the pool");
+	if (hugetlb_region_tier(p) != HUGETLB_TIER_THP)
+		FAIL("Region beyond the pool reports tier %d",
+		     hugetlb_region_tier(p));
+	if (align > 0 && (unsigned long)p % align)
+		FAIL("THP region at %p is not aligned to %ld", p, align);
+	memset(p, 1, len);
+	free_and_confirm_region_free(p, __LINE__);
+
+	if (hugetlb_region_tier(&len) != -1 || errno != EINVAL)
+		FAIL("hugetlb_region_tier() accepted an unknown pointer");
+}
+
+/*
+ * A GHR_MIXED region is hugepages for as much of the length as they fit
+ * and base pages for the rest with GHR_FALLBACK, or hugepages throughout
+ * without it. The default size caps the page size so the layout is known.
+ */
+void test_GHR_MIXED(void)
+{
+	size_t len = 2 * hpage_size + 3 * getpagesize() + 100;
+	ghr_t cap = (ghr_t)__builtin_ctzl(hpage_size) << GHP_HUGE_SHIFT;
+	unsigned char vec = 0;
+	char *p;
+
+	p = get_hugepage_region(len, GHR_MIXED|GHR_FALLBACK|cap);
+	if (p == NULL)
+		FAIL("get_hugepage_region(GHR_MIXED|GHR_FALLBACK)");
+	memset(p, 1, len);
+	if (get_mapping_page_size(p + hpage_size) != hpage_size)
+		FAIL("Start of mixed region is not hugepage");
+	if (get_mapping_page_size(p + 2 * hpage_size) == hpage_size)
+		FAIL("Tail of mixed region is not base pages");
+	free_and_confirm_region_free(p, __LINE__);
+	if (mincore(p + 2 * hpage_size, 4, &vec) == 0 || vec)
+		FAIL("Tail of mixed region was not freed");
+
+	p = get_hugepage_region(len, GHR_MIXED|GHR_STRICT|cap);
+	if (p == NULL)
+		FAIL("get_hugepage_region(GHR_MIXED|GHR_STRICT)");
+	memset(p, 1, len);
+	if (get_mapping_page_size(p + 2 * hpage_size) != hpage_size)
+		FAIL("Tail of strict mixed region is not hugepage");
+	free_and_confirm_region_free(p, __LINE__);
+}
+
 int main(int argc, char *argv[])
 {
 	test_init(argc, argv);
@@ -131,7 +240,9 @@ int main(int argc, char *argv[])
 	check_free_huge_pages(4);
 	test_GHR_STRICT(1);
 	test_GHR_STRICT(4);
+	test_GHR_MIXED();
 	test_GHR_FALLBACK();
+	test_GHR_THP();
 
 	PASS();
 }
@@ -0,0 +1,106 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Once the pool runs dry the heap serves malloc() from base pages, but
+ * after the pool is refilled and the backoff has passed, new allocations
+ * must be on hugepages again. The time spent unable to grow and the
+ * allocations sent to glibc meanwhile are counted.
+ */
+#define NR_HPAGES	4
+
+long hpage_size;
+int fd = -1;
+
+void cleanup(void)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	struct hugetlbfs_stats s;
+	long nr_free;
+	size_t len;
+	void *blocker;
+	char *p, *q;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE") || !getenv("HUGETLB_MORECORE_BACKOFF"))
+		CONFIG("Needs HUGETLB_MORECORE and HUGETLB_MORECORE_BACKOFF");
+
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(NR_HPAGES);
+	len = NR_HPAGES * hpage_size;
+
+	/* Take every available hugepage */
+	nr_free = get_huge_page_counter(hpage_size, HUGEPAGES_FREE) -
+		get_huge_page_counter(hpage_size, HUGEPAGES_RSVD);
+	fd = hugetlbfs_unlinked_fd();
+	if (fd < 0)
+		FAIL("hugetlbfs_unlinked_fd()");
+	blocker = mmap(NULL, nr_free * hpage_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+	if (blocker == MAP_FAILED)
+		FAIL("mmap(): %s", strerror(errno));
+
+	p = malloc(len);
+	if (!p)
+		FAIL("malloc(%zd) with the pool empty", len);
+	memset(p, 0, len);
+	if (get_mapping_page_size(p) == hpage_size)
+		FAIL("Heap grew with the pool empty");
+
+	/* The file holds the reservation until it is closed */
+	munmap(blocker, nr_free * hpage_size);
+	close(fd);
+	fd = -1;
+	usleep(atoi(getenv("HUGETLB_MORECORE_BACKOFF")) * 1000 * 2);
+
+	q = malloc(len);
+	if (!q)
+		FAIL("malloc(%zd) with the pool refilled", len);
+	memset(q, 0, len);
+	if (get_mapping_page_size(q) != hpage_size)
+		FAIL("Heap did not go back to hugepages");
+
+	if (hugetlbfs_get_stats(&s, sizeof(s)) != 0)
+		FAIL("hugetlbfs_get_stats(): %s", strerror(errno));
+	verbose_printf("%llu fallback allocs, %llu ns, %llu retries\n",
+		       s.morecore_fallback_allocs, s.morecore_fallback_ns,
+		       s.morecore_retries);
+	if (!s.morecore_fallback_allocs || !s.morecore_fallback_ns ||
+	    !s.morecore_retries)
+		FAIL("Fallback not counted");
+
+	free(q);
+	free(p);
+	PASS();
+}
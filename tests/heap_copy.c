@@ -0,0 +1,73 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hugetests.h"
+
+/*
+ * realloc() moves large blocks on the hugepage heap with the library's
+ * bulk copy, which uses non-temporal stores for copies of a few
+ * megabytes and more on CPUs that have them. Shrinking a large block
+ * always moves it. Check that every byte arrives, including the ones
+ * past the last whole cache line, with whichever HUGETLB_COPY_METHOD is
+ * set.
+ */
+#define BIG_SIZE	(12 << 20)
+
+static size_t sizes[] = {
+	(4 << 20), (4 << 20) + 1, (5 << 20) + 63, (8 << 20) + 4095,
+};
+#define NUM_SIZES	(sizeof(sizes) / sizeof(sizes[0]))
+
+static unsigned char pattern(size_t i)
+{
+	return i * 7 + (i >> 12);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *p;
+	size_t i, j;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE"))
+		CONFIG("Needs HUGETLB_MORECORE");
+
+	for (i = 0; i < NUM_SIZES; i++) {
+		p = malloc(BIG_SIZE);
+		if (!p)
+			FAIL("malloc(%d)", BIG_SIZE);
+		for (j = 0; j < BIG_SIZE; j++)
+			p[j] = pattern(j);
+
+		p = realloc(p, sizes[i]);
+		if (!p)
+			FAIL("realloc(%zd)", sizes[i]);
+		for (j = 0; j < sizes[i]; j++)
+			if (p[j] != pattern(j))
+				FAIL("Byte %zd of %zd is 0x%x instead of 0x%x",
+				     j, sizes[i], p[j], pattern(j));
+		free(p);
+	}
+
+	PASS();
+}
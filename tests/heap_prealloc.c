@@ -0,0 +1,110 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_MORECORE_PREALLOC, the heap is mapped and faulted before
+ * main() runs. Allocations that fit in it must not grow the heap, and
+ * freeing and trimming them must not give any of it back. A THP heap
+ * must also be locked with ",lock"; the kernel never counts hugetlbfs
+ * pages as locked. As in the malloc test, a mapping above 64 kB is taken
+ * to be huge, which only applies to a hugetlbfs heap.
+ */
+#define MIN_PAGE_SIZE 65536
+#define NR_CHUNKS 16
+
+/* VmLck of this process in bytes */
+static unsigned long long locked_bytes(void)
+{
+	unsigned long long kb;
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		FAIL("fopen(/proc/self/status): %s", strerror(errno));
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmLck: %llu kB", &kb) == 1) {
+			fclose(f);
+			return kb * 1024;
+		}
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct hugetlbfs_stats before, after;
+	char *env, *p[NR_CHUNKS];
+	size_t chunk;
+	int thp, i;
+
+	test_init(argc, argv);
+
+	env = getenv("HUGETLB_MORECORE_PREALLOC");
+	if (!getenv("HUGETLB_MORECORE") || !env)
+		CONFIG("Needs HUGETLB_MORECORE and HUGETLB_MORECORE_PREALLOC");
+	thp = !strcasecmp(getenv("HUGETLB_MORECORE"), "thp");
+
+	if (hugetlbfs_get_stats(&before, sizeof(before)) != 0)
+		FAIL("hugetlbfs_get_stats(): %s", strerror(errno));
+	verbose_printf("%llu bytes preallocated in %llu ns\n",
+		       before.morecore_prealloc, before.morecore_prealloc_ns);
+	if (!before.morecore_prealloc)
+		FAIL("Heap was not preallocated");
+	if (thp && strstr(env, ",lock") &&
+	    locked_bytes() < before.morecore_prealloc)
+		FAIL("Only %llu of %llu preallocated bytes locked",
+		     locked_bytes(), before.morecore_prealloc);
+
+	/* Leave room for the heap's own bookkeeping */
+	chunk = before.morecore_prealloc / NR_CHUNKS / 2;
+	for (i = 0; i < NR_CHUNKS; i++) {
+		p[i] = malloc(chunk);
+		if (!p[i])
+			FAIL("malloc(%zd)", chunk);
+		memset(p[i], i, chunk);
+		if (!thp && get_mapping_page_size(p[i]) <= MIN_PAGE_SIZE)
+			FAIL("Chunk %d at %p is not on hugepages", i, p[i]);
+	}
+	for (i = 0; i < NR_CHUNKS; i++)
+		free(p[i]);
+	malloc_trim(0);
+
+	if (hugetlbfs_get_stats(&after, sizeof(after)) != 0)
+		FAIL("hugetlbfs_get_stats(): %s", strerror(errno));
+	verbose_printf("%llu grows, %llu shrinks, %llu bytes released\n",
+		       after.morecore_grows - before.morecore_grows,
+		       after.morecore_shrinks - before.morecore_shrinks,
+		       after.morecore_released - before.morecore_released);
+	if (after.morecore_grows != before.morecore_grows)
+		FAIL("Heap grew beyond its preallocation");
+	if (after.morecore_shrinks != before.morecore_shrinks ||
+	    after.morecore_released != before.morecore_released)
+		FAIL("Preallocated heap was given back");
+
+	PASS();
+}
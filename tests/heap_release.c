@@ -0,0 +1,116 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * A block freed below the top of the hugepage heap cannot be unmapped,
+ * but its hugepages must go back to the pool: on free() with
+ * HUGETLB_MORECORE_SHRINK, or else on malloc_trim(). They must come back,
+ * zeroed or not but on hugepages, when the space is allocated again, and
+ * the block above must not be disturbed.
+ */
+#define NR_HPAGES	8
+
+long hpage_size;
+
+/* Hugepages that another process could have */
+static long available_hpages(void)
+{
+	return get_huge_page_counter(hpage_size, HUGEPAGES_FREE) -
+		get_huge_page_counter(hpage_size, HUGEPAGES_RSVD);
+}
+
+static void check_bytes(char *p, size_t len, char c, const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < len; i += 4096)
+		if (p[i] != c)
+			FAIL("%s: byte %zd is 0x%x instead of 0x%x", what, i,
+			     p[i], c);
+}
+
+int main(int argc, char *argv[])
+{
+	long free_before, free_after;
+	size_t len;
+	char *p, *q;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE"))
+		CONFIG("Needs HUGETLB_MORECORE");
+
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(NR_HPAGES * 3);
+	len = NR_HPAGES * hpage_size;
+
+	p = malloc(len);
+	q = malloc(len);
+	if (!p || !q)
+		FAIL("malloc(%zd)", len);
+	memset(p, 0x5a, len);
+	memset(q, 0xa5, len);
+	if (get_mapping_page_size(p) != hpage_size ||
+	    get_mapping_page_size(q) != hpage_size)
+		FAIL("Heap not on hugepages");
+
+	free_before = available_hpages();
+	free(p < q ? p : q);
+	if (!getenv("HUGETLB_MORECORE_SHRINK") && !malloc_trim(0))
+		FAIL("malloc_trim() released nothing");
+	free_after = available_hpages();
+	verbose_printf("Available hugepages: %ld before free(), %ld after\n",
+		       free_before, free_after);
+	if (free_after < free_before + NR_HPAGES - 1)
+		FAIL("Only %ld of %d hugepages went back to the pool",
+		     free_after - free_before, NR_HPAGES);
+
+	if (p < q)
+		p = malloc(len);
+	else
+		q = malloc(len);
+	if (!p || !q)
+		FAIL("malloc(%zd) after release", len);
+	if (get_mapping_page_size(p) != hpage_size ||
+	    get_mapping_page_size(q) != hpage_size)
+		FAIL("Released space not on hugepages");
+	free_after = available_hpages();
+	if (free_after > free_before)
+		FAIL("%ld hugepages were not faulted back on reuse",
+		     free_after - free_before);
+
+	if (p < q) {
+		memset(p, 0x5a, len);
+		check_bytes(q, len, 0xa5, "upper block");
+	} else {
+		memset(q, 0xa5, len);
+		check_bytes(p, len, 0x5a, "upper block");
+	}
+
+	free(p);
+	free(q);
+	PASS();
+}
@@ -0,0 +1,102 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_MORECORE_RESERVE, the address space the heap grows into
+ * is set aside when the heap is set up. A mapping asked for right above
+ * the heap must then be put elsewhere, and the heap must still grow on
+ * hugepages afterwards. Without the reservation the mapping would land
+ * there and the heap could not grow contiguously.
+ *
+ * As in the malloc test, a mapping above 64 kB is taken to be huge.
+ */
+#define MIN_PAGE_SIZE 65536
+#define SMALL_SIZE (1024*1024)
+#define LARGE_SIZE (64*1024*1024)
+
+/* The end of the mapping containing addr */
+static unsigned long mapping_end(unsigned long addr)
+{
+	unsigned long start, end;
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		FAIL("fopen(/proc/self/maps): %s", strerror(errno));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+			continue;
+		if (addr >= start && addr < end) {
+			fclose(f);
+			return end;
+		}
+	}
+	FAIL("No mapping contains 0x%lx", addr);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long end;
+	char *p, *q;
+	void *blocker;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE") || !getenv("HUGETLB_MORECORE_RESERVE"))
+		CONFIG("Needs HUGETLB_MORECORE and HUGETLB_MORECORE_RESERVE");
+
+	p = malloc(SMALL_SIZE);
+	if (!p)
+		FAIL("malloc(%d)", SMALL_SIZE);
+	memset(p, 0, SMALL_SIZE);
+	if (get_mapping_page_size(p) <= MIN_PAGE_SIZE)
+		FAIL("Heap not on hugepages");
+
+	end = mapping_end((unsigned long)p);
+	verbose_printf("Heap mapping ends at 0x%lx\n", end);
+
+	blocker = mmap((void *)end, getpagesize(), PROT_READ,
+		       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (blocker == MAP_FAILED)
+		FAIL("mmap(): %s", strerror(errno));
+	verbose_printf("Mapping asked for at 0x%lx went to %p\n", end,
+		       blocker);
+	if (blocker == (void *)end)
+		FAIL("Mapped inside the heap's reserved space");
+
+	q = malloc(LARGE_SIZE);
+	if (!q)
+		FAIL("malloc(%d)", LARGE_SIZE);
+	memset(q, 0, LARGE_SIZE);
+	if (get_mapping_page_size(q + LARGE_SIZE - 1) <= MIN_PAGE_SIZE)
+		FAIL("Heap did not grow on hugepages");
+
+	free(q);
+	free(p);
+	munmap(blocker, getpagesize());
+	PASS();
+}
@@ -0,0 +1,217 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <link.h>
+#include <dirent.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Shared read-only segments are kept in files named after the program's
+ * build ID, segment and page size. Plant a file of the wrong size under
+ * the name the segment holding big_const will use, then start copies of
+ * this program with HUGETLB_SHARE=1. The first must find the file stale
+ * and replace it, the second must reuse what the first prepared, and
+ * both must run from a file of that name.
+ */
+#define BLOCK_SIZE	16384
+#define CONST		0xdeadbeef
+
+const int big_const[BLOCK_SIZE] = { [0] = CONST, [BLOCK_SIZE-1] = CONST };
+
+static char build_id[129];
+static int const_phdr = -1;
+static char share_dir[PATH_MAX/2];
+static char share_file[PATH_MAX+1];
+
+/* Only the parent, which sets share_dir, cleans up every segment's file */
+void cleanup(void)
+{
+	char path[PATH_MAX+1];
+	struct dirent *ent;
+	DIR *dir;
+
+	if (!share_dir[0])
+		return;
+	dir = opendir(share_dir);
+	if (dir) {
+		while ((ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", share_dir,
+				 ent->d_name);
+			unlink(path);
+		}
+		closedir(dir);
+	}
+	rmdir(share_dir);
+}
+
+/* Note the build ID and the phdr of big_const, as elflink.c does */
+static int parse_phdrs(struct dl_phdr_info *info, size_t size, void *data)
+{
+	unsigned long addr = (unsigned long)big_const;
+	const ElfW(Phdr) *phdr;
+	const ElfW(Nhdr) *note;
+	const char *p, *end, *desc;
+	int i, j;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type == PT_LOAD &&
+		    addr >= info->dlpi_addr + phdr->p_vaddr &&
+		    addr < info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz)
+			const_phdr = i;
+		if (phdr->p_type != PT_NOTE)
+			continue;
+
+		p = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+		end = p + phdr->p_memsz;
+		while (p + sizeof(*note) <= end) {
+			note = (const ElfW(Nhdr) *)p;
+			desc = p + sizeof(*note) + ALIGN(note->n_namesz, 4);
+			p = desc + ALIGN(note->n_descsz, 4);
+			if (note->n_type == NT_GNU_BUILD_ID &&
+			    note->n_namesz == 4 && !memcmp(note + 1, "GNU", 4) &&
+			    note->n_descsz <= 64)
+				for (j = 0; j < note->n_descsz; j++)
+					sprintf(build_id + 2 * j, "%02x",
+						(unsigned char)desc[j]);
+		}
+	}
+	return 1;
+}
+
+/* Started as a child: big_const must come from the shared file */
+static void check_child(void)
+{
+	char line[PATH_MAX + 128], *path;
+	unsigned long start, end, addr = (unsigned long)big_const;
+	FILE *f;
+
+	if (big_const[0] != CONST || big_const[BLOCK_SIZE-1] != CONST)
+		FAIL("big_const corrupted");
+	if (!test_addr_huge((void *)big_const))
+		FAIL("big_const is not on hugepages");
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		FAIL("fopen(/proc/self/maps): %s", strerror(errno));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2 ||
+		    addr < start || addr >= end)
+			continue;
+		path = strchr(line, '/');
+		if (!path || strncmp(path, share_file, strlen(share_file)))
+			FAIL("big_const mapped from %s instead of %s",
+			     path ? path : "nowhere", share_file);
+		fclose(f);
+		exit(RC_PASS);
+	}
+	FAIL("big_const not found in /proc/self/maps");
+}
+
+static ino_t run_child(char *argv[])
+{
+	struct stat sb;
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		FAIL("fork(): %s", strerror(errno));
+	if (pid == 0) {
+		setenv("LINKSHARE_BUILDID_CHILD", "1", 1);
+		setenv("HUGETLB_ELFMAP", "R", 1);
+		setenv("HUGETLB_SHARE", "1", 1);
+		setenv("HUGETLB_SHARE_PATH", share_dir, 1);
+		setenv("QUIET_TEST", "1", 1);
+		execv("/proc/self/exe", argv);
+		FAIL("execv(): %s", strerror(errno));
+	}
+	if (waitpid(pid, &status, 0) != pid)
+		FAIL("waitpid(): %s", strerror(errno));
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != RC_PASS)
+		FAIL("Child failed");
+
+	if (stat(share_file, &sb) != 0)
+		FAIL("stat(%s): %s", share_file, strerror(errno));
+	if (sb.st_size == gethugepagesize() * 64)
+		FAIL("Stale %s was used", share_file);
+	return sb.st_ino;
+}
+
+int main(int argc, char *argv[])
+{
+	ino_t first, second;
+	const char *mount;
+	int fd;
+
+	test_init(argc, argv);
+
+	dl_iterate_phdr(parse_phdrs, NULL);
+	if (!build_id[0])
+		CONFIG("Program has no build ID");
+	if (const_phdr < 0)
+		FAIL("No segment holds big_const");
+
+	if (getenv("LINKSHARE_BUILDID_CHILD")) {
+		snprintf(share_file, sizeof(share_file), "%s/%s_%d_%ldkB",
+			 getenv("HUGETLB_SHARE_PATH"), build_id, const_phdr,
+			 gethugepagesize() / 1024);
+		check_child();
+	}
+
+	mount = hugetlbfs_find_path();
+	if (!mount)
+		CONFIG("No hugetlbfs mount");
+	snprintf(share_dir, sizeof(share_dir), "%s/linkshare_buildid-%d",
+		 mount, getpid());
+	snprintf(share_file, sizeof(share_file), "%s/%s_%d_%ldkB", share_dir,
+		 build_id, const_phdr, gethugepagesize() / 1024);
+
+	if (mkdir(share_dir, 0700) != 0)
+		FAIL("mkdir(%s): %s", share_dir, strerror(errno));
+	fd = open(share_file, O_CREAT|O_RDWR, 0600);
+	if (fd < 0)
+		FAIL("open(%s): %s", share_file, strerror(errno));
+	if (ftruncate(fd, gethugepagesize() * 64) != 0)
+		FAIL("ftruncate(): %s", strerror(errno));
+	close(fd);
+
+	first = run_child(argv);
+	second = run_child(argv);
+	verbose_printf("%s: inode %lu, then %lu\n", share_file,
+		       (unsigned long)first, (unsigned long)second);
+	if (first != second)
+		FAIL("Prepared file was not reused");
+
+	PASS();
+}
@@ -0,0 +1,216 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "hugetests.h"
+
+/*
+ * Exercise the whole malloc() family, not just malloc() and free(), on
+ * the hugepage heap: calloc() must clear memory that may be reused,
+ * realloc() must keep the contents when it moves a block, the aligned
+ * allocators must honour their alignment, malloc_usable_size() must
+ * cover the request and objects must be freeable from another thread.
+ * As in the malloc test, a mapping above 64 kB is taken to be huge.
+ * glibc's own malloc() only puts threads' objects on hugepages when
+ * HUGETLB_MORECORE_ARENAS keeps them out of its thread arenas.
+ */
+#define MIN_PAGE_SIZE 65536
+#define NR_OBJS 1000
+
+static size_t sizes[] = {
+	1, 16, 24, 100, 1000, 4096, 10000, 40000, 1024*1024, 5*1024*1024,
+};
+#define NUM_SIZES	(sizeof(sizes) / sizeof(sizes[0]))
+
+static size_t aligns[] = {
+	16, 64, 4096, 65536, 2*1024*1024,
+};
+#define NUM_ALIGNS	(sizeof(aligns) / sizeof(aligns[0]))
+
+static int expect_hugepage, expect_thread_hugepage;
+/* volatile so the compiler does not warn about the overflow on purpose */
+static volatile size_t huge_nmemb = (size_t)-1 / 2;
+
+static void check_huge(void *p, const char *what)
+{
+	unsigned long long mapping_size = get_mapping_page_size(p);
+
+	if (expect_hugepage && mapping_size <= MIN_PAGE_SIZE)
+		FAIL("%s: %p is not on a hugepage", what, p);
+}
+
+static void check_bytes(unsigned char *p, size_t len, unsigned char c,
+			const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] != c)
+			FAIL("%s: byte %zd is 0x%x instead of 0x%x", what, i,
+			     p[i], c);
+}
+
+static void test_calloc(size_t size)
+{
+	unsigned char *p;
+
+	/* Dirty a block of the same size so calloc() is likely to reuse it */
+	p = malloc(size);
+	if (!p)
+		FAIL("malloc(%zd)", size);
+	memset(p, 0xaa, size);
+	free(p);
+
+	p = calloc(1, size);
+	if (!p)
+		FAIL("calloc(1, %zd)", size);
+	check_bytes(p, size, 0, "calloc");
+	check_huge(p, "calloc");
+	free(p);
+}
+
+static void test_realloc(size_t size)
+{
+	unsigned char *p, *q;
+
+	p = malloc(size);
+	if (!p)
+		FAIL("malloc(%zd)", size);
+	memset(p, 0x5a, size);
+
+	q = realloc(p, size * 3);
+	if (!q)
+		FAIL("realloc(%p, %zd)", p, size * 3);
+	check_bytes(q, size, 0x5a, "realloc grow");
+	memset(q, 0xa5, size * 3);
+
+	p = realloc(q, size / 2 + 1);
+	if (!p)
+		FAIL("realloc(%p, %zd)", q, size / 2 + 1);
+	check_bytes(p, size / 2 + 1, 0xa5, "realloc shrink");
+	free(p);
+}
+
+static void test_usable_size(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p)
+		FAIL("malloc(%zd)", size);
+	if (malloc_usable_size(p) < size)
+		FAIL("malloc_usable_size(%p) = %zd for a %zd byte block", p,
+		     malloc_usable_size(p), size);
+	memset(p, 0, malloc_usable_size(p));
+	free(p);
+}
+
+static void test_align(size_t align, size_t size)
+{
+	void *p;
+
+	p = memalign(align, size);
+	if (!p || (uintptr_t)p % align)
+		FAIL("memalign(%zd, %zd) = %p", align, size, p);
+	memset(p, 0, size);
+	check_huge(p, "memalign");
+	free(p);
+
+	if (posix_memalign(&p, align, size) || (uintptr_t)p % align)
+		FAIL("posix_memalign(%zd, %zd) = %p", align, size, p);
+	memset(p, 0, size);
+	free(p);
+
+	p = aligned_alloc(align, ALIGN(size, align));
+	if (!p || (uintptr_t)p % align)
+		FAIL("aligned_alloc(%zd, %zd) = %p", align, size, p);
+	free(p);
+}
+
+static void *thread_alloc(void *arg)
+{
+	void **objs = arg;
+	int i;
+
+	for (i = 0; i < NR_OBJS; i++) {
+		objs[i] = malloc(sizes[i % NUM_SIZES] % 50000 + 1);
+		if (!objs[i])
+			return NULL;
+		*(int *)objs[i] = i;
+	}
+	return objs;
+}
+
+static void test_threads(void)
+{
+	void *objs[NR_OBJS];
+	pthread_t thread;
+	void *ret;
+	int i;
+
+	if (pthread_create(&thread, NULL, thread_alloc, objs))
+		FAIL("pthread_create()");
+	if (pthread_join(thread, &ret))
+		FAIL("pthread_join()");
+	if (!ret)
+		FAIL("malloc() failed in a thread");
+
+	/* The allocating thread has exited; free its objects from here */
+	for (i = 0; i < NR_OBJS; i++) {
+		if (*(int *)objs[i] != i)
+			FAIL("object %d was overwritten", i);
+		if (expect_thread_hugepage && i % 100 == 0)
+			check_huge(objs[i], "thread malloc");
+		free(objs[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j;
+
+	test_init(argc, argv);
+
+	expect_hugepage = getenv("HUGETLB_MORECORE") != NULL;
+	expect_thread_hugepage = expect_hugepage &&
+		getenv("HUGETLB_MORECORE_ARENAS") != NULL;
+	verbose_printf("expect_hugepage=%d\n", expect_hugepage);
+
+	for (i = 0; i < NUM_SIZES; i++) {
+		test_calloc(sizes[i]);
+		test_realloc(sizes[i]);
+		test_usable_size(sizes[i]);
+	}
+
+	for (i = 0; i < NUM_ALIGNS; i++)
+		for (j = 0; j < NUM_SIZES; j++)
+			test_align(aligns[i], sizes[j]);
+
+	if (calloc(huge_nmemb, 4))
+		FAIL("calloc() of an overflowing size succeeded");
+
+	test_threads();
+
+	PASS();
+}
@@ -0,0 +1,79 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_MORECORE_GROWTH=geometric, a heap grown a hugepage at a
+ * time must be mapped in far fewer steps than it has hugepages, and the
+ * growth must show up as morecore() calls served without mapping more.
+ * As in the malloc test, a mapping above 64 kB is taken to be huge.
+ */
+#define MIN_PAGE_SIZE 65536
+#define NR_CHUNKS 32
+
+int main(int argc, char *argv[])
+{
+	struct hugetlbfs_stats before, after;
+	unsigned long long grows;
+	long hpage_size;
+	char *p[NR_CHUNKS];
+	int i;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE") || !getenv("HUGETLB_MORECORE_GROWTH"))
+		CONFIG("Needs HUGETLB_MORECORE and HUGETLB_MORECORE_GROWTH");
+
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(NR_CHUNKS * 2);
+
+	if (hugetlbfs_get_stats(&before, sizeof(before)) != 0)
+		FAIL("hugetlbfs_get_stats(): %s", strerror(errno));
+
+	for (i = 0; i < NR_CHUNKS; i++) {
+		p[i] = malloc(hpage_size / 2);
+		if (!p[i])
+			FAIL("malloc(%ld)", hpage_size / 2);
+		memset(p[i], i, hpage_size / 2);
+		if (get_mapping_page_size(p[i]) <= MIN_PAGE_SIZE)
+			FAIL("Chunk %d at %p is not on hugepages", i, p[i]);
+	}
+
+	if (hugetlbfs_get_stats(&after, sizeof(after)) != 0)
+		FAIL("hugetlbfs_get_stats(): %s", strerror(errno));
+
+	grows = after.morecore_grows - before.morecore_grows;
+	verbose_printf("%llu grows, %llu avoided\n", grows,
+		       after.morecore_grows_avoided -
+		       before.morecore_grows_avoided);
+	if (after.morecore_grows_avoided == before.morecore_grows_avoided)
+		FAIL("No morecore() call was served by growing ahead");
+	if (grows >= NR_CHUNKS / 4)
+		FAIL("Heap grew %llu times for %d chunks", grows, NR_CHUNKS);
+
+	for (i = 0; i < NR_CHUNKS; i++)
+		free(p[i]);
+	PASS();
+}
@@ -0,0 +1,129 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Check through /proc/self/numa_maps that the hugepage heap carries the
+ * memory policy HUGETLB_MORECORE_NUMA asks for, and that a heap bound to
+ * a node has all its pages there.
+ */
+#define NR_HPAGES	4
+
+long hpage_size;
+
+/* The start of the mapping containing addr */
+static unsigned long mapping_start(unsigned long addr)
+{
+	unsigned long start, end;
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		FAIL("fopen(/proc/self/maps): %s", strerror(errno));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+			continue;
+		if (addr >= start && addr < end) {
+			fclose(f);
+			return start;
+		}
+	}
+	FAIL("No mapping contains 0x%lx", addr);
+}
+
+/* Check the policy and placement of the mapping at start */
+static void check_numa_maps(unsigned long start, const char *policy,
+			    int node)
+{
+	char line[1024], *tok, *save;
+	unsigned long addr;
+	int n;
+	FILE *f;
+
+	f = fopen("/proc/self/numa_maps", "r");
+	if (!f)
+		CONFIG("No /proc/self/numa_maps: %s", strerror(errno));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx", &addr) == 1 && addr == start)
+			break;
+	}
+	fclose(f);
+	if (addr != start)
+		FAIL("Heap at 0x%lx not in numa_maps", start);
+	verbose_printf("%s", line);
+
+	strtok_r(line, " \n", &save);
+	tok = strtok_r(NULL, " \n", &save);
+	if (!tok || strncmp(tok, policy, strlen(policy)))
+		FAIL("Heap policy is %s instead of %s", tok, policy);
+
+	if (node < 0)
+		return;
+	while ((tok = strtok_r(NULL, " \n", &save)))
+		if (sscanf(tok, "N%d=", &n) == 1 && n != node)
+			FAIL("Heap has pages on node %d instead of %d", n,
+			     node);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *numa = getenv("HUGETLB_MORECORE_NUMA");
+	const char *policy;
+	int node = -1;
+	size_t len;
+	char *p;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE") || !numa)
+		CONFIG("Needs HUGETLB_MORECORE and HUGETLB_MORECORE_NUMA");
+
+	if (!strcmp(numa, "interleave")) {
+		policy = "interleave";
+	} else if (!strcmp(numa, "local")) {
+		policy = "prefer";
+	} else if (sscanf(numa, "node:%d", &node) == 1) {
+		policy = "bind";
+	} else {
+		CONFIG("Unknown HUGETLB_MORECORE_NUMA %s", numa);
+	}
+
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(NR_HPAGES * 2);
+	len = NR_HPAGES * hpage_size;
+
+	p = malloc(len);
+	if (!p)
+		FAIL("malloc(%zd)", len);
+	memset(p, 0, len);
+	if (get_mapping_page_size(p) != hpage_size)
+		FAIL("Heap not on hugepages");
+
+	check_numa_maps(mapping_start((unsigned long)p), policy, node);
+
+	free(p);
+	PASS();
+}
@@ -0,0 +1,131 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * A region allocated with GHP_ASYNC_PREFAULT is populated in the
+ * background. Check that hugetlb_prefault_wait() only returns once every
+ * hugepage is instantiated, that freeing a region still being populated
+ * returns all of its hugepages, and, when HUGETLB_PREFAULT_RATE is set,
+ * that population takes as long as the rate implies. With
+ * HUGETLB_NO_RESERVE=yes a region larger than the pool is mapped without
+ * a reservation, and its failure must be reported by the wait.
+ */
+#define NR_HPAGES	32
+
+long hpage_size;
+
+void cleanup(void)
+{
+}
+
+static long nr_free(void)
+{
+	return get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	long free_before, rate = 0;
+	double start, elapsed;
+	char *env, *p;
+	int i;
+
+	test_init(argc, argv);
+
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(NR_HPAGES);
+	free_before = nr_free();
+
+	env = getenv("HUGETLB_PREFAULT_RATE");
+	if (env)
+		rate = atol(env);
+
+	start = now();
+	p = get_huge_pages(NR_HPAGES * hpage_size,
+			   GHP_DEFAULT|GHP_ASYNC_PREFAULT);
+	if (!p)
+		FAIL("get_huge_pages(): %s", strerror(errno));
+	if (hugetlb_prefault_wait(p) != 0)
+		FAIL("hugetlb_prefault_wait(): %s", strerror(errno));
+	elapsed = now() - start;
+
+	if (free_before - nr_free() != NR_HPAGES)
+		FAIL("%ld of %d hugepages instantiated after wait",
+		     free_before - nr_free(), NR_HPAGES);
+	for (i = 0; i < NR_HPAGES; i++)
+		if (p[i * hpage_size] != 0)
+			FAIL("Hugepage %d is not zeroed", i);
+	if (rate && elapsed < 0.9 * NR_HPAGES * hpage_size / rate)
+		FAIL("Populated in %.3fs, rate limit implies %.3fs", elapsed,
+		     (double)NR_HPAGES * hpage_size / rate);
+	free_huge_pages(p);
+
+	/* Free a region without waiting, the prefault must be abandoned */
+	p = get_huge_pages(NR_HPAGES * hpage_size,
+			   GHP_DEFAULT|GHP_ASYNC_PREFAULT);
+	if (!p)
+		FAIL("get_huge_pages(): %s", strerror(errno));
+	free_huge_pages(p);
+	if (nr_free() != free_before)
+		FAIL("Freeing during prefault leaked %ld hugepages",
+		     free_before - nr_free());
+
+	/* Regions prefaulted synchronously have nothing to wait for */
+	p = get_huge_pages(hpage_size, GHP_DEFAULT);
+	if (!p)
+		FAIL("get_huge_pages(): %s", strerror(errno));
+	if (hugetlb_prefault_wait(p) != 0)
+		FAIL("hugetlb_prefault_wait() failed for a synchronous region");
+	free_huge_pages(p);
+
+	env = getenv("HUGETLB_NO_RESERVE");
+	if (env && !strcasecmp(env, "yes") &&
+	    get_huge_page_counter(hpage_size, HUGEPAGES_OC) == 0) {
+		p = get_huge_pages((free_before + 1) * hpage_size,
+				   GHP_DEFAULT|GHP_ASYNC_PREFAULT);
+		if (p) {
+			if (hugetlb_prefault_wait(p) == 0)
+				FAIL("Prefault beyond the pool succeeded");
+			if (errno != ENOMEM)
+				FAIL("hugetlb_prefault_wait(): %s",
+				     strerror(errno));
+			free_huge_pages(p);
+		}
+		if (nr_free() != free_before)
+			FAIL("Failed prefault leaked %ld hugepages",
+			     free_before - nr_free());
+	}
+
+	PASS();
+}
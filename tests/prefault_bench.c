@@ -0,0 +1,165 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Compare the ways of instantiating the hugepages of a region: first
+ * touch by the application, the library prefault with readv(2) of
+ * /dev/zero and with MADV_POPULATE_WRITE, and fallocate(2) of a hugetlbfs
+ * file that is then mapped shared. The prefault method is read when the
+ * library initialises, so each one runs in a fresh copy of this program
+ * started with HUGETLB_PREFAULT_METHOD set. run_tests.py runs the
+ * benchmark once for each page size.
+ */
+#define MAX_HPAGES	64
+#define NR_PASSES	4
+
+long hpage_size;
+long nr_hpages;
+
+void cleanup(void)
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void touch(char *p)
+{
+	long i;
+
+	for (i = 0; i < nr_hpages; i++)
+		p[i * hpage_size] = 1;
+}
+
+/* Instantiate and release the region once. Returns the time taken */
+static double run_once(const char *method)
+{
+	size_t len = nr_hpages * hpage_size;
+	double start, elapsed;
+	char *p;
+	int fd;
+
+	start = now();
+	if (!strcmp(method, "fallocate")) {
+		fd = hugetlbfs_unlinked_fd();
+		if (fd < 0)
+			FAIL("hugetlbfs_unlinked_fd()");
+		if (fallocate(fd, 0, 0, len) != 0)
+			FAIL("fallocate(): %s", strerror(errno));
+		p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			FAIL("mmap(): %s", strerror(errno));
+		elapsed = now() - start;
+		munmap(p, len);
+		close(fd);
+		return elapsed;
+	}
+
+	if (!strcmp(method, "touch")) {
+		p = get_huge_pages(len, GHP_DEFAULT);
+		if (!p)
+			FAIL("get_huge_pages(): %s", strerror(errno));
+		touch(p);
+	} else {
+		p = get_huge_pages(len, GHP_DEFAULT|GHP_ASYNC_PREFAULT);
+		if (!p)
+			FAIL("get_huge_pages(): %s", strerror(errno));
+		if (hugetlb_prefault_wait(p) != 0)
+			FAIL("hugetlb_prefault_wait(): %s", strerror(errno));
+	}
+	elapsed = now() - start;
+
+	free_huge_pages(p);
+	return elapsed;
+}
+
+static void bench(const char *method)
+{
+	double total = 0;
+	int pass;
+
+	for (pass = 0; pass < NR_PASSES; pass++)
+		total += run_once(method);
+
+	printf("%-9s %7ld kB pages: %9.1f us/page %7.2f GB/s\n", method,
+		hpage_size / 1024, total * 1e6 / (NR_PASSES * nr_hpages),
+		NR_PASSES * nr_hpages * hpage_size / total / 1e9);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *methods[] = { "madvise", "readv" };
+	char *method;
+	int status;
+	pid_t pid;
+	int i;
+
+	test_init(argc, argv);
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(1);
+
+	nr_hpages = get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+	if (nr_hpages > MAX_HPAGES)
+		nr_hpages = MAX_HPAGES;
+
+	method = getenv("PREFAULT_BENCH_METHOD");
+	if (method) {
+		bench(method);
+		exit(RC_PASS);
+	}
+
+	bench("touch");
+	bench("fallocate");
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		pid = fork();
+		if (pid < 0)
+			FAIL("fork(): %s", strerror(errno));
+		if (pid == 0) {
+			setenv("PREFAULT_BENCH_METHOD", methods[i], 1);
+			setenv("HUGETLB_PREFAULT_METHOD", methods[i], 1);
+			setenv("QUIET_TEST", "1", 1);
+			execv("/proc/self/exe", argv);
+			FAIL("execv(): %s", strerror(errno));
+		}
+		if (waitpid(pid, &status, 0) != pid)
+			FAIL("waitpid(): %s", strerror(errno));
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != RC_PASS)
+			FAIL("%s benchmark failed", methods[i]);
+	}
+
+	PASS();
+}
@@ -0,0 +1,101 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_PREFAULT_THREADS set, get_huge_pages() prefaults a large
+ * region with several threads. Check that every hugepage of the region
+ * is instantiated before it is returned, that a region which cannot be
+ * fully backed still fails without leaking hugepages, and that
+ * hugetlb_set_prefault_threads() reports and validates the setting.
+ * Without the variable the threads are set with the call instead, which
+ * must prefault just the same on kernels with MAP_PRIVATE reservations.
+ */
+#define PREFAULT_THREADS	4
+#define NR_HPAGES		64
+
+long hpage_size;
+
+void cleanup(void)
+{
+}
+
+static long nr_free(void)
+{
+	return get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+}
+
+int main(int argc, char *argv[])
+{
+	long free_before;
+	char *env, *p;
+	int i;
+
+	test_init(argc, argv);
+
+	hpage_size = check_hugepagesize();
+	env = getenv("HUGETLB_PREFAULT_THREADS");
+	if (!env)
+		hugetlb_set_prefault_threads(PREFAULT_THREADS);
+	else if (atoi(env) != PREFAULT_THREADS)
+		CONFIG("HUGETLB_PREFAULT_THREADS must be %d", PREFAULT_THREADS);
+	if (getenv("HUGETLB_NO_PREFAULT"))
+		CONFIG("HUGETLB_NO_PREFAULT disables prefaulting");
+
+	check_free_huge_pages(NR_HPAGES);
+	free_before = nr_free();
+
+	p = get_huge_pages(NR_HPAGES * hpage_size, GHP_DEFAULT);
+	if (!p)
+		FAIL("get_huge_pages(): %s", strerror(errno));
+	if (free_before - nr_free() != NR_HPAGES)
+		FAIL("%ld of %d hugepages instantiated by prefault",
+		     free_before - nr_free(), NR_HPAGES);
+	for (i = 0; i < NR_HPAGES; i++)
+		if (p[i * hpage_size] != 0)
+			FAIL("Hugepage %d is not zeroed", i);
+	free_huge_pages(p);
+
+	if (nr_free() != free_before)
+		FAIL("Freeing the region leaked %ld hugepages",
+		     free_before - nr_free());
+
+	/* A region larger than the pool must fail as a whole */
+	p = get_huge_pages((free_before + 1) * hpage_size, GHP_DEFAULT);
+	if (p)
+		FAIL("Region larger than the pool was allocated");
+	if (nr_free() != free_before)
+		FAIL("Failed allocation leaked %ld hugepages",
+		     free_before - nr_free());
+
+	if (hugetlb_set_prefault_threads(1) != PREFAULT_THREADS)
+		FAIL("hugetlb_set_prefault_threads() did not return %d",
+		     PREFAULT_THREADS);
+	if (hugetlb_set_prefault_threads(-1) != -1 || errno != EINVAL)
+		FAIL("hugetlb_set_prefault_threads(-1) was accepted");
+	if (hugetlb_set_prefault_threads(PREFAULT_THREADS) != 1)
+		FAIL("hugetlb_set_prefault_threads() did not return 1");
+
+	PASS();
+}
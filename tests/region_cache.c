@@ -0,0 +1,138 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_REGION_CACHE set, a region freed with free_huge_pages()
+ * stays mapped and is handed back to the next request of the same size.
+ * Check that the mapping is reused, that regions cached by a thread
+ * which has exited are still found, that the cache never grows beyond
+ * its limit, that a full cache makes room for the region freed last and
+ * that hugetlb_region_cache_flush() returns the hugepages to the pool.
+ */
+#define CACHE_HPAGES	4
+
+long hpage_size;
+long free_before;
+
+void cleanup(void)
+{
+}
+
+static long nr_free(void)
+{
+	return get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+}
+
+static void *alloc_and_free(void *arg)
+{
+	void *p = get_huge_pages(hpage_size, GHP_DEFAULT);
+
+	if (!p)
+		return NULL;
+	*(int *)p = 1;
+	free_huge_pages(p);
+	return p;
+}
+
+int main(int argc, char *argv[])
+{
+	void *p, *q, *regions[CACHE_HPAGES + 2];
+	pthread_t thread;
+	char *env;
+	int i;
+
+	test_init(argc, argv);
+
+	hpage_size = check_hugepagesize();
+	env = getenv("HUGETLB_REGION_CACHE");
+	if (!env || atol(env) != CACHE_HPAGES * hpage_size)
+		CONFIG("HUGETLB_REGION_CACHE must be %d hugepages", CACHE_HPAGES);
+
+	check_free_huge_pages(CACHE_HPAGES + 2);
+	free_before = nr_free();
+
+	p = get_huge_pages(hpage_size, GHP_DEFAULT);
+	if (!p)
+		FAIL("get_huge_pages(): %s", strerror(errno));
+	memset(p, 0xa5, hpage_size);
+	free_huge_pages(p);
+
+	if (nr_free() == free_before)
+		FAIL("Freed region was not cached");
+
+	q = get_huge_pages(hpage_size, GHP_DEFAULT);
+	if (q != p)
+		FAIL("Cached region %p was not reused, got %p", p, q);
+	if (*(unsigned char *)q != 0xa5)
+		FAIL("Reused region has unexpected contents");
+	free_huge_pages(q);
+
+	/* A region a thread cached before exiting must not be lost */
+	hugetlb_region_cache_flush();
+	if (pthread_create(&thread, NULL, alloc_and_free, NULL) != 0)
+		FAIL("pthread_create(): %s", strerror(errno));
+	if (pthread_join(thread, &p) != 0)
+		FAIL("pthread_join(): %s", strerror(errno));
+	if (!p)
+		FAIL("get_huge_pages() failed in thread");
+	q = get_huge_pages(hpage_size, GHP_DEFAULT);
+	if (q != p)
+		FAIL("Region cached by exited thread was not reused");
+	free_huge_pages(q);
+
+	/* Free more than the cache holds, the excess must be unmapped */
+	for (i = 0; i < CACHE_HPAGES + 2; i++) {
+		regions[i] = get_huge_pages(hpage_size, GHP_DEFAULT);
+		if (!regions[i])
+			FAIL("get_huge_pages() %d: %s", i, strerror(errno));
+		*(int *)regions[i] = i;
+	}
+	for (i = 0; i < CACHE_HPAGES + 2; i++)
+		free_huge_pages(regions[i]);
+	if (free_before - nr_free() > CACHE_HPAGES)
+		FAIL("Cache holds %ld hugepages, limit is %d",
+		     free_before - nr_free(), CACHE_HPAGES);
+
+	/* Entries of this thread's own cache must make room as well */
+	hugetlb_region_cache_flush();
+	for (i = 0; i < CACHE_HPAGES + 1; i++) {
+		regions[i] = get_huge_pages(hpage_size, GHP_DEFAULT);
+		if (!regions[i])
+			FAIL("get_huge_pages() %d: %s", i, strerror(errno));
+	}
+	for (i = 0; i < CACHE_HPAGES + 1; i++)
+		free_huge_pages(regions[i]);
+	q = get_huge_pages(hpage_size, GHP_DEFAULT);
+	if (q != regions[CACHE_HPAGES])
+		FAIL("Region freed last was not cached");
+	free_huge_pages(q);
+
+	hugetlb_region_cache_flush();
+	if (nr_free() != free_before)
+		FAIL("Flush left %ld hugepages in use", free_before - nr_free());
+
+	PASS();
+}
@@ -651,11 +651,29 @@ def functional_tests():
                           LD_PRELOAD="libhugetlbfs.so",
                           HUGETLB_MORECORE="yes",
                           HUGETLB_RESTRICT_EXE="unknown:malloc")
+    # Move the heap on to a larger page size once it is 16MB
+    larger = sorted(p for p in pagesizes if p > system_default_hpage_size)
+    if larger:
+        do_test_with_pagesize(system_default_hpage_size, "malloc",
+                              skip=morecore_disabled,
+                              LD_PRELOAD="libhugetlbfs.so",
+                              HUGETLB_MORECORE="%d,%d@16M" %
+                              (system_default_hpage_size, larger[0]))
     do_test_with_pagesize(system_default_hpage_size, "malloc_manysmall")
     do_test_with_pagesize(system_default_hpage_size, "malloc_manysmall",
                           skip=morecore_disabled,
                           LD_PRELOAD="libhugetlbfs.so",
                           HUGETLB_MORECORE="yes")
+    do_test_with_pagesize(system_default_hpage_size, "malloc_api")
+    do_test_with_pagesize(system_default_hpage_size, "malloc_api",
+                          skip=morecore_disabled,
+                          LD_PRELOAD="libhugetlbfs.so",
+                          HUGETLB_MORECORE="yes")
+    do_test_with_pagesize(system_default_hpage_size, "malloc_api",
+                          skip=morecore_disabled,
+                          LD_PRELOAD="libhugetlbfs.so",
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_ARENAS="main")
 
     # After upstream commit: (glibc-2.25.90-688-gd5c3fafc43) glibc has a
     # new per-thread caching mechanism that will NOT allow heapshrink test to
@@ -697,6 +715,64 @@ def functional_tests():
                           HUGETLB_MORECORE="yes",
                           HUGETLB_MORECORE_SHRINK="yes")
 
+    do_test_with_pagesize(system_default_hpage_size, "heap_reserve",
+                          skip=morecore_disabled,
+                          LD_PRELOAD="libhugetlbfs.so",
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_RESERVE="256M")
+    # The heap outgrows a reservation smaller than its large allocation
+    do_test_with_pagesize(system_default_hpage_size, "heap_reserve",
+                          skip=morecore_disabled,
+                          LD_PRELOAD="libhugetlbfs.so",
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_RESERVE="16M")
+    do_test_with_pagesize(system_default_hpage_size, "heapshrink",
+                          skip=morecore_disabled,
+                          GLIBC_TUNABLES="glibc.malloc.tcache_count=0",
+                          LD_PRELOAD="libhugetlbfs.so libheapshrink.so",
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_SHRINK="yes",
+                          HUGETLB_MORECORE_RESERVE="256M")
+    do_test_with_pagesize(system_default_hpage_size, "morecore_growth",
+                          skip=morecore_disabled,
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_GROWTH="geometric:2,64M")
+    do_test_with_pagesize(system_default_hpage_size, "morecore_growth",
+                          skip=morecore_disabled,
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_SHRINK="yes",
+                          HUGETLB_MORECORE_GROWTH="geometric")
+    do_test_with_pagesize(system_default_hpage_size, "heap_release",
+                          skip=morecore_disabled,
+                          HUGETLB_MORECORE="yes")
+    do_test_with_pagesize(system_default_hpage_size, "heap_release",
+                          skip=morecore_disabled,
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_SHRINK="yes")
+    for numa in ("interleave", "local", "node:0"):
+        do_test_with_pagesize(system_default_hpage_size, "morecore_numa",
+                              skip=morecore_disabled,
+                              HUGETLB_MORECORE="yes",
+                              HUGETLB_MORECORE_NUMA=numa)
+    do_test_with_pagesize(system_default_hpage_size, "heap_backoff",
+                          skip=morecore_disabled,
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_BACKOFF="20")
+    do_test_with_pagesize(system_default_hpage_size, "heap_prealloc",
+                          skip=morecore_disabled,
+                          HUGETLB_MORECORE="yes",
+                          HUGETLB_MORECORE_SHRINK="yes",
+                          HUGETLB_MORECORE_PREALLOC="32M,lock")
+    do_test("heap_prealloc", HUGETLB_MORECORE="thp",
+            HUGETLB_MORECORE_PREALLOC="32M,lock")
+    for method in ("auto", "memcpy", "sse2", "avx2", "avx512"):
+        do_test_with_pagesize(system_default_hpage_size, "heap_copy",
+                              skip=morecore_disabled,
+                              HUGETLB_MORECORE="yes",
+                              HUGETLB_COPY_METHOD=method)
+    do_test("thp_morecore", HUGETLB_MORECORE="thp")
+    do_test("thp_morecore", HUGETLB_MORECORE="thp", HUGETLB_THP_COLLAPSE="yes")
+
     do_test("heap-overflow", skip=morecore_disabled, HUGETLB_VERBOSE="1",
             HUGETLB_MORECORE="yes")
 
@@ -714,8 +790,22 @@ def functional_tests():
 
     # elflink_rw tests
     elflink_rw_test("linkhuge_rw")
+    elflink_rw_test("linkhuge_rw", HUGETLB_ELFMAP_THREADS="1")
     # elflink_rw sharing tests
     elflink_rw_and_share_test("linkhuge_rw")
+    do_test_with_pagesize(system_default_hpage_size, "linkshare_buildid")
+
+    # Shared library remapping, after dlopen() and at startup
+    dlopen_preload = {"LD_PRELOAD": "libhugetlbfs_dlopen.so"}
+    for env in ({}, dlopen_preload, {"LD_PRELOAD": "libelfmaplib.so"},
+                dict(dlopen_preload, HUGETLB_ELFMAP="R"),
+                dict(dlopen_preload, HUGETLB_SHARE="1")):
+        do_test_with_pagesize(system_default_hpage_size, "elfmap_libs",
+                              HUGETLB_ELFMAP_LIBS="*elfmaplib*", **env)
+    clear_hpages()
+    do_test("elfmap_thp", HUGETLB_ELFMAP="thp")
+    do_test("elfmap_thp", HUGETLB_ELFMAP="thp", HUGETLB_ELFMAP_LIBS="*elfmaplib*",
+            **dlopen_preload)
 
     # Accounting bug tests
     # reset free hpages because sharing will have held some
@@ -728,6 +818,18 @@ def functional_tests():
 
     # Test direct allocation API
     do_test("get_huge_pages")
+    do_test("get_huge_pages_onnode")
+    do_test("prefault_threads")
+    do_test("prefault_threads", HUGETLB_PREFAULT_THREADS="4")
+    do_test("prefault_threads", HUGETLB_PREFAULT_THREADS="4",
+            HUGETLB_PREFAULT_METHOD="readv")
+    do_test("prefault_async")
+    do_test("prefault_async", HUGETLB_PREFAULT_RATE=repr(256 * 1024 * 1024),
+            HUGETLB_NO_RESERVE="yes")
+    do_test("stats")
+    do_test("arena")
+    do_test("region_cache",
+            HUGETLB_REGION_CACHE=repr(4 * system_default_hpage_size))
 
     # Test overriding of shmget()
     do_shm_test("shmoverride_linked")
@@ -783,13 +885,22 @@ def stress_tests():
 
     do_test("fallocate_stress.sh")
 
+def bench_tests():
+    """
+    Run the set of benchmarks. These always pass unless something breaks,
+    the interesting part is the timings they print.
+    """
+    do_test("arena_bench")
+    do_test("prefault_bench")
+    do_test("elflink_bench")
+
 def print_help():
     print("Usage: %s [options]" % sys.argv[0])
     print("Options:")
     print("  -v	\t Verbose output.")
     print("  -V	\t Highly verbose output.")
     print("  -f	\t Force all tests.")
-    print("  -t <set> 	 Run test set, allowed are func and stress.")
+    print("  -t <set> 	 Run test set, allowed are func, stress and bench.")
     print("  -b <wordsize>  Define wordsizes to be used. ")
     print("  -p <pagesize>  Define the page sizes to be used.")
     print("  -c	\t Do a paranoid pool check.")
@@ -858,6 +969,7 @@ def main():
 
     if "func" in testsets: functional_tests()
     if "stress" in testsets: stress_tests()
+    if "bench" in testsets: bench_tests()
 
     results_summary()
 
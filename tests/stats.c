@@ -0,0 +1,111 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Check that hugetlbfs_get_stats() counts allocations and frees by page
+ * size, prefaults done on the library's own threads, and regions from
+ * get_hugepage_region() that fell back to smaller pages.
+ */
+#define NR_HPAGES	4
+
+long hpage_size;
+
+void cleanup(void)
+{
+}
+
+static void get_stats(struct hugetlbfs_stats *s)
+{
+	if (hugetlbfs_get_stats(s, sizeof(*s)) != 0)
+		FAIL("hugetlbfs_get_stats(): %s", strerror(errno));
+}
+
+int main(int argc, char *argv[])
+{
+	struct hugetlbfs_stats before, after;
+	unsigned long long short_stats[2];
+	unsigned long long sum;
+	long nr_free;
+	int shift, i;
+	void *p;
+
+	test_init(argc, argv);
+
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(NR_HPAGES);
+	shift = __builtin_ctzl(hpage_size);
+
+	get_stats(&before);
+	p = get_huge_pages(NR_HPAGES * hpage_size,
+			   GHP_DEFAULT|GHP_ASYNC_PREFAULT);
+	if (!p)
+		FAIL("get_huge_pages(): %s", strerror(errno));
+	if (hugetlb_prefault_wait(p) != 0)
+		FAIL("hugetlb_prefault_wait(): %s", strerror(errno));
+	free_huge_pages(p);
+	get_stats(&after);
+
+	if (after.allocs[shift] != before.allocs[shift] + 1 ||
+	    after.frees[shift] != before.frees[shift] + 1)
+		FAIL("%llu allocs and %llu frees of %ld kB pages, expected 1",
+		     after.allocs[shift] - before.allocs[shift],
+		     after.frees[shift] - before.frees[shift],
+		     hpage_size / 1024);
+	if (after.prefaults == before.prefaults ||
+	    after.prefault_bytes - before.prefault_bytes !=
+			NR_HPAGES * hpage_size)
+		FAIL("Prefault of %ld bytes counted as %llu bytes",
+		     NR_HPAGES * hpage_size,
+		     after.prefault_bytes - before.prefault_bytes);
+	for (sum = 0, i = 0; i < HUGETLB_STATS_LATENCY_BUCKETS; i++)
+		sum += after.prefault_latency[i] - before.prefault_latency[i];
+	if (sum != after.prefaults - before.prefaults)
+		FAIL("Latency histogram holds %llu of %llu prefaults", sum,
+		     after.prefaults - before.prefaults);
+
+	/* More than the pool has must fall back to THP or base pages */
+	nr_free = get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+	before = after;
+	p = get_hugepage_region((nr_free + 1) * hpage_size, GHR_FALLBACK);
+	if (!p)
+		FAIL("get_hugepage_region(GHR_FALLBACK): %s", strerror(errno));
+	free_hugepage_region(p);
+	get_stats(&after);
+	if (get_huge_page_counter(hpage_size, HUGEPAGES_OC) == 0 &&
+	    after.thp_fallbacks + after.base_fallbacks !=
+			before.thp_fallbacks + before.base_fallbacks + 1)
+		FAIL("Fallback not counted");
+
+	/* A short buffer is filled as far as it goes */
+	memset(short_stats, 0xff, sizeof(short_stats));
+	if (hugetlbfs_get_stats((void *)short_stats, sizeof(short_stats[0]))
+			!= 0 || short_stats[1] != ~0ULL)
+		FAIL("hugetlbfs_get_stats() wrote beyond size");
+
+	if (hugetlbfs_get_stats(NULL, sizeof(after)) == 0 || errno != EINVAL)
+		FAIL("hugetlbfs_get_stats(NULL) did not fail with EINVAL");
+
+	PASS();
+}
@@ -0,0 +1,82 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * hugetlbfs_get_stats() must report how much of the THP morecore heap is
+ * resident and on transparent hugepages. With HUGETLB_THP_COLLAPSE=yes
+ * every hugepage of the heap must be collapsed as soon as it is grown,
+ * which takes the heap starting on a hugepage boundary.
+ */
+#define THP_ENABLED	"/sys/kernel/mm/transparent_hugepage/enabled"
+#define THP_PMD_SIZE	"/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+#define NR_HPAGES	8
+
+int main(int argc, char *argv[])
+{
+	struct hugetlbfs_stats s;
+	char buf[64];
+	long thp_size;
+	size_t len;
+	FILE *f;
+	char *p;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE") ||
+	    strcmp(getenv("HUGETLB_MORECORE"), "thp"))
+		CONFIG("Needs HUGETLB_MORECORE=thp");
+
+	f = fopen(THP_ENABLED, "r");
+	if (!f || !fgets(buf, sizeof(buf), f) || strstr(buf, "[never]"))
+		CONFIG("Transparent hugepages are not enabled");
+	fclose(f);
+	f = fopen(THP_PMD_SIZE, "r");
+	if (!f || fscanf(f, "%ld", &thp_size) != 1)
+		CONFIG("No transparent hugepage size");
+	fclose(f);
+
+	len = NR_HPAGES * thp_size;
+	p = malloc(len);
+	if (!p)
+		FAIL("malloc(%zd)", len);
+	memset(p, 0, len);
+
+	if (hugetlbfs_get_stats(&s, sizeof(s)) != 0)
+		FAIL("hugetlbfs_get_stats(): %s", strerror(errno));
+	verbose_printf("%llu of %llu heap bytes on hugepages\n",
+		       s.thp_heap_huge, s.thp_heap_rss);
+	if (s.thp_heap_rss < len)
+		FAIL("Only %llu bytes of heap resident", s.thp_heap_rss);
+	if (s.thp_heap_huge > s.thp_heap_rss)
+		FAIL("More of the heap on hugepages than is resident");
+
+	if (getenv("HUGETLB_THP_COLLAPSE") && s.thp_heap_huge < len)
+		FAIL("Only %llu of %zd bytes were collapsed", s.thp_heap_huge,
+		     len);
+
+	free(p);
+	PASS();
+}